@@ -0,0 +1,131 @@
+#include <Arduino.h>
+
+#include <CircularBuffer.hpp>
+
+// Times moving data through a CircularBuffer one byte at a time, as
+// LRTPConnection used to, against the bulk and in-place region operations it
+// uses now. The heap-allocated buffer is sized like a connection's receive
+// buffer, and the fixed-capacity one like its transmit buffers. Needs no
+// radio: flash it and watch the serial port.
+
+// the size of a connection's receive buffer
+#define BUFFER_SZ (255 * 4)
+// the size of a connection's transmit buffers, LRTP_TX_DATA_BUFFER_SZ
+#define FIXED_BUFFER_SZ 1024
+// bytes moved per write or packet, as an application or a frame would
+#define CHUNK_SZ 200
+#define ROUNDS 2000
+
+CircularBuffer<uint8_t> heapBuffer(BUFFER_SZ);
+CircularBuffer<uint8_t, FIXED_BUFFER_SZ> fixedBuffer;
+uint8_t in[CHUNK_SZ];
+uint8_t out[CHUNK_SZ];
+// keeps the compiler from optimising the reads away
+volatile uint8_t sink = 0;
+
+void report(const char *name, unsigned long elapsed)
+{
+    const float bytes = (float)ROUNDS * CHUNK_SZ;
+    Serial.printf("%-10s %8lu us  %7.1f ns/byte\n", name, elapsed, elapsed * 1000.0f / bytes);
+}
+
+template <class Buffer>
+unsigned long runPerByte(Buffer &buffer)
+{
+    unsigned long start = micros();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (size_t i = 0; i < CHUNK_SZ; i++)
+        {
+            buffer.enqueue(in[i]);
+        }
+        for (size_t i = 0; i < CHUNK_SZ; i++)
+        {
+            out[i] = *buffer.dequeue();
+        }
+        sink ^= out[round % CHUNK_SZ];
+    }
+    return micros() - start;
+}
+
+template <class Buffer>
+unsigned long runBulk(Buffer &buffer)
+{
+    unsigned long start = micros();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        buffer.enqueue(in, CHUNK_SZ);
+        buffer.dequeue(out, CHUNK_SZ);
+        sink ^= out[round % CHUNK_SZ];
+    }
+    return micros() - start;
+}
+
+template <class Buffer>
+unsigned long runRegion(Buffer &buffer)
+{
+    unsigned long start = micros();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        // fill in place, as the receive path decompresses into the buffer
+        size_t written = 0;
+        size_t length;
+        uint8_t *region = buffer.writeRegion(length);
+        while (region != nullptr && written < CHUNK_SZ)
+        {
+            length = min(length, (size_t)(CHUNK_SZ - written));
+            memcpy(region, in + written, length);
+            buffer.commit(length);
+            written += length;
+            region = buffer.writeRegion(length);
+        }
+        // and read in place, without copying out
+        size_t read = 0;
+        region = buffer.readRegion(length);
+        while (region != nullptr && read < CHUNK_SZ)
+        {
+            length = min(length, (size_t)(CHUNK_SZ - read));
+            sink ^= region[length - 1];
+            buffer.consume(length);
+            read += length;
+            region = buffer.readRegion(length);
+        }
+    }
+    return micros() - start;
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while (!Serial)
+    {
+    }
+    for (size_t i = 0; i < CHUNK_SZ; i++)
+    {
+        in[i] = i;
+    }
+    // keep some bytes queued, so that the chunks move round the buffers and
+    // wrap around their ends like a connection's data does
+    size_t length;
+    heapBuffer.writeRegion(length);
+    heapBuffer.commit(BUFFER_SZ / 3);
+    fixedBuffer.writeRegion(length);
+    fixedBuffer.commit(FIXED_BUFFER_SZ / 3);
+}
+
+template <class Buffer>
+void runAll(Buffer &buffer)
+{
+    report("per byte", runPerByte(buffer));
+    report("bulk", runBulk(buffer));
+    report("region", runRegion(buffer));
+}
+
+void loop()
+{
+    Serial.printf("%d rounds of %d bytes through a %d byte heap buffer\n", ROUNDS, CHUNK_SZ, BUFFER_SZ);
+    runAll(heapBuffer);
+    Serial.printf("%d rounds of %d bytes through a %d byte fixed buffer\n", ROUNDS, CHUNK_SZ, FIXED_BUFFER_SZ);
+    runAll(fixedBuffer);
+    delay(5000);
+}
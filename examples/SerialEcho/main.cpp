@@ -9,7 +9,7 @@
 
 LRTP lrtp(1);
 
-std::shared_ptr<LRTPConnection> testCon = nullptr;
+LRTPConnectionHandle testCon = nullptr;
 
 unsigned long lastTx = 0;
 const unsigned long txEvery = 5000;
@@ -20,6 +20,8 @@ bool setupLoRa()
     SPI.begin(LORA_SCK, LORA_MISO, LORA_MOSI, LORA_CS);
     // setup LoRa transceiver module
     LoRa.setPins(LORA_CS, LORA_RST, LORA_IRQ);
+    // let LRTP write and read whole frames to the radio FIFO in one SPI burst
+    LRTPLoRaRadio::shared().setSPI(SPI, LORA_CS);
     return LoRa.begin(LORA_BAND);
 }
 
@@ -27,16 +29,23 @@ void setupLoRaConfig()
 {
     // set LORA parameters
     LoRa.setSyncWord(LORA_SYNC_WORD);
+    // modulation parameters are set through LRTP's radio so that it can
+    // compute frame airtimes
+    LRTPRadioConfig config;
+    config.frequency = LORA_BAND;
 #ifdef LORA_CRC
-    LoRa.enableCrc();
+    config.crc = true;
+#else
+    config.crc = false;
 #endif
-    LoRa.setSpreadingFactor(LORA_SPREADING_FACTOR);
-    LoRa.setCodingRate4(LORA_CODING_RATE);
-    LoRa.setPreambleLength(LORA_PREAMBLE_LENGTH);
-    LoRa.setSignalBandwidth(LORA_SIGNAL_BANDWIDTH);
+    config.spreadingFactor = LORA_SPREADING_FACTOR;
+    config.codingRate4 = LORA_CODING_RATE;
+    config.preambleLength = LORA_PREAMBLE_LENGTH;
+    config.signalBandwidth = LORA_SIGNAL_BANDWIDTH;
+    LRTPLoRaRadio::shared().setConfig(config);
 }
 
-void newConnection(std::shared_ptr<LRTPConnection> connection)
+void newConnection(LRTPConnectionHandle connection)
 {
     Serial.printf("New connection from node %u!\n", connection->getRemoteAddr());
     testCon = connection;
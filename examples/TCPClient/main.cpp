@@ -21,7 +21,7 @@ const char *password = "YOUR_PASSWORD";
 LRTP lrtp(2);
 
 // store a reference to the currently connected node's connection
-std::shared_ptr<LRTPConnection> testCon = nullptr;
+LRTPConnectionHandle testCon = nullptr;
 
 // Use WiFiClient class to create TCP connections
 WiFiClient tcpClient;
@@ -72,6 +72,8 @@ bool setupLoRa()
 #endif
     // setup LoRa transceiver module
     LoRa.setPins(LORA_SS, LORA_RST, LORA_DIO0);
+    // let LRTP write and read whole frames to the radio FIFO in one SPI burst
+    LRTPLoRaRadio::shared().setSPI(SPI, LORA_SS);
     return LoRa.begin(LORA_BAND);
 }
 
@@ -79,20 +81,27 @@ void setupLoRaConfig()
 {
     // set LORA parameters
     LoRa.setSyncWord(LORA_SYNC_WORD);
+    // modulation parameters are set through LRTP's radio so that it can
+    // compute frame airtimes
+    LRTPRadioConfig config;
+    config.frequency = LORA_BAND;
 #ifdef LORA_CRC
-    LoRa.enableCrc();
+    config.crc = true;
+#else
+    config.crc = false;
 #endif
-    LoRa.setSpreadingFactor(LORA_SPREADING_FACTOR);
-    LoRa.setCodingRate4(LORA_CODING_RATE);
-    LoRa.setPreambleLength(LORA_PREAMBLE_LENGTH);
-    LoRa.setSignalBandwidth(LORA_SIGNAL_BANDWIDTH);
+    config.spreadingFactor = LORA_SPREADING_FACTOR;
+    config.codingRate4 = LORA_CODING_RATE;
+    config.preambleLength = LORA_PREAMBLE_LENGTH;
+    config.signalBandwidth = LORA_SIGNAL_BANDWIDTH;
+    LRTPLoRaRadio::shared().setConfig(config);
 }
 void newPacket()
 {
     Serial.println("[LRTP] Packet was received!\n");
 }
 
-void newConnection(std::shared_ptr<LRTPConnection> connection)
+void newConnection(LRTPConnectionHandle connection)
 {
     Serial.printf("[LRTP] New connection from %u!\n", connection->getRemoteAddr());
     connection->onDataReceived(newPacket);
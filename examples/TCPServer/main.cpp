@@ -9,7 +9,6 @@
 #include <LRTP.hpp>
 
 #define MAX_TELNET_BUF 247
-#define TELNET_BUFFER_DUR 750
 
 // Port to open the TCP socket on
 #define TCP_PORT 8023
@@ -23,13 +22,10 @@ const char *password = "PASSWORD_HERE";
 WiFiServer server(TCP_PORT);
 WiFiClient serverClients[MAX_SRV_CLIENTS];
 
-size_t lastTelnetAvailable = 0;
-unsigned long lastTelnetRead = 0;
-
 // this node has address 1
 LRTP lrtp(1);
 
-std::shared_ptr<LRTPConnection> testCon = nullptr;
+LRTPConnectionHandle testCon = nullptr;
 
 void setupWifi()
 {
@@ -56,6 +52,8 @@ bool setupLoRa()
 #endif
     // setup LoRa transceiver module
     LoRa.setPins(LORA_SS, LORA_RST, LORA_DIO0);
+    // let LRTP write and read whole frames to the radio FIFO in one SPI burst
+    LRTPLoRaRadio::shared().setSPI(SPI, LORA_SS);
     return LoRa.begin(LORA_BAND);
 }
 
@@ -63,13 +61,20 @@ void setupLoRaConfig()
 {
     // set LORA parameters
     LoRa.setSyncWord(LORA_SYNC_WORD);
+    // modulation parameters are set through LRTP's radio so that it can
+    // compute frame airtimes
+    LRTPRadioConfig config;
+    config.frequency = LORA_BAND;
 #ifdef LORA_CRC
-    LoRa.enableCrc();
+    config.crc = true;
+#else
+    config.crc = false;
 #endif
-    LoRa.setSpreadingFactor(LORA_SPREADING_FACTOR);
-    LoRa.setCodingRate4(LORA_CODING_RATE);
-    LoRa.setPreambleLength(LORA_PREAMBLE_LENGTH);
-    LoRa.setSignalBandwidth(LORA_SIGNAL_BANDWIDTH);
+    config.spreadingFactor = LORA_SPREADING_FACTOR;
+    config.codingRate4 = LORA_CODING_RATE;
+    config.preambleLength = LORA_PREAMBLE_LENGTH;
+    config.signalBandwidth = LORA_SIGNAL_BANDWIDTH;
+    LRTPLoRaRadio::shared().setConfig(config);
 }
 // handler attached to the LRTP::onDataReceived() callback
 void newPacket()
@@ -77,7 +82,7 @@ void newPacket()
     Serial.println("Packet was received!\n");
 }
 
-void newConnection(std::shared_ptr<LRTPConnection> connection)
+void newConnection(LRTPConnectionHandle connection)
 {
     Serial.printf("New connection from %u!\n", connection->getRemoteAddr());
     connection->onDataReceived(newPacket);
@@ -99,6 +104,9 @@ void setup()
     setupLoRaConfig();
     lrtp.begin();
 
+    // this node accepts connections, so it listens at the base rate and
+    // adaptive rate (LRTP::setAdaptiveRate()) would not speed up the frames
+    // sent to it. It is left disabled
     lrtp.onConnect(newConnection);
 
     Serial.println("\nReady.");
@@ -145,20 +153,12 @@ void tcpLoop()
                 // read all data
                 if (serverClients[i].available())
                 {
-                    // get data from the TCP socket, whilst allowing it to buffer for a short time to prevent sending too many small packets
-                    unsigned long t = millis();
-                    if (serverClients[i].available() != lastTelnetAvailable)
-                    {
-                        lastTelnetRead = t;
-                        lastTelnetAvailable = serverClients[i].available();
-                    }
-                    if (t - lastTelnetRead >= TELNET_BUFFER_DUR)
-                    {
-                        Serial.printf("Sending: (%u) %u\n", i, serverClients[i].available());
-                        while (serverClients[i].available())
-                            testCon->write(serverClients[i].read());
-                        lastTelnetAvailable = 0;
-                    }
+                    // get data from the TCP socket. The connection gathers it
+                    // into full frames, so that it is not sent as many small
+                    // packets
+                    Serial.printf("Sending: (%u) %u\n", i, serverClients[i].available());
+                    while (serverClients[i].available() && testCon->availableForWrite() > 0)
+                        testCon->write(serverClients[i].read());
                 }
             }
         }
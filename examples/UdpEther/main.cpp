@@ -0,0 +1,60 @@
+#include <Arduino.h>
+
+#include <LRTP.h>
+
+// Runs LRTP over the simulated UDP multicast "ether" instead of a LoRa module.
+// Build this sketch for a host with an Arduino compatibility layer (or for an
+// ESP32, passing its WiFi address as the interface) and start several copies
+// with different NODE_ADDR values: they share one simulated LoRa channel.
+
+#ifndef NODE_ADDR
+#define NODE_ADDR 1
+#endif
+// the node that NODE_ADDR 2 and above connect to
+#define SERVER_ADDR 1
+
+// use the same modulation parameters as the hardware examples
+LRTPRadioConfig radioConfig;
+LRTPUdpRadio radio(radioConfig);
+
+LRTP lrtp(NODE_ADDR, radio);
+
+LRTPConnectionHandle testCon = nullptr;
+
+void newConnection(LRTPConnectionHandle connection)
+{
+    Serial.printf("New connection from node %u!\n", connection->getRemoteAddr());
+    testCon = connection;
+}
+
+void setup()
+{
+    Serial.begin(115200);
+
+    if (!lrtp.begin())
+    {
+        Serial.println("Failed to start UDP radio");
+    }
+    lrtp.onConnect(newConnection);
+
+    if (NODE_ADDR != SERVER_ADDR)
+    {
+        testCon = lrtp.connect(SERVER_ADDR);
+    }
+}
+
+void loop()
+{
+    lrtp.loop();
+    if (testCon != nullptr)
+    {
+        if (Serial.available() > 0 && testCon->availableForWrite() > 0)
+        {
+            testCon->write(Serial.read());
+        }
+        while (testCon->available() > 0)
+        {
+            Serial.write(testCon->read());
+        }
+    }
+}
@@ -2,23 +2,240 @@
 #include <Arduino.h>
 
 #define DEBUG 0
+
 /**
- * @brief Simple circular buffer implementation
+ * @brief Bulk operations shared by both CircularBuffer variants, written in
+ * terms of the region interface each one implements
+ *
+ * @tparam Derived the CircularBuffer that inherits them
+ * @tparam T base type of the circular buffer
+ */
+template <class Derived, class T>
+class CircularBufferBulk
+{
+public:
+    /**
+     * @brief Append up to n elements, as many as there is room for
+     *
+     * @return size_t the number of elements appended
+     */
+    size_t enqueue(const T *elems, size_t n)
+    {
+        size_t written = 0;
+        while (written < n)
+        {
+            size_t length;
+            T *region = self().writeRegion(length);
+            if (region == nullptr)
+            {
+                break;
+            }
+            length = min(length, n - written);
+            std::copy(elems + written, elems + written + length, region);
+            self().commit(length);
+            written += length;
+        }
+        return written;
+    };
+
+    /**
+     * @brief Remove up to n elements from the head, as many as there are
+     *
+     * @param elems the array to copy the elements to
+     * @return size_t the number of elements removed
+     */
+    size_t dequeue(T *elems, size_t n)
+    {
+        size_t read = 0;
+        while (read < n)
+        {
+            size_t length;
+            T *region = self().readRegion(length);
+            if (region == nullptr)
+            {
+                break;
+            }
+            length = min(length, n - read);
+            std::copy(region, region + length, elems + read);
+            self().consume(length);
+            read += length;
+        }
+        return read;
+    };
+
+private:
+    Derived &self()
+    {
+        return *static_cast<Derived *>(this);
+    };
+};
+
+/**
+ * @brief Circular buffer with its storage inline, for buffers whose size is
+ * known at compile time
+ *
+ * The head and tail are free running counts, masked to index the array, so no
+ * division is needed and the buffer holds no pointers into itself: it can be
+ * copied or moved as plain memory, and lives inside its owner with no
+ * separate allocation. It has the same interface as the heap-allocated
+ * CircularBuffer<T>.
  *
  * @tparam T base type of the circular buffer
+ * @tparam N capacity, must be a power of two. 0 selects the heap-allocated
+ * buffer whose capacity is set at run time
  */
+template <class T, size_t N = 0>
+class CircularBuffer : public CircularBufferBulk<CircularBuffer<T, N>, T>
+{
+    static_assert((N & (N - 1)) == 0, "CircularBuffer capacity must be a power of two");
+
+public:
+    using CircularBufferBulk<CircularBuffer<T, N>, T>::enqueue;
+    using CircularBufferBulk<CircularBuffer<T, N>, T>::dequeue;
+
+    constexpr CircularBuffer() : m_buffer(), m_head(0), m_tail(0){};
+
+    T *operator[](size_t i)
+    {
+        return &m_buffer[(m_head + i) & (N - 1)];
+    };
+
+    constexpr size_t size()
+    {
+        return N;
+    };
+
+    size_t count()
+    {
+        return m_tail - m_head;
+    };
+
+    bool enqueue(const T &elem)
+    {
+        T *slot = this->enqueueSlot();
+        if (slot == nullptr)
+        {
+            return false;
+        }
+        *slot = elem;
+        return true;
+    };
+
+    T *enqueueEmpty()
+    {
+        T *elem = this->enqueueSlot();
+        if (elem != nullptr)
+        {
+            // zero out the data
+            memset(elem, 0, sizeof(T));
+        }
+        return elem;
+    };
+
+    T *peek()
+    {
+        if (this->count() == 0)
+        {
+            return nullptr;
+        }
+        return &m_buffer[m_head & (N - 1)];
+    };
+
+    T *dequeue()
+    {
+        if (this->count() == 0)
+        {
+            return nullptr;
+        }
+        return &m_buffer[m_head++ & (N - 1)];
+    };
+
+    T *peekRegion(size_t offset, size_t &length)
+    {
+        if (offset >= this->count())
+        {
+            length = 0;
+            return nullptr;
+        }
+        const size_t index = (m_head + offset) & (N - 1);
+        length = min(this->count() - offset, N - index);
+        return &m_buffer[index];
+    };
+
+    T *readRegion(size_t &length)
+    {
+        const size_t head = m_head & (N - 1);
+        length = min(this->count(), N - head);
+        return length > 0 ? &m_buffer[head] : nullptr;
+    };
+
+    void consume(size_t n)
+    {
+        m_head += n;
+    };
+
+    T *writeRegion(size_t &length)
+    {
+        if (this->count() == 0)
+        {
+            m_head = 0;
+            m_tail = 0;
+        }
+        const size_t tail = m_tail & (N - 1);
+        length = min(N - this->count(), N - tail);
+        return length > 0 ? &m_buffer[tail] : nullptr;
+    };
+
+    void commit(size_t n)
+    {
+        m_tail += n;
+    };
+
+private:
+    T m_buffer[N];
+    size_t m_head;
+    size_t m_tail;
 
-// TODO: add enqueue(T* arr, size_t len); and T* dequeue(size_t len);
-//       to allow enqueue/dequeue mulptiple objects in one go
+    T *enqueueSlot()
+    {
+        if (this->count() >= N)
+        {
+            return nullptr;
+        }
+        if (this->count() == 0)
+        {
+            m_head = 0;
+            m_tail = 0;
+        }
+        return &m_buffer[m_tail++ & (N - 1)];
+    };
+};
+
+/**
+ * @brief Simple circular buffer implementation
+ *
+ * @tparam T base type of the circular buffer
+ */
 template <class T>
-class CircularBuffer
+class CircularBuffer<T, 0> : public CircularBufferBulk<CircularBuffer<T, 0>, T>
 {
 public:
+    using CircularBufferBulk<CircularBuffer<T, 0>, T>::enqueue;
+    using CircularBufferBulk<CircularBuffer<T, 0>, T>::dequeue;
+
     CircularBuffer(int maxCapacity) : m_maxCapacity(maxCapacity), m_count(0)
     {
         this->m_buffer = new T[maxCapacity];
     };
 
+    /**
+     * @brief Use storage owned by the caller instead of allocating it. The
+     * storage must outlive the buffer
+     *
+     * @param storage an array of maxCapacity elements
+     */
+    CircularBuffer(T *storage, size_t maxCapacity) : m_buffer(storage), m_maxCapacity(maxCapacity), m_count(0), m_owned(false){};
+
     CircularBuffer(CircularBuffer<T> const &copy)
     {
         m_count = copy.m_count;
@@ -36,7 +253,10 @@ public:
 #if DEBUG > 0
         Serial.println("CircularBuffer<T>: Destructor called");
 #endif
-        delete[] this->m_buffer;
+        if (this->m_owned)
+        {
+            delete[] this->m_buffer;
+        }
     };
 
     CircularBuffer<T> &operator=(CircularBuffer<T> rhs)
@@ -53,11 +273,12 @@ public:
     void swap(CircularBuffer<T> &s) noexcept
     {
         using std::swap;
-        swap(this.m_buffer, s.m_buffer);
-        swap(this.m_maxCapacity, s.m_maxCapacity);
-        swap(this.m_head, s.m_head);
-        swap(this.m_tail, s.m_tail);
-        swap(this.m_count, s.m_count);
+        swap(this->m_buffer, s.m_buffer);
+        swap(this->m_maxCapacity, s.m_maxCapacity);
+        swap(this->m_head, s.m_head);
+        swap(this->m_tail, s.m_tail);
+        swap(this->m_count, s.m_count);
+        swap(this->m_owned, s.m_owned);
     };
 
     // C++11
@@ -153,11 +374,99 @@ public:
         return elem;
     };
 
+    /**
+     * @brief Get the elements at the head that are contiguous in memory. If
+     * they wrap around the end of the array, the rest are returned by the next
+     * call, once these are consumed
+     *
+     * @param length set to the number of elements in the region
+     * @return T* the first element, or nullptr if the buffer is empty
+     */
+    T *readRegion(size_t &length)
+    {
+        if (this->m_count <= 0)
+        {
+            length = 0;
+            return nullptr;
+        }
+        length = min(this->m_count, this->m_maxCapacity - this->m_head);
+        return &this->m_buffer[this->m_head];
+    };
+
+    /**
+     * @brief Get the elements from offset places after the head that are
+     * contiguous in memory, without removing them. The elements stay where
+     * they are until they are dequeued
+     *
+     * @param length set to the number of elements in the region
+     * @return T* the element at offset, or nullptr if there are not that many
+     */
+    T *peekRegion(size_t offset, size_t &length)
+    {
+        if (offset >= this->m_count)
+        {
+            length = 0;
+            return nullptr;
+        }
+        const size_t index = (this->m_head + offset) % this->m_maxCapacity;
+        length = min(this->m_count - offset, this->m_maxCapacity - index);
+        return &this->m_buffer[index];
+    };
+
+    // remove n elements from the head, at most the length of the read region
+    void consume(size_t n)
+    {
+        this->m_head = (this->m_head + n) % this->m_maxCapacity;
+        this->m_count -= n;
+    };
+
+    /**
+     * @brief Get the free space after the tail that is contiguous in memory,
+     * to fill in place. If it wraps around the end of the array, the rest is
+     * returned by the next call, once this is committed
+     *
+     * @param length set to the number of elements that fit in the region
+     * @return T* the first free element, or nullptr if the buffer is full
+     */
+    T *writeRegion(size_t &length)
+    {
+        if (this->m_count >= this->m_maxCapacity)
+        {
+            length = 0;
+            return nullptr;
+        }
+        if (this->m_count == 0)
+        {
+            this->m_head = 0;
+            this->m_tail = 0;
+        }
+        // free space runs to the end of the array, or up to the head
+        if (this->m_tail >= this->m_head)
+        {
+            length = this->m_maxCapacity - this->m_tail;
+        }
+        else
+        {
+            length = this->m_head - this->m_tail;
+        }
+        return &this->m_buffer[this->m_tail];
+    };
+
+    // append the n elements filled in at the tail, at most the length of the
+    // write region
+    void commit(size_t n)
+    {
+        this->m_tail = (this->m_tail + n) % this->m_maxCapacity;
+        this->m_count += n;
+    };
+
 private:
     T *m_buffer = nullptr;
     size_t m_maxCapacity;
     size_t m_count;
 
-    int m_head = 0;
-    int m_tail = 0;
+    size_t m_head = 0;
+    size_t m_tail = 0;
+    // false if the storage belongs to the caller
+    bool m_owned = true;
 };
\ No newline at end of file
@@ -1,30 +1,67 @@
 #include "LRTP.h"
 
-LRTP::LRTP(uint16_t m_hostAddr) : m_hostAddr(m_hostAddr), m_currentLoRaState(LoRaState::IDLE_RECEIVE) {
+#if LRTP_RADIO_LORA
+LRTP::LRTP(uint16_t hostAddr) : LRTP(hostAddr, LRTPLoRaRadio::shared()) {
+}
+#endif
+
+LRTP::LRTP(uint16_t hostAddr, LRTPRadio &radio) : m_hostAddr(hostAddr), m_radio(radio), m_currentLoRaState(LoRaState::IDLE_RECEIVE), m_scheduler(radio), m_multicast(hostAddr, m_timers), m_router(hostAddr, m_timers) {
 }
 
-std::shared_ptr<LRTPConnection> LRTP::connect(uint16_t destAddr) {
-    std::shared_ptr<LRTPConnection> connection = nullptr;
+LRTPConnectionHandle LRTP::connect(uint16_t destAddr) {
+    LRTPLock lock(this);
     // check if connection exists
-    std::unordered_map<uint16_t, std::shared_ptr<LRTPConnection>>::const_iterator connection_iter = m_activeConnections.find(destAddr);
-    if (connection_iter != m_activeConnections.end()) {
-        connection = connection_iter->second;
-    } else {
-        connection = std::make_shared<LRTPConnection>(m_hostAddr, destAddr);
-        m_activeConnections[destAddr] = connection;
-        if (connection->getConnectionState() == LRTPConnState::CLOSED)
+    LRTPConnectionHandle connection = m_activeConnections.find(destAddr);
+    // a closed connection is replaced by a new one
+    if (connection && connection->getConnectionState() == LRTPConnState::CLOSED) {
+        removeConnection(*connection);
+        connection = nullptr;
+    }
+    if (!connection) {
+        connection = createConnection(destAddr);
+        if (connection && connection->getConnectionState() == LRTPConnState::CLOSED)
             connection->connect();
+    } else {
+        connection->setReleased(false);
     }
     return connection;
 }
 
-int LRTP::begin() {
+void LRTP::release(LRTPConnectionHandle connection) {
+    LRTPLock lock(this);
+    if (!connection)
+        return;
+    connection->close();
+    // freed by loop() once closed, so that this may be called from handlers
+    connection->setReleased(true);
+    m_reapPending = true;
+    wake();
+}
+
+int LRTP::begin(size_t maxConnections) {
+    if (!m_activeConnections.begin(maxConnections, m_rxBufferSize)) {
+        lrtp_debug("Error: could not allocate connection table");
+        return 0;
+    }
+    m_scheduler.reserve(maxConnections);
     // attach callbacks
-    LoRa.onReceive(std::bind(&LRTP::onLoRaPacketReceived, this, std::placeholders::_1));
-    LoRa.onTxDone(std::bind(&LRTP::onLoRaTxDone, this));
-    LoRa.onCadDone(std::bind(&LRTP::onLoRaCADDone, this, std::placeholders::_1));
-    LoRa.receive();
+    m_radio.onReceive(std::bind(&LRTP::onLoRaPacketReceived, this, std::placeholders::_1));
+    m_radio.onTxDone(std::bind(&LRTP::onLoRaTxDone, this));
+    m_radio.onCadDone(std::bind(&LRTP::onLoRaCADDone, this, std::placeholders::_1));
+    if (!m_radio.begin()) {
+        lrtp_debug("Error: could not start radio");
+        return 0;
+    }
+    m_radio.receive();
     m_currentLoRaState = LoRaState::IDLE_RECEIVE;
+    // scale channel access slots from the airtime of a full frame
+    m_channelAccess.setFrameAirtime(m_radio.airtime(LRTP_MAX_PACKET) / 1000);
+    m_multicast.setSlotTime(m_radio.airtime(LRTP_MAX_PACKET) / 1000);
+    // the configuration the radio starts with is the base rate
+    m_rateControl.begin(m_radio.getConfig());
+    m_rateTimer.setCallback(std::bind(&LRTP::onRateTimer, this));
+    if (m_rateControl.isEnabled())
+        m_timers.start(m_rateTimer, LRTP_RATE_UPDATE_INTERVAL, millis());
     return 1;
 }
 
@@ -33,7 +70,7 @@ int LRTP::begin() {
 // }
 
 // callback handlers
-void LRTP::onConnect(std::function<void(std::shared_ptr<LRTPConnection>)> callback) {
+void LRTP::onConnect(std::function<void(LRTPConnectionHandle)> callback) {
     _onConnect = callback;
 }
 
@@ -41,7 +78,154 @@ void LRTP::onBroadcastPacket(std::function<void(const LRTPPacket &)> callback) {
     _onBroadcastPacket = callback;
 }
 
+void LRTP::onMulticastReceived(std::function<void(const LRTPPacket &)> callback) {
+    m_multicast.onReceived(callback);
+}
+
+void LRTP::onWake(std::function<void(void)> callback) {
+    _onWake = callback;
+}
+
+void LRTP::wake() {
+    if (_onWake != nullptr)
+        _onWake();
+}
+
+void LRTP::lock() {
+    m_mutex.lock();
+}
+
+void LRTP::unlock() {
+    m_mutex.unlock();
+}
+
+const LRTPRxStats &LRTP::getRxStats() {
+    return m_rxStats;
+}
+
+LRTPChannelAccess &LRTP::getChannelAccess() {
+    return m_channelAccess;
+}
+
+LRTPDutyCycle &LRTP::getDutyCycle() {
+    return m_dutyCycle;
+}
+
+LRTPCapture &LRTP::getCapture() {
+    return m_capture;
+}
+
+void LRTP::setPromiscuous(bool enabled) {
+    m_addressFilter = !enabled;
+}
+
+LRTPRadio &LRTP::getRadio() {
+    return m_radio;
+}
+
+LRTPMulticast &LRTP::getMulticast() {
+    return m_multicast;
+}
+
+bool LRTP::joinGroup(uint16_t group) {
+    LRTPLock lock(this);
+    return m_multicast.joinGroup(group);
+}
+
+void LRTP::leaveGroup(uint16_t group) {
+    LRTPLock lock(this);
+    m_multicast.leaveGroup(group);
+}
+
+size_t LRTP::multicastWrite(uint16_t group, const uint8_t *buf, size_t len) {
+    LRTPLock lock(this);
+    size_t written = m_multicast.write(group, buf, len, millis());
+    if (written > 0)
+        wake();
+    return written;
+}
+
+void LRTP::setAdaptiveRate(bool enabled) {
+    m_rateControl.setEnabled(enabled);
+    if (enabled && m_accepting)
+        lrtp_infof("Rate: accepting connections, listening at the base rate\n");
+    if (enabled)
+        m_timers.start(m_rateTimer, LRTP_RATE_UPDATE_INTERVAL, millis());
+    else
+        m_rateTimer.cancel();
+}
+
+void LRTP::setAccepting(bool enabled) {
+    LRTPLock lock(this);
+    m_accepting = enabled;
+}
+
+LRTPRateControl &LRTP::getRateControl() {
+    return m_rateControl;
+}
+
+void LRTP::setForwarding(bool enabled) {
+    m_router.setEnabled(enabled, millis());
+}
+
+LRTPRouter &LRTP::getRouter() {
+    return m_router;
+}
+
+void LRTP::onRateTimer() {
+    // multicast, forwarded frames, beacons and the SYNs of new peers are sent
+    // at the base rate
+    m_rateControl.update(m_activeConnections, m_multicast.isActive() || m_router.isEnabled() || m_accepting, millis());
+    // jitter the interval, so that peers measuring each other do not switch
+    // rates at the same time and miss each other's reports
+    if (m_rateControl.isEnabled())
+        m_timers.start(m_rateTimer, random(LRTP_RATE_UPDATE_INTERVAL / 2, LRTP_RATE_UPDATE_INTERVAL * 3 / 2), millis());
+}
+
+bool LRTP::tuneRadio(const LRTPRadioConfig &config) {
+    const LRTPRadioConfig &current = m_radio.getConfig();
+    if (config.spreadingFactor == current.spreadingFactor && config.txPower == current.txPower)
+        return false;
+    m_radio.setConfig(config);
+    return true;
+}
+
+void LRTP::setAckAggregation(bool enabled) {
+    m_ackAggregation = enabled;
+}
+
+void LRTP::setCompactHeaders(bool enabled) {
+    m_compactHeaders = enabled;
+}
+
+void LRTP::setCompression(bool enabled) {
+    m_compression = enabled;
+}
+
+void LRTP::setForwardErrorCorrection(bool enabled) {
+    m_fec = enabled;
+}
+
+void LRTP::setSelectiveRepeat(bool enabled) {
+    m_selectiveRepeat = enabled;
+}
+
+bool LRTP::setReceiveBufferSize(size_t size) {
+    // the rings are allocated by begin()
+    if (m_activeConnections.capacity() > 0)
+        return false;
+    m_rxBufferSize = max(size, (size_t)LRTP_RX_BUFFER_MIN);
+    return true;
+}
+
+void LRTP::setCoalescing(size_t minFill, unsigned long maxDelay) {
+    m_coalesceFill = minFill;
+    m_coalesceDelay = maxDelay;
+}
+
 int LRTP::parsePacket(LRTPPacket *outPacket, uint8_t *buf, size_t len) {
+    if (len > 0 && (buf[0] & LRTP_COMPACT_FLAG))
+        return parseCompactPacket(outPacket, buf, len);
     if (len < LRTP_HEADER_SZ) {
         // not enough bytes in packet to parse header!
         lrtp_debug("not enough bytes in packet to parse header");
@@ -69,9 +253,60 @@ int LRTP::parsePacket(LRTPPacket *outPacket, uint8_t *buf, size_t len) {
     outPacket->dest = ntohs(destAddr_no);
     outPacket->seqNum = buf[6];
     outPacket->ackNum = buf[7];
+    // the selective ACK bitmap follows the header
+    const size_t headerLength = LRTP_HEADER_SZ + (outPacket->flags.sack ? LRTP_SACK_SZ : 0);
+    if (len < headerLength) {
+        lrtp_debug("not enough bytes in packet to parse SACK bitmap");
+        return 0;
+    }
+    outPacket->sackBitmap = outPacket->flags.sack ? buf[LRTP_HEADER_SZ] : 0;
     // set payload pointer to the start of the payload and compute payload length
-    outPacket->payload = buf + LRTP_HEADER_SZ;
-    outPacket->payloadLength = len - LRTP_HEADER_SZ;
+    outPacket->payload = buf + headerLength;
+    outPacket->payloadLength = len - headerLength;
+    outPacket->wrapPayload = nullptr;
+    outPacket->wrapLength = 0;
+    outPacket->compact = false;
+    outPacket->connectionId = 0;
+    return 1;
+}
+
+int LRTP::parseCompactPacket(LRTPPacket *outPacket, uint8_t *buf, size_t len) {
+    if (len < LRTP_COMPACT_ACK_SZ) {
+        lrtp_debug("not enough bytes in packet to parse compact header");
+        return 0;
+    }
+    outPacket->compact = true;
+    outPacket->wrapPayload = nullptr;
+    outPacket->wrapLength = 0;
+    outPacket->version = LRTP_DEFAULT_VERSION;
+    outPacket->payloadType = LRTP_DEFAULT_TYPE;
+    // the fin, ack and sack flags sit below the compact flag, SYN frames
+    // always have a full header
+    LRTP::parseHeaderFlags(&outPacket->flags, (buf[0] >> 0x04) & 0x07);
+    outPacket->ackWindow = buf[0] & 0x0f;
+    outPacket->connectionId = (buf[1] << 0x08) | buf[2];
+    // the receiver fills in the addresses from the connection
+    outPacket->src = 0;
+    outPacket->dest = 0;
+    const size_t sackLength = outPacket->flags.sack ? LRTP_SACK_SZ : 0;
+    if (len == LRTP_COMPACT_ACK_SZ + sackLength) {
+        // ACK only frame: the sequence number is left out
+        outPacket->seqNum = 0;
+        outPacket->ackNum = buf[3];
+        outPacket->sackBitmap = sackLength > 0 ? buf[LRTP_COMPACT_ACK_SZ] : 0;
+        outPacket->payload = buf + len;
+        outPacket->payloadLength = 0;
+        return 1;
+    }
+    if (len < LRTP_COMPACT_HEADER_SZ + sackLength) {
+        lrtp_debug("not enough bytes in packet to parse compact header");
+        return 0;
+    }
+    outPacket->seqNum = buf[3];
+    outPacket->ackNum = buf[4];
+    outPacket->sackBitmap = sackLength > 0 ? buf[LRTP_COMPACT_HEADER_SZ] : 0;
+    outPacket->payload = buf + LRTP_COMPACT_HEADER_SZ + sackLength;
+    outPacket->payloadLength = len - LRTP_COMPACT_HEADER_SZ - sackLength;
     return 1;
 }
 
@@ -80,25 +315,51 @@ void LRTP::handleIncomingPacket(const LRTPPacket &packet) {
     debug_print_packet(packet);
 
     // find connection pertaining to this packet
-    std::unordered_map<uint16_t, std::shared_ptr<LRTPConnection>>::const_iterator connection = m_activeConnections.find(packet.src);
-    if (connection == m_activeConnections.end()) {
+    LRTPConnection *connection = m_activeConnections.find(packet.src).get();
+    if (packet.payloadType == LRTP_TYPE_RATE) {
+        // rate reports are not part of the connection's sequence
+        if (connection != nullptr)
+            m_rateControl.handleReport(connection->getLink(), packet);
+        return;
+    }
+    if (packet.payloadType == LRTP_TYPE_PARITY || packet.payloadType == LRTP_TYPE_FEC_REPORT) {
+        if (connection != nullptr)
+            connection->handleFecPacket(packet);
+        return;
+    }
+    if (connection != nullptr && connection->getConnectionState() == LRTPConnState::CLOSED && packet.flags.syn) {
+        // the peer opens a new connection in place of the closed one
+        removeConnection(*connection);
+        connection = nullptr;
+    }
+    if (connection == nullptr) {
         // the source of the packet is not in our active connections!
         // it may be a new incoming connection, otherwise we should ignore it
         lrtp_debug("Source of packet not in active connections");
         return handleIncomingConnectionPacket(packet);
     }
     // pass the packet on to the connection:
-    return connection->second->handleIncomingPacket(packet);
+    connection->handleIncomingPacket(packet);
+    // print any protocol errors raised while handling the packet
+    if (connection->m_connectionError != LRTPError::NONE) {
+        lrtp_debugf("CONNECTION ERROR: code %u !\n", (int)connection->m_connectionError);
+        connection->m_connectionError = LRTPError::NONE;
+    }
 }
 
 void LRTP::handleIncomingConnectionPacket(const LRTPPacket &packet) {
     // lrtp_debugf("Handling Connection packet:\n");
 
-    if (packet.flags.syn && packet.payloadLength == 0) {
-        std::shared_ptr<LRTPConnection> newConnection = std::make_shared<LRTPConnection>(m_hostAddr, packet.src);
-
-        m_activeConnections[packet.src] = newConnection;
-
+    if (packet.flags.syn && (packet.payloadLength == 0 || packet.payloadType == LRTP_TYPE_OPTIONS)) {
+        if (!m_accepting) {
+            lrtp_debug("Not accepting connections, ignoring SYN");
+            return;
+        }
+        LRTPConnectionHandle newConnection = createConnection(packet.src);
+        if (!newConnection) {
+            lrtp_debug("Error: connection table full, ignoring SYN");
+            return;
+        }
         newConnection->handleIncomingPacket(packet);
         if (_onConnect != nullptr)
             _onConnect(newConnection);
@@ -108,6 +369,15 @@ void LRTP::handleIncomingConnectionPacket(const LRTPPacket &packet) {
 }
 
 void LRTP::handleIncomingBroadcastPacket(const LRTPPacket &packet) {
+    if (packet.payloadType == LRTP_TYPE_ACK_AGGREGATE) {
+        handleAggregateAck(packet);
+        return;
+    }
+    if (packet.payloadType == LRTP_TYPE_ROUTE_BEACON) {
+        if (m_router.isEnabled())
+            m_router.handleBeacon(packet, millis());
+        return;
+    }
     if (_onBroadcastPacket != nullptr)
         _onBroadcastPacket(packet);
 }
@@ -116,46 +386,191 @@ int LRTP::parseHeaderFlags(LRTPFlags *outFlags, uint8_t rawFlags) {
     outFlags->syn = (rawFlags >> 0x03) & 0x01;
     outFlags->fin = (rawFlags >> 0x02) & 0x01;
     outFlags->ack = (rawFlags >> 0x01) & 0x01;
+    outFlags->sack = rawFlags & 0x01;
     return 1;
 }
 
 uint8_t LRTP::packFlags(const LRTPFlags &flags) {
-    return (flags.syn << 0x03) | (flags.fin << 0x02) | (flags.ack << 0x01);
+    return (flags.syn << 0x03) | (flags.fin << 0x02) | (flags.ack << 0x01) | flags.sack;
 }
 
 void LRTP::loop() {
+    LRTPLock lock(this);
+
+    // let polled radio backends dispatch their events
+    m_radio.poll();
+
+    // fire expired connection timers, whatever the radio is doing
+    m_timers.advance(millis());
+
+    if (m_reapPending)
+        reapConnections();
+
+    // listen at our own rate again after sending to a peer at its rate
+    if (m_rateControl.isEnabled() && m_currentLoRaState == LoRaState::IDLE_RECEIVE && tuneRadio(m_rateControl.getListenConfig()))
+        m_radio.receive();
 
     loopReceive();
     loopTransmit();
 }
 
+unsigned long LRTP::nextDeadline() {
+    LRTPLock lock(this);
+
+    // events already waiting to be handled
+    if (m_rxFrames.count() > 0 || m_rxFrameEnded || m_cadBusyPending || m_txDonePending || m_currentLoRaState == LoRaState::CAD_FINISHED)
+        return 0;
+
+    unsigned long t = millis();
+    // polled radios report in microseconds, round up so that loop() does not
+    // run just before the event
+    unsigned long deadline = m_radio.pollDeadline();
+    if (deadline != LRTP_NO_DEADLINE)
+        deadline = (deadline + 999) / 1000;
+
+    deadline = min(deadline, m_timers.nextDeadline(t));
+
+    if (m_currentLoRaState == LoRaState::RECEIVE) {
+        unsigned long elapsed = t - m_timer_checkReceiveTimeout;
+        deadline = min(deadline, elapsed >= LORA_SIGNAL_TIMEOUT ? 0 : LORA_SIGNAL_TIMEOUT - elapsed);
+    } else if (m_currentLoRaState == LoRaState::IDLE_RECEIVE) {
+        if (m_scheduler.hasReady() || m_multicast.hasPending() || m_router.hasPending()) {
+            // a frame is waiting for its backoff or duty cycle budget
+            if (!m_channelAccess.canAttempt(t))
+                deadline = min(deadline, m_channelAccess.getBackoffEnd() - t);
+            else if (m_txDeferred)
+                deadline = min(deadline, m_dutyCycle.timeUntilAvailable(m_radio.getConfig().frequency, m_radio.getConfig().signalBandwidth, m_txDeferredAirtime, t));
+            else
+                deadline = 0;
+        }
+    }
+    // CAD and transmit complete through radio callbacks
+    return deadline;
+}
+
 void LRTP::loopReceive() {
-    // lrtp_debugf("Bytes Waiting: %u\n", m_loraRxBytesWaiting);
+    // a frame has ended, even if the ISR dropped it, so the channel is free
+    // again
+    if (m_rxFrameEnded) {
+        m_rxFrameEnded = false;
+        if (m_currentLoRaState == LoRaState::RECEIVE)
+            setState(LoRaState::IDLE_RECEIVE);
+    }
+    // drain every frame queued by the receive ISR
+    LRTPRawFrame *frame;
+    while ((frame = m_rxFrames.peek()) != nullptr) {
+        lrtp_debugf("LORA: Bytes Waiting: %u\n", frame->length);
+        processFrame(*frame);
+        m_rxFrames.release();
+    }
+}
 
-    if (m_loraRxBytesWaiting > 0) {
+void LRTP::handleAggregateAck(const LRTPPacket &packet) {
+    LRTPConnection *connection = m_activeConnections.find(packet.src).get();
+    if (connection == nullptr)
+        return;
+    // find the tuple addressed to this node
+    for (size_t i = 0; i + LRTP_ACK_AGGREGATE_TUPLE_SZ <= packet.payloadLength; i += LRTP_ACK_AGGREGATE_TUPLE_SZ) {
+        const uint8_t *tuple = packet.payload + i;
+        uint16_t addr = (tuple[0] << 0x08) | tuple[1];
+        if (addr == m_hostAddr) {
+            connection->handleAggregateAck(tuple[2], tuple[3]);
+            return;
+        }
+    }
+}
+
+bool LRTP::canAggregateAck(LRTPConnection &connection) {
+    // aggregate ACKs are sent at the base rate, only heard by peers listening
+    // at it, and are not relayed
+    if (!connection.owesAck() || (m_rateControl.isEnabled() && connection.getLink().peerRate != 0))
+        return false;
+    return m_router.nextHop(connection.getRemoteAddr(), millis()) == connection.getRemoteAddr();
+}
 
-        lrtp_debugf("LORA: Bytes Waiting: %u\n", m_loraRxBytesWaiting);
-        LRTPPacket pkt;
-        int parseResult = LRTP::parsePacket(&pkt, this->m_rxBuffer, m_loraRxBytesWaiting);
-        if (parseResult) {
-            if (pkt.dest == m_hostAddr) {
-                handleIncomingPacket(pkt);
-            } else if (pkt.dest == LRTP_BROADCAST_ADDR) {
-                handleIncomingBroadcastPacket(pkt);
+size_t LRTP::countOwedAcks() {
+    size_t count = 0;
+    for (size_t i = 0; i < m_activeConnections.capacity(); i++) {
+        LRTPConnection *connection = m_activeConnections.at(i);
+        if (connection != nullptr && canAggregateAck(*connection))
+            count++;
+    }
+    return count;
+}
 
-                lrtp_debug("Broadcast packet received! TODO Implement broadcast!\n");
+size_t LRTP::sendAggregateAck() {
+    size_t length = 0;
+    for (size_t i = 0; i < m_activeConnections.capacity() && length < sizeof(m_ackAggregatePayload); i++) {
+        LRTPConnection *connection = m_activeConnections.at(i);
+        if (connection == nullptr || !canAggregateAck(*connection))
+            continue;
+        uint16_t addr = connection->getRemoteAddr();
+        uint8_t *tuple = m_ackAggregatePayload + length;
+        tuple[0] = addr >> 0x08;
+        tuple[1] = addr & 0xff;
+        connection->takeAck(tuple[2], tuple[3]);
+        length += LRTP_ACK_AGGREGATE_TUPLE_SZ;
+    }
 
-            } else {
-                lrtp_debugf("Packet src: %u, dest: %u, was not addressed to me - ignored "
-                            "TODO: implement dump of entire LoRa packet\n",
-                    pkt.src,
-                    pkt.dest);
+    LRTPPacket packet = {};
+    packet.version = LRTP_DEFAULT_VERSION;
+    packet.payloadType = LRTP_TYPE_ACK_AGGREGATE;
+    packet.src = m_hostAddr;
+    packet.dest = LRTP_BROADCAST_ADDR;
+    packet.payload = m_ackAggregatePayload;
+    packet.payloadLength = length;
+    lrtp_infof("Sending aggregate ACK for %u connections\n", (unsigned int)(length / LRTP_ACK_AGGREGATE_TUPLE_SZ));
+    return sendPacket(packet);
+}
+
+void LRTP::processFrame(const LRTPRawFrame &frame) {
+    m_capture.record(LRTP_CAPTURE_RX, frame.data, frame.length, frame.timestamp, frame.rssi, frame.snr);
+
+    LRTPPacket pkt;
+    int parseResult = LRTP::parsePacket(&pkt, const_cast<uint8_t *>(frame.data), frame.length);
+    if (parseResult && pkt.compact) {
+        // find the connection the id was given to
+        LRTPConnection *connection = findConnectionById(pkt.connectionId);
+        if (connection == nullptr) {
+            lrtp_debugf("Compact packet for unknown connection %04X - ignored\n", pkt.connectionId);
+            return;
+        }
+        connection->resolveCompactPacket(pkt, frame.length == LRTP_COMPACT_ACK_SZ + (pkt.flags.sack ? LRTP_SACK_SZ : 0));
+    }
+    if (parseResult) {
+        // true if the frame was relayed to us, so its signal is not the origin's
+        bool relayed = false;
+        if (m_router.isEnabled() && (pkt.dest == m_hostAddr || pkt.dest == LRTP_BROADCAST_ADDR)) {
+            unsigned long t = millis();
+            m_router.onNeighborHeard(pkt.src, t);
+            if (pkt.dest == m_hostAddr && pkt.payloadType == LRTP_TYPE_FORWARD) {
+                // relay the frame, or unwrap it if it has reached us
+                const uint8_t *inner;
+                size_t innerLength;
+                if (!m_router.handleForward(pkt, inner, innerLength, t) || !LRTP::parsePacket(&pkt, const_cast<uint8_t *>(inner), innerLength))
+                    return;
+                relayed = true;
             }
+        }
+        // any frame heard from a peer, aggregate ACKs included, renews its
+        // rate lease
+        if (m_rateControl.isEnabled() && !relayed && (pkt.dest == m_hostAddr || pkt.dest == LRTP_BROADCAST_ADDR)) {
+            LRTPConnection *connection = m_activeConnections.find(pkt.src).get();
+            if (connection != nullptr)
+                m_rateControl.onFrameReceived(connection->getLink(), frame.rssi, frame.snr, frame.spreadingFactor, millis());
+        }
+        if (pkt.dest == m_hostAddr) {
+            handleIncomingPacket(pkt);
+        } else if (pkt.dest == LRTP_BROADCAST_ADDR) {
+            handleIncomingBroadcastPacket(pkt);
+        } else if (m_multicast.accepts(pkt.dest)) {
+            m_multicast.handlePacket(pkt, millis());
         } else {
-            lrtp_debug("ERROR: Could not parse packet!");
+            // captured above when in promiscuous mode
+            lrtp_debugf("Packet src: %u, dest: %u, was not addressed to me - ignored\n", pkt.src, pkt.dest);
         }
-        m_loraRxBytesWaiting = 0;
-        setState(LoRaState::IDLE_RECEIVE);
+    } else {
+        lrtp_debug("ERROR: Could not parse packet!");
     }
 }
 
@@ -164,6 +579,17 @@ void LRTP::loopTransmit() {
     // debug("LORA loopTransmit()");
     unsigned long t = millis();
 
+    // the CAD ISR found the channel busy: back off before the next attempt
+    if (m_cadBusyPending) {
+        m_cadBusyPending = false;
+        m_channelAccess.onChannelBusy(m_txPriority, t);
+    }
+    // the TX done ISR reported the last frame sent
+    if (m_txDonePending) {
+        m_txDonePending = false;
+        m_channelAccess.onTransmitted(m_txPriority);
+    }
+
     // TODO: Investigate:
     //// Step 1: Process transmissions
     //
@@ -190,43 +616,87 @@ void LRTP::loopTransmit() {
 
     //  if radio is currently idle, get the next packet to send, if it exists
     if (m_currentLoRaState == LoRaState::IDLE_RECEIVE) {
-        if (m_activeConnections.size() > 0) {
-            // loop round-robin through the current connections, until we find a
-            // connection which has a packet ready for transmit
-            static std::unordered_map<uint16_t, std::shared_ptr<LRTPConnection>>::const_iterator txTarget = m_activeConnections.begin();
-
-            while (txTarget != m_activeConnections.end()) {
-                if (!txTarget->second) {
-
-                    lrtp_debug("NULL POINTER!");
-                    continue;
-                }
-                // check if the connection has closed
-                if (txTarget->second->getConnectionState() == LRTPConnState::CLOSED) {
-                    lrtp_debug("Warning: Connection has closed");
+        // the scheduler keeps returning the same connection until its frame
+        // has been sent, so a deferred frame keeps its turn
+        LRTPConnection *txTarget = m_scheduler.select();
+        // frames that don't belong to a connection: forwarded frames go before
+        // multicast frames of the same priority
+        TxSource engine = TxSource::CONNECTION;
+        LRTPPriority enginePriority = LRTPPriority::BULK;
+        if (m_router.hasPending()) {
+            engine = TxSource::FORWARD;
+            enginePriority = m_router.getTxPriority();
+        }
+        if (m_multicast.hasPending() && (engine == TxSource::CONNECTION || m_multicast.getTxPriority() < enginePriority)) {
+            engine = TxSource::MULTICAST;
+            enginePriority = m_multicast.getTxPriority();
+        }
+        // they go first when they have a higher priority than the connection
+        // frame, and take turns with connections of the same priority
+        TxSource source = TxSource::CONNECTION;
+        if (engine != TxSource::CONNECTION) {
+            if (txTarget == nullptr) {
+                source = engine;
+            } else {
+                LRTPPriority connectionPriority = txTarget->getTxPriority();
+                if (enginePriority < connectionPriority || (enginePriority == connectionPriority && m_engineTurn))
+                    source = engine;
+            }
+        }
+        if (txTarget || source != TxSource::CONNECTION) {
+            // wait for any pending backoff before sensing the channel again
+            if (!m_channelAccess.canAttempt(t))
+                return;
+            unsigned long airtime;
+            LRTPPriority priority;
+            // multicast, forwarded and aggregate ACK frames are sent at the
+            // base rate
+            LRTPRadioConfig txConfig = m_rateControl.getConfig(0, m_rateControl.getListenConfig().txPower);
+            m_txAggregateAck = false;
+            if (source == TxSource::MULTICAST) {
+                airtime = LRTPRadio::airtime(LRTP_HEADER_SZ + m_multicast.getNextTxPayloadLength(), txConfig);
+                priority = enginePriority;
+            } else if (source == TxSource::FORWARD) {
+                airtime = LRTPRadio::airtime(LRTP_HEADER_SZ + m_router.getNextTxPayloadLength(), txConfig);
+                priority = enginePriority;
+            } else {
+                priority = txTarget->getTxPriority();
+                // an ACK only frame is replaced by an aggregate ACK when other
+                // connections owe ACKs too
+                if (m_ackAggregation && canAggregateAck(*txTarget)) {
+                    size_t owed = countOwedAcks();
+                    if (owed >= LRTP_ACK_AGGREGATE_MIN) {
+                        m_txAggregateAck = true;
+                        airtime = LRTPRadio::airtime(LRTP_HEADER_SZ + min(owed, (size_t)LRTP_ACK_AGGREGATE_MAX) * LRTP_ACK_AGGREGATE_TUPLE_SZ, txConfig);
+                    }
                 }
-                // print any IRQ errors
-                if (txTarget->second->m_connectionError != LRTPError::NONE) {
-                    lrtp_debugf("IRQ ERROR: code %u ! (previous errors that occured since the "
-                                "last check may have been missed)\n",
-                        (int)txTarget->second->m_connectionError);
-                    txTarget->second->m_connectionError = LRTPError::NONE;
+                if (!m_txAggregateAck) {
+                    size_t length = LRTP_HEADER_SZ + txTarget->getNextTxPayloadLength();
+                    if (m_router.nextHop(txTarget->getRemoteAddr(), t) != txTarget->getRemoteAddr())
+                        length += LRTP_FORWARD_OVERHEAD;
+                    else
+                        txConfig = m_rateControl.getTxConfig(txTarget->getLink(), t);
+                    airtime = LRTPRadio::airtime(length, txConfig);
                 }
-                // update each connection
-                txTarget->second->updateTimers(t);
-
-                if (txTarget->second->isReadyForTransmit()) {
-                    lrtp_info("Ready for transmit. Starting CAD");
-                    m_nextConnectionForTransmit = txTarget->second;
-                    beginCAD();
-                    break;
+            }
+            // defer the frame until its sub-band's duty cycle budget allows it
+            if (!m_dutyCycle.canTransmit(m_radio.getConfig().frequency, m_radio.getConfig().signalBandwidth, airtime, t)) {
+                if (!m_txDeferred) {
+                    lrtp_info("Duty cycle budget exhausted, deferring transmit");
+                    m_dutyCycle.onDeferred();
+                    m_txDeferred = true;
                 }
-                // move iterator forward to the next conenction in the map
-                ++txTarget;
+                m_txDeferredAirtime = airtime;
+                return;
             }
-            // loop back to the beginning if we reach the end of the map
-            if (txTarget == m_activeConnections.end())
-                txTarget = m_activeConnections.begin();
+            m_txDeferred = false;
+            lrtp_info("Ready for transmit. Starting CAD");
+            m_txSource = source;
+            m_nextConnectionForTransmit = source == TxSource::CONNECTION ? txTarget : nullptr;
+            // sense the channel and send at the rate the frame is sent at
+            if (m_rateControl.isEnabled())
+                tuneRadio(txConfig);
+            beginCAD(priority);
         }
     } else if (m_currentLoRaState == LoRaState::CAD_FINISHED) {
         handleCADDone(t);
@@ -235,21 +705,24 @@ void LRTP::loopTransmit() {
     }
 }
 
-bool LRTP::beginCAD() {
+bool LRTP::beginCAD(LRTPPriority priority) {
 
     lrtp_info("beginCAD");
 
+    m_txPriority = priority;
+
     // check if the radio is receiving a packet
-    bool channelFree = !LoRa.rxSignalDetected();
+    bool channelFree = !m_radio.rxSignalDetected();
     if (channelFree) {
         setState(LoRaState::CAD_STARTED);
         // set CAD counter
-        m_cadRoundsRemaining = LRTP_CAD_ROUNDS;
+        m_cadRoundsRemaining = m_channelAccess.getParams(priority).cadRounds;
+        m_channelAccess.onAttempt();
         // put the radio into CAD mode only if we're not mid-way through receiveing
         // a packet
         lrtp_debug("beginCAD - Channel Free");
 
-        LoRa.channelActivityDetection();
+        m_radio.channelActivityDetection();
     } else {
         m_checkReceiveRounds = LORA_SIGNAL_TIMEOUT_ROUNDS;
         setState(LoRaState::RECEIVE);
@@ -259,77 +732,72 @@ bool LRTP::beginCAD() {
     return channelFree;
 }
 
-std::vector<uint8_t> LRTP::preparePacket(const LRTPPacket &packet) {
-
-#ifdef LRTP_DEBUG
-    // lrtp_debugf("Sending Packet. length: %d. Src: %d, Dest: %u Seq: %u, Ack:
-    // %u\n",
-    //        packet.payloadLength, packet.src, packet.dest, packet.seqNum,
-    //        packet.ackNum);
-#endif
-
-    char flagsStr[] = { packet.flags.syn ? 'S' : '-', packet.flags.fin ? 'F' : '-', packet.flags.ack ? 'A' : '-', 0 };
-    lrtp_infof("PREPARE PACKET: length: %d, src: %d, dest: %d, flags: %s, %u seq: %u, ack: %u\n",
-        packet.payloadLength,
-        packet.src,
-        packet.dest,
-        flagsStr,
-        packet.seqNum,
-        packet.ackNum);
-
-    setState(LoRaState::TRANSMIT);
-
+size_t LRTP::preparePacket(const LRTPPacket &packet, uint8_t *buf, size_t len) {
+    if (packet.compact)
+        return prepareCompactPacket(packet, buf, len);
+    const size_t headerLength = LRTP_HEADER_SZ + (packet.flags.sack ? LRTP_SACK_SZ : 0);
+    const size_t frameLength = headerLength + packet.payloadLength;
+    if (frameLength > len) {
+        lrtp_debugf("Error: packet of %u bytes does not fit in frame buffer\n", frameLength);
+        return 0;
+    }
     // pack the version and type into a single byte. shift version left by 4 bits
     // and OR with the lower 4 bits of the payload type
-    uint8_t verAndType = (packet.version << 0x04) | (packet.payloadType & 0x0f);
+    buf[0] = (packet.version << 0x04) | (packet.payloadType & 0x0f);
     // pack the flags and acknowledgment window into a single byte. shift flag
     // bits left by 4 bits and OR with the lower 4 bits of the acknowledgment
     // window size
-    uint8_t flagsAndWindow = (packFlags(packet.flags) << 0x04) | (packet.ackWindow & 0x0f);
-    // convert src and dest addresses from host to network order (big-endian)
-    uint16_t src_addr = htons(packet.src);
-    uint16_t dest_addr = htons(packet.dest);
-    // now take higher and lower bytes of the 16 bit addresses
-    uint8_t src_lo = src_addr >> 0x08;
-    uint8_t src_hi = src_addr & 0xff;
-    uint8_t dest_lo = dest_addr >> 0x08;
-    uint8_t dest_hi = dest_addr & 0xff;
-
-    /*
-    // write packet data in order specified by the specification
-    LoRa.beginPacket();
-    LoRa.write(verAndType);
-    LoRa.write(flagsAndWindow);
-    LoRa.write(src_hi);
-    LoRa.write(src_lo);
-    LoRa.write(dest_hi);
-    LoRa.write(dest_lo);
-    LoRa.write(packet.seqNum);
-    LoRa.write(packet.ackNum);
+    buf[1] = (packFlags(packet.flags) << 0x04) | (packet.ackWindow & 0x0f);
+    // src and dest addresses in network order (big-endian)
+    buf[2] = packet.src >> 0x08;
+    buf[3] = packet.src & 0xff;
+    buf[4] = packet.dest >> 0x08;
+    buf[5] = packet.dest & 0xff;
+    buf[6] = packet.seqNum;
+    buf[7] = packet.ackNum;
+    if (packet.flags.sack)
+        buf[LRTP_HEADER_SZ] = packet.sackBitmap;
     // write the actual payload:
-    LoRa.write(packet.payload, packet.payloadLength);
-    // call endPacket with true to use async mode
-    LoRa.endPacket(true);
-    */
-    std::vector<uint8_t> data(LRTP_HEADER_SZ + packet.payloadLength);
-
-    data[0] = verAndType;
-    data[1] = flagsAndWindow;
-    data[2] = src_hi;
-    data[3] = src_lo;
-    data[4] = dest_hi;
-    data[5] = dest_lo;
-    data[6] = packet.seqNum;
-    data[7] = packet.ackNum;
+    copyPayload(packet, buf + headerLength);
+    return frameLength;
+}
 
-    // TODO: write payload too
-    throw std::runtime_error("Unimplemented!");
+size_t LRTP::prepareCompactPacket(const LRTPPacket &packet, uint8_t *buf, size_t len) {
+    // frames carrying nothing but an ACK leave out the sequence number
+    const bool ackOnly = packet.payloadLength == 0 && packet.flags.ack && !packet.flags.fin;
+    const size_t sackLength = packet.flags.sack ? LRTP_SACK_SZ : 0;
+    const size_t headerLength = (ackOnly ? LRTP_COMPACT_ACK_SZ : LRTP_COMPACT_HEADER_SZ) + sackLength;
+    const size_t frameLength = headerLength + packet.payloadLength;
+    if (frameLength > len) {
+        lrtp_debugf("Error: packet of %u bytes does not fit in frame buffer\n", frameLength);
+        return 0;
+    }
+    buf[0] = LRTP_COMPACT_FLAG | ((packFlags(packet.flags) & 0x07) << 0x04) | (packet.ackWindow & 0x0f);
+    buf[1] = packet.connectionId >> 0x08;
+    buf[2] = packet.connectionId & 0xff;
+    if (ackOnly) {
+        buf[3] = packet.ackNum;
+    } else {
+        buf[3] = packet.seqNum;
+        buf[4] = packet.ackNum;
+    }
+    if (packet.flags.sack)
+        buf[headerLength - LRTP_SACK_SZ] = packet.sackBitmap;
+    copyPayload(packet, buf + headerLength);
+    return frameLength;
+}
 
-    return data;
+void LRTP::copyPayload(const LRTPPacket &packet, uint8_t *buf) {
+    // a payload that wraps around the end of a send buffer is in two pieces
+    const size_t length = packet.payloadLength - packet.wrapLength;
+    if (length > 0)
+        memcpy(buf, packet.payload, length);
+    if (packet.wrapLength > 0)
+        memcpy(buf + length, packet.wrapPayload, packet.wrapLength);
 }
 
-void LRTP::sendPacket(const LRTPPacket &packet) {
-    char flagsStr[] = { packet.flags.syn ? 'S' : '-', packet.flags.fin ? 'F' : '-', packet.flags.ack ? 'A' : '-', 0 };
+size_t LRTP::sendPacket(const LRTPPacket &packet) {
+    char flagsStr[] = { packet.flags.syn ? 'S' : '-', packet.flags.fin ? 'F' : '-', packet.flags.ack ? 'A' : '-', packet.flags.sack ? 'K' : '-', 0 };
 
     lrtp_infof("Sending Packet. length: %d, src: %d, dest: %u, flags: %s, seq: %u, ack: %u\n",
         packet.payloadLength,
@@ -339,37 +807,42 @@ void LRTP::sendPacket(const LRTPPacket &packet) {
         packet.seqNum,
         packet.ackNum);
 
+    // serialize the whole frame so that it can be written to the radio FIFO in
+    // a single burst
+    size_t frameLength = prepareTxFrame(packet);
+    if (frameLength == 0) {
+        setState(LoRaState::IDLE_RECEIVE);
+        m_radio.receive();
+        return 0;
+    }
+    m_capture.record(LRTP_CAPTURE_TX, m_txFrame, frameLength, micros(), 0, 0);
     setState(LoRaState::TRANSMIT);
+    m_dutyCycle.consume(m_radio.getConfig().frequency, m_radio.getConfig().signalBandwidth, m_radio.airtime(frameLength), millis());
 
-    // pack the version and type into a single byte. shift version left by 4 bits
-    // and OR with the lower 4 bits of the payload type
-    uint8_t verAndType = (packet.version << 0x04) | (packet.payloadType & 0x0f);
-    // pack the flags and acknowledgment window into a single byte. shift flag
-    // bits left by 4 bits and OR with the lower 4 bits of the acknowledgment
-    // window size
-    uint8_t flagsAndWindow = (packFlags(packet.flags) << 0x04) | (packet.ackWindow & 0x0f);
-    // convert src and dest addresses from host to network order (big-endian)
-    uint16_t src_addr = htons(packet.src);
-    uint16_t dest_addr = htons(packet.dest);
-    // now take higher and lower bytes of the 16 bit addresses
-    uint8_t src_lo = src_addr >> 0x08;
-    uint8_t src_hi = src_addr & 0xff;
-    uint8_t dest_lo = dest_addr >> 0x08;
-    uint8_t dest_hi = dest_addr & 0xff;
-    // write packet data in order specified by the specification
-    LoRa.beginPacket();
-    LoRa.write(verAndType);
-    LoRa.write(flagsAndWindow);
-    LoRa.write(src_hi);
-    LoRa.write(src_lo);
-    LoRa.write(dest_hi);
-    LoRa.write(dest_lo);
-    LoRa.write(packet.seqNum);
-    LoRa.write(packet.ackNum);
-    // write the actual payload:
-    LoRa.write(packet.payload, packet.payloadLength);
+    m_radio.beginPacket();
+    m_radio.write(m_txFrame, frameLength);
     // call endPacket with true to use async mode
-    LoRa.endPacket(true);
+    m_radio.endPacket(true);
+    return frameLength;
+}
+
+size_t LRTP::prepareTxFrame(const LRTPPacket &packet) {
+    // forwarded frames are already addressed to the next hop
+    uint16_t nextHop = packet.payloadType == LRTP_TYPE_FORWARD ? packet.dest : m_router.nextHop(packet.dest, millis());
+    if (nextHop == packet.dest)
+        return preparePacket(packet, m_txFrame, sizeof(m_txFrame));
+    // send the frame to the next hop as the payload of a FORWARD frame
+    size_t length = preparePacket(packet, m_txFrame + LRTP_FORWARD_OVERHEAD, sizeof(m_txFrame) - LRTP_FORWARD_OVERHEAD);
+    if (length == 0)
+        return 0;
+    LRTPPacket forward = {};
+    forward.version = LRTP_DEFAULT_VERSION;
+    forward.payloadType = LRTP_TYPE_FORWARD;
+    forward.src = m_hostAddr;
+    forward.dest = nextHop;
+    preparePacket(forward, m_txFrame, LRTP_HEADER_SZ);
+    m_router.prepareForward(m_txFrame + LRTP_HEADER_SZ);
+    return LRTP_FORWARD_OVERHEAD + length;
 }
 
 // handlers for LoRa async
@@ -378,24 +851,80 @@ void LRTP::onLoRaPacketReceived(int packetSize) {
 
     // lrtp_debugf("Received Packet of length: %d!\n", packetSize);
 
-    // read packet into buffer
-    uint8_t *bufferStart = this->m_rxBuffer;
-    // size_t rxMax = (LRTP_MAX_PACKET * LRTP_GLOBAL_RX_BUFFER_SZ) - 1;
-    while (LoRa.available() > 0) {
-        *(bufferStart++) = (uint8_t)LoRa.read();
+    readReceivedFrame(packetSize);
+    // the loop leaves RECEIVE whether or not the frame was kept
+    m_rxFrameEnded = true;
+    wake();
+}
+
+// ISR!
+void LRTP::readReceivedFrame(int packetSize) {
+    if (packetSize <= 0 || packetSize > LRTP_MAX_PACKET) {
+        m_rxStats.invalid++;
+        return;
+    }
+    LRTPRawFrame *frame = m_rxFrames.reserve();
+    if (frame == nullptr) {
+        // loopReceive() has not kept up, drop the frame
+        m_rxStats.overruns++;
+        return;
+    }
+    // read the address prefix first so that frames for other nodes can be
+    // dropped without reading their payload
+    size_t len = packetSize;
+    size_t pos = 0;
+    pos += m_radio.readBytes(frame->data, min(len, (size_t)LRTP_ADDR_PREFIX_SZ));
+    bool compact = pos > 0 && (frame->data[0] & LRTP_COMPACT_FLAG);
+    if (!compact && pos == LRTP_ADDR_PREFIX_SZ) {
+        // source address is big-endian in bytes 2-3
+        uint16_t src = (frame->data[2] << 0x08) | frame->data[3];
+        if ((src & 0xff) == (m_hostAddr & 0xff) && src != m_hostAddr)
+            m_lowByteShared = true;
+    }
+    if (m_addressFilter && compact && pos >= LRTP_COMPACT_ACK_SZ) {
+        // the connection id of a compact frame starts with the low byte of the
+        // receiver's address
+        if (frame->data[1] != (m_hostAddr & 0xff)) {
+            m_rxStats.filtered++;
+            return;
+        }
+    } else if (m_addressFilter && !compact && pos == LRTP_ADDR_PREFIX_SZ) {
+        // destination address is big-endian in bytes 4-5
+        uint16_t dest = (frame->data[4] << 0x08) | frame->data[5];
+        if (dest != m_hostAddr && dest != LRTP_BROADCAST_ADDR && !m_multicast.accepts(dest)) {
+            m_rxStats.filtered++;
+            return;
+        }
+    }
+    // read the rest of the frame into the slot
+    if (pos < len)
+        pos += m_radio.readBytes(frame->data + pos, len - pos);
+    frame->length = pos;
+    frame->timestamp = micros();
+    if (m_capture.isEnabled() || m_rateControl.isEnabled()) {
+        frame->rssi = m_radio.packetRssi();
+        frame->snr = m_radio.packetSnr();
+        frame->spreadingFactor = m_radio.getConfig().spreadingFactor;
+    } else {
+        frame->rssi = 0;
+        frame->snr = 0;
+        frame->spreadingFactor = 0;
     }
-    m_loraRxBytesWaiting = packetSize;
-    // set state back to idle/receive
-    // m_currentLoRaState = LoRaState::IDLE_RECEIVE;
+    m_rxFrames.commit();
+    m_rxStats.received++;
 }
 
 void LRTP::onLoRaTxDone() {
 
     // debug("TX Done");
 
+    // the contention window is shrunk in the loop, which also grows it
+    m_txDonePending = true;
+
     setState(LoRaState::IDLE_RECEIVE);
     // put radio back into receive mode
-    LoRa.receive();
+    m_radio.receive();
+    wake();
 }
 
 void LRTP::onLoRaCADDone(bool channelBusy) {
@@ -404,7 +933,7 @@ void LRTP::onLoRaCADDone(bool channelBusy) {
   debugf("CAD %s (%u of ) \n", channelBusy ? "BUSY" : "FREE",
          m_cadRoundsRemaining, LORA_SIGNAL_TIMEOUT_ROUNDS);
          */
-    lrtp_debugf("CAD %s (%u of %u) ", channelBusy ? "[BUSY]" : "[FREE]", m_cadRoundsRemaining, LORA_SIGNAL_TIMEOUT_ROUNDS);
+    lrtp_debugf("CAD %s (%u remaining) ", channelBusy ? "[BUSY]" : "[FREE]", m_cadRoundsRemaining);
 
     m_channelActive = channelBusy;
     if (channelBusy) {
@@ -412,18 +941,22 @@ void LRTP::onLoRaCADDone(bool channelBusy) {
         // incoming packet
         m_checkReceiveRounds = LORA_SIGNAL_TIMEOUT_ROUNDS;
         setState(LoRaState::RECEIVE);
-        LoRa.receive();
+        m_radio.receive();
+        // back off before the next attempt (handled in loopTransmit)
+        m_cadBusyPending = true;
+        wake();
 
-        lrtp_debugf("CAD (%u/%u) interrupted!\n", LRTP_CAD_ROUNDS - m_cadRoundsRemaining, LRTP_CAD_ROUNDS);
+        lrtp_debugf("CAD (%u remaining) interrupted!\n", m_cadRoundsRemaining);
 
         return;
     }
     if (m_cadRoundsRemaining > 1) {
         m_cadRoundsRemaining--;
         // start channel activity detect again
-        LoRa.channelActivityDetection();
+        m_radio.channelActivityDetection();
     } else {
         setState(LoRaState::CAD_FINISHED);
+        wake();
 
         // debug("CAD Finished");
     }
@@ -433,7 +966,7 @@ void LRTP::handleReceiveTimeout(unsigned long t) {
     // fix to prevent getting stuck in RECEIVE state if a corrupt/partial packet
     // is received and onPacketReceive callback is never called
     if (t - m_timer_checkReceiveTimeout >= LORA_SIGNAL_TIMEOUT) {
-        bool receiving = LoRa.rxSignalDetected();
+        bool receiving = m_radio.rxSignalDetected();
         if (receiving) {
             m_checkReceiveRounds = LORA_SIGNAL_TIMEOUT_ROUNDS;
         } else if (m_checkReceiveRounds <= 1) {
@@ -453,7 +986,32 @@ void LRTP::handleCADDone(unsigned long t) {
 
     lrtp_info("Sending packet");
 
-    LRTPPacket *p = m_nextConnectionForTransmit->getNextTxPacket();
+    if (m_txSource != TxSource::CONNECTION) {
+        LRTPPacket *p = m_txSource == TxSource::MULTICAST ? m_multicast.getNextTxPacket(t) : m_router.getNextTxPacket(t);
+        m_txSource = TxSource::CONNECTION;
+        if (p != nullptr) {
+            sendPacket(*p);
+            m_engineTurn = false;
+        } else {
+            setState(LoRaState::IDLE_RECEIVE);
+            m_radio.receive();
+        }
+        return;
+    }
+
+    if (m_txAggregateAck) {
+        m_txAggregateAck = false;
+        // the ACKs may have been sent with data in the meantime
+        if (countOwedAcks() > 0) {
+            size_t length = sendAggregateAck();
+            m_scheduler.onTransmit(m_nextConnectionForTransmit, m_radio.airtime(length));
+            m_engineTurn = true;
+            return;
+        }
+    }
+
+    // the connection may have been removed during CAD
+    LRTPPacket *p = m_nextConnectionForTransmit != nullptr ? m_nextConnectionForTransmit->getNextTxPacket() : nullptr;
 
     if (p != nullptr) {
 #if LRTP_DEBUG > 3
@@ -462,11 +1020,140 @@ void LRTP::handleCADDone(unsigned long t) {
         debug_print_packet_header(*p);
 #endif
 
-        sendPacket(*p);
+        size_t length = sendPacket(*p);
+        m_scheduler.onTransmit(m_nextConnectionForTransmit, m_radio.airtime(length));
+        m_engineTurn = true;
     } else {
         lrtp_debugf("%s: ERROR: Transmit packet was null!\n", __PRETTY_FUNCTION__);
         setState(LoRaState::IDLE_RECEIVE);
+        // the radio is in standby after CAD, put it back into receive mode
+        m_radio.receive();
+    }
+}
+
+LRTPConnectionHandle LRTP::createConnection(uint16_t addr) {
+    LRTPConnectionHandle connection = m_activeConnections.create(m_hostAddr, addr, this);
+    if (!connection) {
+        // take the slot of a connection that is no longer needed. Its handles
+        // become null
+        LRTPConnection *reclaimed = findReclaimable(millis());
+        if (reclaimed != nullptr) {
+            lrtp_infof("[%u] Connection table full, dropping the %s connection to %u\n",
+                addr,
+                connStateToStr(reclaimed->getConnectionState()),
+                reclaimed->getRemoteAddr());
+            reclaimed->abort();
+            removeConnection(*reclaimed);
+            connection = m_activeConnections.create(m_hostAddr, addr, this);
+        }
+    }
+    if (connection)
+        initConnection(*connection);
+    return connection;
+}
+
+LRTPConnection *LRTP::findReclaimable(unsigned long t) {
+    LRTPConnection *closing = nullptr;
+    LRTPConnection *idle = nullptr;
+    for (size_t i = 0; i < m_activeConnections.capacity(); i++) {
+        LRTPConnection *connection = m_activeConnections.at(i);
+        if (connection == nullptr)
+            continue;
+        LRTPConnState state = connection->getConnectionState();
+        if (state == LRTPConnState::CLOSED)
+            return connection;
+        if (state == LRTPConnState::CLOSE_FIN || state == LRTPConnState::CLOSE_FIN_ACK) {
+            // the application has given these up
+            closing = connection;
+        } else if (t - connection->getLastReceived() >= LRTP_CONN_IDLE_TIMEOUT &&
+                   (idle == nullptr || t - connection->getLastReceived() > t - idle->getLastReceived())) {
+            idle = connection;
+        }
+    }
+    return closing != nullptr ? closing : idle;
+}
+
+void LRTP::removeConnection(LRTPConnection &connection) {
+    // a frame it was about to send after CAD is dropped
+    if (&connection == m_nextConnectionForTransmit)
+        m_nextConnectionForTransmit = nullptr;
+    m_scheduler.removeFlow(&connection);
+    m_activeConnections.remove(connection.getRemoteAddr());
+}
+
+void LRTP::reapConnections() {
+    m_reapPending = false;
+    for (size_t i = 0; i < m_activeConnections.capacity(); i++) {
+        LRTPConnection *connection = m_activeConnections.at(i);
+        if (connection == nullptr || !connection->isReleased())
+            continue;
+        if (connection->getConnectionState() == LRTPConnState::CLOSED)
+            removeConnection(*connection);
+        else
+            m_reapPending = true;
+    }
+}
+
+void LRTP::initConnection(LRTPConnection &connection) {
+    m_scheduler.addFlow(&connection);
+    m_rateControl.initLink(connection.getLink());
+    // compact frames to us could be taken for another node's that shares our
+    // low address byte
+    bool compact = m_compactHeaders && !m_lowByteShared;
+    if (m_compactHeaders && !compact)
+        lrtp_infof("[%u] Address low byte shared with another node, using full headers\n", connection.getRemoteAddr());
+    uint8_t capabilities = (compact ? LRTP_CAP_COMPACT : 0) | (m_compression ? LRTP_CAP_LZSS : 0) | (m_fec ? LRTP_CAP_FEC : 0) |
+                           (m_selectiveRepeat ? LRTP_CAP_SACK : 0);
+    connection.setCapabilities(capabilities, allocateConnectionId());
+    connection.setCoalescing(m_coalesceFill, m_coalesceDelay);
+
+    // size the connection timers from real airtime: a frame may wait for the
+    // peer's piggyback timeout (about one more frame) before its ACK is sent.
+    // Each hop of a relayed connection adds the same again
+    unsigned long frameAirtime = m_radio.airtime(LRTP_MAX_PACKET) / 1000;
+    unsigned long ackAirtime = m_radio.airtime(LRTP_HEADER_SZ) / 1000;
+    unsigned long piggybackTimeout = frameAirtime;
+    unsigned long hops = m_router.hops(connection.getRemoteAddr(), millis());
+    unsigned long packetTimeout = hops * (2 * frameAirtime + ackAirtime + LRTP_TIMEOUT_MARGIN) + piggybackTimeout;
+    // the timeout starts there and adapts to the round trip time measured, but
+    // never below the time a full frame takes to be acknowledged
+    connection.setTimeoutBounds(hops * (frameAirtime + ackAirtime) + piggybackTimeout, max(packetTimeout, hops * LRTP_RTO_MAX_FRAMES * frameAirtime));
+    connection.setTimeouts(packetTimeout, piggybackTimeout);
+    // leave room for the forwarding header in case the peer is reached through
+    // a relay
+    if (m_router.isEnabled())
+        connection.setMaxPayload(LRTP_MAX_PAYLOAD_SZ - LRTP_FORWARD_OVERHEAD);
+}
+
+uint16_t LRTP::allocateConnectionId() {
+    // the high byte lets the receive ISR drop compact frames for other nodes,
+    // the low byte is random so that frames for a closed connection are not
+    // taken for its successor's. Ids are only unique among our own
+    // connections, see LRTP_CAP_COMPACT
+    uint16_t id = 0;
+    for (int attempt = 0; attempt < 256; attempt++) {
+        id = ((m_hostAddr & 0xff) << 0x08) | random(0, 256);
+        if (findConnectionById(id) == nullptr)
+            break;
     }
+    return id;
+}
+
+LRTPConnection *LRTP::findConnectionById(uint16_t id) {
+    for (size_t i = 0; i < m_activeConnections.capacity(); i++) {
+        LRTPConnection *connection = m_activeConnections.at(i);
+        // connections opened without compact headers never receive them
+        if (connection != nullptr && (connection->getCapabilities() & LRTP_CAP_COMPACT) && connection->getConnectionId() == id)
+            return connection;
+    }
+    return nullptr;
+}
+
+void LRTP::onConnectionTimeout(LRTPConnection &connection) {
+    // an unacknowledged frame most likely collided at the receiver
+    m_channelAccess.onCollision(connection.getPriority());
+    if (m_rateControl.isEnabled())
+        m_rateControl.onLoss(connection.getLink());
 }
 
 void LRTP::setState(LoRaState newState) {
@@ -483,15 +1170,21 @@ void debug_print_packet(const LRTPPacket &packet) {
     // print the packet payload in hex:
     Serial.println("\nPayload:");
 
-    // print the raw packet payload (ASCII)
-    int j = 16;
-    for (unsigned int i = 0; i < packet.payloadLength; i++) {
-        Serial.printf("%02x ", packet.payload[i]);
-        j--;
-        if (j <= 0) {
-            Serial.println();
-            j = 16;
+    // format the payload 16 bytes per line, so that each line is written to
+    // the port at once
+    static const char hex[] = "0123456789abcdef";
+    char line[16 * 3 + 1];
+    const size_t first = packet.payloadLength - packet.wrapLength;
+    for (unsigned int i = 0; i < packet.payloadLength; i += 16) {
+        size_t pos = 0;
+        for (unsigned int k = i; k < packet.payloadLength && k < i + 16; k++) {
+            const uint8_t value = k < first ? packet.payload[k] : packet.wrapPayload[k - first];
+            line[pos++] = hex[value >> 4];
+            line[pos++] = hex[value & 0x0f];
+            line[pos++] = ' ';
         }
+        line[pos] = 0;
+        Serial.println(line);
     }
     Serial.println();
 }
@@ -506,16 +1199,19 @@ void debug_print_packet_header(const LRTPPacket &packet) {
     Serial.print(packet.flags.syn ? "S " : "- ");
     Serial.print(packet.flags.fin ? "F " : "- ");
     Serial.print(packet.flags.ack ? "A " : "- ");
-    // reserved flag bit
-    Serial.printf("X\t\t");
+    Serial.print(packet.flags.sack ? "K\t\t" : "-\t\t");
     // size of the remote acknowledgement window in packets
     Serial.printf("Ack Window: %u (0x%02X)\n", packet.ackWindow, packet.ackWindow);
     // source and destiantion addresses
     Serial.printf("Source: %u (0x%04X)\t\t", packet.src, packet.src);
     Serial.printf("Destination: %u (0x%04X)\n", packet.dest, packet.dest);
+    if (packet.compact)
+        Serial.printf("Connection ID: %u (0x%04X)\n", packet.connectionId, packet.connectionId);
     // sequence and acknowledgement numbers
     Serial.printf("Sequence Num: %u (0x%02X)\t\t", packet.seqNum, packet.seqNum);
     Serial.printf("Acknowledgment Num: %u (0x%02X)\n", packet.ackNum, packet.ackNum);
+    if (packet.flags.sack)
+        Serial.printf("SACK Bitmap: 0x%02X\n", packet.sackBitmap);
     // print the packet payload length
     Serial.printf("Payload: %u bytes.\n", packet.payloadLength);
 }
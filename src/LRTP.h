@@ -3,43 +3,307 @@
 
 #include <Arduino.h>
 #include <functional>
-#include <memory>
-#include <unordered_map>
-#include <vector>
 
 #include "LRTPDebug.h"
 
 #include <lwip/sockets.h>
 
-#include <LoRa.h>
-#include <SPI.h>
-
+#include "LRTPCapture.hpp"
+#include "LRTPChannelAccess.hpp"
 #include "LRTPConnection.hpp"
+#include "LRTPConnectionTable.hpp"
 #include "LRTPConstants.hpp"
+#include "LRTPDutyCycle.hpp"
+#include "LRTPFrameRing.hpp"
+#include "LRTPLoRaRadio.hpp"
+#include "LRTPMulticast.hpp"
+#include "LRTPMutex.hpp"
+#include "LRTPRadio.hpp"
+#include "LRTPRateControl.hpp"
+#include "LRTPRouter.hpp"
+#include "LRTPScheduler.hpp"
+#include "LRTPTimerWheel.hpp"
+#include "LRTPUdpRadio.hpp"
 
 enum class LoRaState { IDLE_RECEIVE, RECEIVE, CAD_STARTED, CAD_FINISHED, TRANSMIT };
 
 class LRTP {
   public:
-    LRTP(uint16_t m_hostAddr);
+#if LRTP_RADIO_LORA
+    /**
+     * @brief Construct a new LRTP node using the global LoRa object as its radio
+     *
+     * @param hostAddr the address of this node
+     */
+    LRTP(uint16_t hostAddr);
+#endif
+    /**
+     * @brief Construct a new LRTP node on top of the given radio backend
+     *
+     * @param hostAddr the address of this node
+     * @param radio the radio to send and receive frames with. Must outlive this
+     * object
+     */
+    LRTP(uint16_t hostAddr, LRTPRadio &radio);
 
-    std::shared_ptr<LRTPConnection> connect(uint16_t destAddr);
+    /**
+     * @brief Open a connection to a remote node, or return the existing one.
+     * A connection that has closed is replaced by a new one
+     *
+     * @param destAddr the address of the remote node
+     * @return LRTPConnectionHandle the connection, or a null handle if the
+     * connection table is full
+     */
+    LRTPConnectionHandle connect(uint16_t destAddr);
 
-    int begin();
+    /**
+     * @brief Give a connection up. It is closed if still open, and its slot is
+     * freed once it has closed, making every handle to it null
+     */
+    void release(LRTPConnectionHandle connection);
+
+    /**
+     * @brief Start the radio and allocate the connection table, with every
+     * connection's buffers. No memory is allocated for connections after this
+     * call, apart from the handlers an application attaches to them
+     *
+     * @param maxConnections the number of connections that can be open at once.
+     * When the table is full, a new connection takes the slot of a closed
+     * connection, else of one being closed, else of the one whose peer has
+     * been silent longest, if for at least LRTP_CONN_IDLE_TIMEOUT
+     * @return int 1 on success, 0 on failure
+     */
+    int begin(size_t maxConnections = LRTP_MAX_CONNECTIONS);
 
     void loop();
 
+    /**
+     * @brief Take the node's lock. loop() and nextDeadline() hold it while
+     * they run, and so do connect(), release(), multicastWrite(), joinGroup(),
+     * leaveGroup() and the LRTPConnection methods an application calls
+     * (reading, writing, flushing, opening and closing), so those may be
+     * called from other threads or tasks while a runner calls loop(). Take it
+     * around a sequence of calls that must not be interleaved with loop(), or
+     * to use the rest of the API (setters, handlers, counters) from another
+     * thread once a runner has started. Recursive, so handlers called from
+     * loop() may take it again. Must not be called from an interrupt
+     */
+    void lock();
+    void unlock();
+
+    /**
+     * @brief Time until loop() next has work to do: a connection timer, the
+     * end of a CSMA backoff or duty cycle deferral, a receive timeout or a
+     * polled radio event. Events that arrive before then (radio interrupts,
+     * application writes) are signalled through the onWake() callback, so a
+     * host can sleep between calls to loop() instead of spinning
+     *
+     * @return unsigned long the time in ms, 0 if loop() should be called
+     * again immediately, or LRTP_NO_DEADLINE if only an event can create work
+     */
+    unsigned long nextDeadline();
+
+    /**
+     * @brief Set a handler called when an event creates work for loop(). It may
+     * be called from an interrupt or from another thread, and must only wake
+     * the thread calling loop()
+     */
+    void onWake(std::function<void(void)> callback);
+
+    /**
+     * @brief Signal that loop() has work to do, invoking the onWake() handler
+     */
+    void wake();
+
+    LRTPRadio &getRadio();
+
+    /**
+     * @brief Enable or disable aggregate ACKs (enabled by default). When an
+     * ACK only frame is due and other connections also owe ACKs, a single
+     * broadcast frame acknowledging all of them is sent instead
+     */
+    void setAckAggregation(bool enabled);
+
+    /**
+     * @brief Enable or disable compact headers (enabled by default) for
+     * connections opened afterwards. Connections to peers that also support
+     * them switch to 5 byte headers (4 bytes for ACK only frames) once the
+     * handshake is complete, unless the peer is reached through a relay.
+     * Once another node whose address has the same low byte has been heard,
+     * connections opened afterwards use full headers, see LRTP_CAP_COMPACT
+     */
+    void setCompactHeaders(bool enabled);
+
+    /**
+     * @brief Enable or disable stream compression (disabled by default) for
+     * connections opened afterwards. The data sent on connections to peers
+     * that also enable it is LZSS compressed, so that repetitive data such as
+     * telemetry takes less airtime. Each such connection keeps a 512 byte
+     * window for each direction, see LRTPCompressor
+     */
+    void setCompression(bool enabled);
+
+    /**
+     * @brief Enable or disable forward error correction (disabled by default)
+     * for connections opened afterwards. On connections to peers that also
+     * enable it, the receiver asks for XOR parity frames over blocks of data
+     * frames once it sees frames being lost, more often as the loss rate
+     * rises, and rebuilds a lost frame from them instead of waiting for it to
+     * be sent again. See LRTPFec
+     */
+    void setForwardErrorCorrection(bool enabled);
+
+    /**
+     * @brief Enable or disable selective repeat (disabled by default) for
+     * connections opened afterwards. On connections to peers that also enable
+     * it, the receiver keeps the frames that arrive after a lost one and lists
+     * them in its ACKs, and the sender only sends the missing frames again
+     * instead of the rest of the window (Go-Back-N)
+     */
+    void setSelectiveRepeat(bool enabled);
+
+    /**
+     * @brief Set the size of each connection's receive buffer (bytes, at
+     * least LRTP_RX_BUFFER_MIN, LRTP_RX_BUFFER_SZ by default), which holds
+     * received data until the application reads it. The window advertised to
+     * the peer shrinks as the buffer fills, so gateways may trade RAM for
+     * larger buffers that let peers keep their full window in flight while
+     * the application is busy. begin() allocates the buffers of every
+     * connection slot at once, so this must be called before begin()
+     *
+     * @return false if begin() has already been called
+     */
+    bool setReceiveBufferSize(size_t size);
+
+    /**
+     * @brief Set how connections opened afterwards gather the data written
+     * into frames (by default a full frame, for at most LRTP_COALESCE_DELAY
+     * ms while frames are in flight). See LRTPConnection::setCoalescing()
+     */
+    void setCoalescing(size_t minFill, unsigned long maxDelay);
+
+    /**
+     * @brief Enable or disable adaptive data rate (disabled by default). Each
+     * node then listens at the fastest spreading factor its peers' SNR allows,
+     * and sends to each peer at the rate the peer listens at with the lowest
+     * transmit power that reaches it. Only the spreading factor is adapted,
+     * the bandwidth and coding rate stay those of the base radio
+     * configuration, which all nodes must share. Multicast and aggregate ACK
+     * frames are always sent at the base rate, so nodes using multicast keep
+     * listening at the base rate.
+     *
+     * Nodes accepting connections (the default, see setAccepting()) also keep
+     * listening at the base rate, so frames sent to them gain nothing. A
+     * gateway accepting connections from its nodes still sends faster to the
+     * nodes that have stopped accepting, but its nodes send to it at the base
+     * rate. Adaptive rate is therefore only worth enabling on nodes that stop
+     * accepting, and on the nodes they talk to
+     */
+    void setAdaptiveRate(bool enabled);
+
+    /**
+     * @brief Accept connections opened by other nodes (enabled by default).
+     * New peers send their SYN at the base rate, so with adaptive rate a node
+     * accepting connections keeps listening at the base rate, and gets no rate
+     * gain on the frames sent to it (see setAdaptiveRate()). A node that only
+     * opens connections itself, or that has connected all the peers it
+     * expects, can stop accepting so that it listens faster. SYNs from nodes
+     * without a connection are then ignored
+     */
+    void setAccepting(bool enabled);
+
+    LRTPRateControl &getRateControl();
+
+    /**
+     * @brief Enable or disable multi-hop forwarding (disabled by default). The
+     * node then sends route beacons, learns routes from beacons and traffic,
+     * relays frames for other nodes, and reaches nodes out of range through a
+     * relay. Every node on a path must enable it. Connections opened
+     * afterwards send smaller frames, leaving room for the forwarding header.
+     * With adaptive rate, forwarding nodes keep listening at the base rate
+     */
+    void setForwarding(bool enabled);
+
+    /**
+     * @brief Get the router, to read its counters
+     */
+    LRTPRouter &getRouter();
+
     /**
      * @brief Set a handler to be called when a new client has connected
      *
      */
-    void onConnect(std::function<void(std::shared_ptr<LRTPConnection>)> callback);
+    void onConnect(std::function<void(LRTPConnectionHandle)> callback);
     /**
      * @brief Set a handler to be called when a broadcast packet is received
      *
      */
     void onBroadcastPacket(std::function<void(const LRTPPacket &)> callback);
 
+    /**
+     * @brief Join a multicast group, to receive the frames sent to it
+     *
+     * @param group the group address, between LRTP_MULTICAST_MIN and
+     * LRTP_MULTICAST_MAX
+     * @return true if the group was joined
+     * @return false if the address is not a group or too many groups are joined
+     */
+    bool joinGroup(uint16_t group);
+    void leaveGroup(uint16_t group);
+
+    /**
+     * @brief Send data to a multicast group. Lost frames are repaired when
+     * receivers NACK them, as long as they are still in the repair window
+     *
+     * @return size_t the number of bytes queued, less than len if the repair
+     * window is full
+     */
+    size_t multicastWrite(uint16_t group, const uint8_t *buf, size_t len);
+
+    /**
+     * @brief Set a handler to be called with each multicast frame received,
+     * in order, for a group that has been joined
+     */
+    void onMulticastReceived(std::function<void(const LRTPPacket &)> callback);
+
+    /**
+     * @brief Get the multicast engine, to read its counters
+     */
+    LRTPMulticast &getMulticast();
+
+    /**
+     * @brief Get the packet capture. Once started with getCapture().begin(),
+     * every frame received and sent is recorded, and the capture should be
+     * drained regularly from the loop
+     */
+    LRTPCapture &getCapture();
+
+    /**
+     * @brief Enable or disable promiscuous mode. The receive ISR then keeps
+     * frames addressed to other nodes so that they can be captured. They are
+     * not otherwise processed
+     */
+    void setPromiscuous(bool enabled);
+
+    /**
+     * @brief Get the receive path counters. Updated from the receive ISR, so
+     * values may be slightly out of date
+     */
+    const LRTPRxStats &getRxStats();
+
+    /**
+     * @brief Get the channel access (CSMA/CA) engine, to tune its per priority
+     * parameters or read its busy and collision counters
+     */
+    LRTPChannelAccess &getChannelAccess();
+
+    /**
+     * @brief Get the duty cycle scheduler, to change its sub-bands or read its
+     * counters. Frames are deferred (not dropped) while their sub-band's budget
+     * is exhausted
+     */
+    LRTPDutyCycle &getDutyCycle();
+
     // private:
     /**
      * @brief Parse a raw packet into the struct outPacket from a buffer of given
@@ -55,32 +319,110 @@ class LRTP {
 
     static int parseHeaderFlags(LRTPFlags *outFlags, uint8_t rawFlags);
 
+    // parse a frame with a compact header, see parsePacket()
+    static int parseCompactPacket(LRTPPacket *outPacket, uint8_t *buf, size_t len);
+
     static uint8_t packFlags(const LRTPFlags &flags);
 
   private:
+    friend class LRTPConnection;
+
     uint16_t m_hostAddr;
 
+    LRTPRadio &m_radio;
+
+    // guards everything below except the ISR flags and the receive ring
+    LRTPMutex m_mutex;
+
     LoRaState m_currentLoRaState;
 
     unsigned int m_cadRoundsRemaining = 0;
 
     bool m_channelActive = false;
 
-    // the number of bytes waiting to be read by a connection currently in the
-    // receive buffer
-    int m_loraRxBytesWaiting = 0;
+    LRTPChannelAccess m_channelAccess;
+    // priority of the frame for which CAD is running
+    LRTPPriority m_txPriority = LRTPPriority::DATA;
+    // set by the CAD ISR when the channel was found busy, handled in the loop
+    volatile bool m_cadBusyPending = false;
+    // set by the TX done ISR, handled in the loop
+    volatile bool m_txDonePending = false;
+    // set by the receive ISR whenever a frame ends, queued or dropped, so that
+    // the loop leaves RECEIVE
+    volatile bool m_rxFrameEnded = false;
+
+    LRTPDutyCycle m_dutyCycle;
+    // true while the next frame is being held back by the duty cycle budget
+    bool m_txDeferred = false;
+    unsigned long m_txDeferredAirtime = 0;
+
+    // picks the connection that sends the next frame
+    LRTPScheduler m_scheduler;
+
+    // retransmit and piggyback timers of all connections
+    LRTPTimerWheel m_timers;
+
+    // reliable multicast streams, sent alongside the connections
+    LRTPMulticast m_multicast;
+
+    // relays frames for other nodes, sent alongside the connections
+    LRTPRouter m_router;
+
+    // where the pending transmission comes from
+    enum class TxSource { CONNECTION, MULTICAST, FORWARD };
+    TxSource m_txSource = TxSource::CONNECTION;
+    // multicast or forwarded frames and connection frames of the same priority
+    // take turns
+    bool m_engineTurn = false;
+
+    // drop frames addressed to other nodes in the receive ISR, before their
+    // payload is read
+    bool m_addressFilter = true;
+
+    LRTPRxStats m_rxStats = {};
+
+    LRTPCapture m_capture;
+
+    // per peer data rate and transmit power, re-evaluated on a timer
+    LRTPRateControl m_rateControl;
+    LRTPTimer m_rateTimer;
+    void onRateTimer();
+    // apply a radio configuration if it differs from the current one. Returns
+    // true if the radio was retuned
+    bool tuneRadio(const LRTPRadioConfig &config);
 
     // stores the next connection which has a packet waiting to transmit, so it
     // can be used after channel activity detection completes
-    std::shared_ptr<LRTPConnection> m_nextConnectionForTransmit = nullptr;
-
-    // a buffer used to hold bytes read from the radio that have not yet been
-    // processed by a connection
-    uint8_t m_rxBuffer[LRTP_MAX_PACKET * LRTP_GLOBAL_RX_BUFFER_SZ];
-
-    // map from connection address to connection object. used to dispatch data to
-    // the correct connection once it has been received.
-    std::unordered_map<uint16_t, std::shared_ptr<LRTPConnection>> m_activeConnections;
+    LRTPConnection *m_nextConnectionForTransmit = nullptr;
+
+    // frames read from the radio by the receive ISR that have not yet been
+    // processed by loopReceive()
+    LRTPFrameRing<LRTP_GLOBAL_RX_BUFFER_SZ> m_rxFrames;
+
+    // the frame currently being transmitted, serialized by preparePacket()
+    uint8_t m_txFrame[LRTP_MAX_PACKET];
+
+    bool m_accepting = true;
+    bool m_ackAggregation = true;
+    bool m_compactHeaders = true;
+    // set by the receive ISR once a frame from another node whose address has
+    // our low byte is heard. Compact frames to us could then be taken for its
+    volatile bool m_lowByteShared = false;
+    bool m_compression = false;
+    bool m_fec = false;
+    bool m_selectiveRepeat = false;
+    size_t m_rxBufferSize = LRTP_RX_BUFFER_SZ;
+    size_t m_coalesceFill = LRTP_COALESCE_FILL;
+    unsigned long m_coalesceDelay = LRTP_COALESCE_DELAY;
+    // set when the pending transmission is an aggregate ACK frame
+    bool m_txAggregateAck = false;
+    uint8_t m_ackAggregatePayload[LRTP_ACK_AGGREGATE_MAX * LRTP_ACK_AGGREGATE_TUPLE_SZ];
+
+    // table from connection address to connection object. used to dispatch data
+    // to the correct connection once it has been received.
+    LRTPConnectionTable m_activeConnections;
+    // set while released connections are waiting to be removed
+    bool m_reapPending = false;
 
     unsigned int m_checkReceiveRounds = 0;
     unsigned long m_timer_checkReceiveTimeout = 0;
@@ -88,11 +430,14 @@ class LRTP {
     void handleCADDone(unsigned long t);
 
     // event handlers
-    std::function<void(std::shared_ptr<LRTPConnection>)> _onConnect = nullptr;
+    std::function<void(LRTPConnectionHandle)> _onConnect = nullptr;
     std::function<void(const LRTPPacket &)> _onBroadcastPacket = nullptr;
+    std::function<void(void)> _onWake = nullptr;
 
-    // handles receiveing data from the radio during the update loop
+    // handles receiveing data from the radio during the update loop. Processes
+    // every frame queued by the receive ISR
     void loopReceive();
+    void processFrame(const LRTPRawFrame &frame);
     // handles the transmision of a packet during the loop
     void loopTransmit();
 
@@ -104,28 +449,96 @@ class LRTP {
      * received, switches state to RECEIVE and doesn't start CAD (otherwise the
      * packet being received will be dropped by the LoRa radio.)
      *
+     * @param priority the priority of the frame to be sent, selects the number
+     * of CAD rounds
      * @return true if CAD was successfully started
      * @return false if we're part way through receiving a packet
      */
-    bool beginCAD();
+    bool beginCAD(LRTPPriority priority);
 
-    std::vector<uint8_t> preparePacket(const LRTPPacket &);
+    /**
+     * @brief Serialize a packet (header and payload) into a frame buffer. Does
+     * not allocate
+     *
+     * @param packet the packet to serialize
+     * @param buf the buffer to write the frame into
+     * @param len the size of buf in bytes
+     * @return size_t the length of the frame, or 0 if it does not fit in buf
+     */
+    static size_t preparePacket(const LRTPPacket &packet, uint8_t *buf, size_t len);
+    // serialize a packet with a compact header, see preparePacket()
+    static size_t prepareCompactPacket(const LRTPPacket &packet, uint8_t *buf, size_t len);
+    // write a packet's payload, in one or two pieces, to buf
+    static void copyPayload(const LRTPPacket &packet, uint8_t *buf);
 
     void handleIncomingPacket(const LRTPPacket &packet);
 
     void handleIncomingConnectionPacket(const LRTPPacket &packet);
 
     void handleIncomingBroadcastPacket(const LRTPPacket &packet);
-
-    // sends a packet once CAD has finished
-    void sendPacket(const LRTPPacket &packet);
+    void handleAggregateAck(const LRTPPacket &packet);
+    // true if the connection owes an ACK that can go in an aggregate ACK
+    bool canAggregateAck(LRTPConnection &connection);
+    // number of connections owing an ACK that could be aggregated
+    size_t countOwedAcks();
+    // build and send an aggregate ACK frame for every connection owing an ACK.
+    // Returns the frame length
+    size_t sendAggregateAck();
+
+    // sends a packet once CAD has finished. Returns the frame length, or 0 if
+    // the packet could not be sent
+    size_t sendPacket(const LRTPPacket &packet);
+    // serialize a packet into m_txFrame, wrapped in a FORWARD frame when its
+    // destination is reached through a relay. Returns the frame length
+    size_t prepareTxFrame(const LRTPPacket &packet);
+
+    // create a connection in the table, reclaiming a slot if it is full
+    LRTPConnectionHandle createConnection(uint16_t addr);
+    // the connection whose slot a new one may take, or nullptr, see begin()
+    LRTPConnection *findReclaimable(unsigned long t);
+    // remove a connection from the table, making its handles null
+    void removeConnection(LRTPConnection &connection);
+    // remove the released connections that have closed
+    void reapConnections();
+    // set up a new connection's airtime dependent parameters
+    void initConnection(LRTPConnection &connection);
+    // choose the id that compact frames to a new connection will carry
+    uint16_t allocateConnectionId();
+    LRTPConnection *findConnectionById(uint16_t id);
+
+    // called by a connection when a transmitted frame was not acknowledged
+    void onConnectionTimeout(LRTPConnection &connection);
 
     // handlers for LoRa async
     void onLoRaPacketReceived(int packetSize);
+    // read a received frame into the ring, unless it is dropped
+    void readReceivedFrame(int packetSize);
     void onLoRaTxDone();
     void onLoRaCADDone(bool channelBusy);
 };
 
+/**
+ * @brief Holds a node's lock (see LRTP::lock()) for the scope it is declared
+ * in. The node may be null, in which case nothing is locked
+ */
+class LRTPLock {
+  public:
+    LRTPLock(LRTP *lrtp) : m_lrtp(lrtp) {
+        if (m_lrtp != nullptr)
+            m_lrtp->lock();
+    }
+    ~LRTPLock() {
+        if (m_lrtp != nullptr)
+            m_lrtp->unlock();
+    }
+
+  private:
+    LRTP *m_lrtp;
+
+    LRTPLock(const LRTPLock &) = delete;
+    LRTPLock &operator=(const LRTPLock &) = delete;
+};
+
 /* ========== Debug methods ==========*/
 void debug_print_packet(const LRTPPacket &packet);
 void debug_print_packet_header(const LRTPPacket &packet);
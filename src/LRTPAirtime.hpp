@@ -0,0 +1,65 @@
+#pragma once
+#include <Arduino.h>
+
+/*
+ * Time on air of a LoRa frame, see Semtech AN1200.13 "LoRa Modem Designer's
+ * Guide":
+ *
+ *   Tsym     = 2^SF / BW
+ *   Tpre     = (Npreamble + 4.25) * Tsym
+ *   Npayload = 8 + max(ceil((8PL - 4SF + 28 + 16CRC - 20IH) / (4(SF - 2DE))) * CR, 0)
+ *   ToA      = Tpre + Npayload * Tsym
+ *
+ * where CR is the coding rate denominator (5-8) and low data rate optimisation
+ * (DE) is used when a symbol lasts more than 16ms. Only explicit header mode
+ * (IH = 0) is used by LRTP. The functions are constexpr (C++11) so airtimes of
+ * fixed size frames can be computed at compile time.
+ */
+
+// duration of one symbol in microseconds
+constexpr uint32_t lrtpSymbolTime(uint8_t spreadingFactor, uint32_t bandwidth) {
+    return (uint32_t)(((uint64_t)1 << spreadingFactor) * 1000000ULL / bandwidth);
+}
+
+constexpr bool lrtpLowDataRateOptimize(uint8_t spreadingFactor, uint32_t bandwidth) {
+    return lrtpSymbolTime(spreadingFactor, bandwidth) > 16000;
+}
+
+constexpr int32_t lrtpCeilDiv(int32_t num, int32_t den) {
+    return num <= 0 ? 0 : (num + den - 1) / den;
+}
+
+// number of payload symbols (including the 8 symbol header block)
+constexpr uint32_t lrtpPayloadSymbols(size_t length, uint8_t spreadingFactor, uint32_t bandwidth, uint8_t codingRate4, bool crc) {
+    return 8 +
+           lrtpCeilDiv(8 * (int32_t)length - 4 * spreadingFactor + 28 + (crc ? 16 : 0),
+               4 * (spreadingFactor - (lrtpLowDataRateOptimize(spreadingFactor, bandwidth) ? 2 : 0))) *
+               codingRate4;
+}
+
+/**
+ * @brief Lowest SNR at which a frame can be demodulated (SX127x datasheet),
+ * 2.5 dB lower for every step of the spreading factor
+ *
+ * @return float the SNR in dB
+ */
+constexpr float lrtpRequiredSnr(uint8_t spreadingFactor) {
+    return -7.5f - 2.5f * (spreadingFactor - 7);
+}
+
+/**
+ * @brief Time on air of a LoRa frame
+ *
+ * @param length the frame length in bytes (LRTP header and payload)
+ * @param spreadingFactor 6-12
+ * @param bandwidth the signal bandwidth in Hz
+ * @param codingRate4 the coding rate denominator, 5-8
+ * @param preambleLength the number of preamble symbols
+ * @param crc true if the payload CRC is enabled
+ * @return uint32_t the airtime in microseconds
+ */
+constexpr uint32_t lrtpTimeOnAir(size_t length, uint8_t spreadingFactor, uint32_t bandwidth, uint8_t codingRate4, uint16_t preambleLength, bool crc) {
+    // (Npreamble + 4.25 + Npayload) * 2^SF / BW, kept in integers by scaling by 4
+    return (uint32_t)(((uint64_t)(4 * preambleLength + 17 + 4 * lrtpPayloadSymbols(length, spreadingFactor, bandwidth, codingRate4, crc)) << spreadingFactor) *
+                      1000000ULL / (4ULL * bandwidth));
+}
@@ -0,0 +1,170 @@
+#include "LRTPCapture.hpp"
+
+#include <new>
+
+// pcap file header and record header sizes
+#define LRTP_PCAP_HEADER_SZ 24
+#define LRTP_PCAP_RECORD_SZ 16
+#define LRTP_PCAP_MAGIC 0xa1b2c3d4
+
+// pcap headers are written in little-endian order, readers detect the byte
+// order from the magic number
+static void writeLE16(uint8_t *buf, uint16_t val) {
+    buf[0] = val;
+    buf[1] = val >> 8;
+}
+
+static void writeLE32(uint8_t *buf, uint32_t val) {
+    buf[0] = val;
+    buf[1] = val >> 8;
+    buf[2] = val >> 16;
+    buf[3] = val >> 24;
+}
+
+LRTPCapture::~LRTPCapture() {
+    end();
+}
+
+bool LRTPCapture::begin(size_t bufferSize) {
+    end();
+    if (bufferSize < LRTP_PCAP_HEADER_SZ)
+        return false;
+    m_buffer = new (std::nothrow) uint8_t[bufferSize];
+    if (m_buffer == nullptr)
+        return false;
+    m_size = bufferSize;
+    m_head = 0;
+    m_count = 0;
+    m_clock = 0;
+    m_lastTimestamp = micros();
+    m_stats = {};
+
+    uint8_t header[LRTP_PCAP_HEADER_SZ];
+    writeLE32(header, LRTP_PCAP_MAGIC);
+    // version 2.4
+    writeLE16(header + 4, 2);
+    writeLE16(header + 6, 4);
+    // timezone offset and timestamp accuracy
+    writeLE32(header + 8, 0);
+    writeLE32(header + 12, 0);
+    writeLE32(header + 16, LRTP_CAPTURE_PSEUDO_SZ + LRTP_MAX_PACKET);
+    writeLE32(header + 20, LRTP_CAPTURE_LINKTYPE);
+    push(header, sizeof(header));
+    return true;
+}
+
+void LRTPCapture::end() {
+    delete[] m_buffer;
+    m_buffer = nullptr;
+    m_size = 0;
+    m_count = 0;
+}
+
+bool LRTPCapture::isEnabled() {
+    return m_buffer != nullptr;
+}
+
+void LRTPCapture::record(uint8_t direction, const uint8_t *frame, size_t length, unsigned long timestamp, int rssi, float snr) {
+    if (m_buffer == nullptr)
+        return;
+    // frames are recorded in the loop, so a received frame stamped by the ISR
+    // may be slightly older than the last frame recorded
+    long elapsed = (long)(timestamp - m_lastTimestamp);
+    uint64_t clock = m_clock + elapsed;
+    if (elapsed > 0) {
+        m_clock = clock;
+        m_lastTimestamp = timestamp;
+    }
+
+    const size_t recordLength = LRTP_CAPTURE_PSEUDO_SZ + length;
+    if (m_size - m_count < LRTP_PCAP_RECORD_SZ + recordLength) {
+        m_stats.dropped++;
+        return;
+    }
+    uint8_t header[LRTP_PCAP_RECORD_SZ + LRTP_CAPTURE_PSEUDO_SZ];
+    writeLE32(header, clock / 1000000);
+    writeLE32(header + 4, clock % 1000000);
+    writeLE32(header + 8, recordLength);
+    writeLE32(header + 12, recordLength);
+    uint8_t *pseudo = header + LRTP_PCAP_RECORD_SZ;
+    pseudo[0] = direction;
+    pseudo[1] = (int8_t)(snr * 4);
+    pseudo[2] = (uint16_t)(int16_t)rssi >> 8;
+    pseudo[3] = (uint16_t)(int16_t)rssi & 0xff;
+    push(header, sizeof(header));
+    push(frame, length);
+    m_stats.records++;
+}
+
+size_t LRTPCapture::available() {
+    return m_count;
+}
+
+size_t LRTPCapture::read(uint8_t *buf, size_t len) {
+    size_t copied = 0;
+    while (copied < len) {
+        size_t n = contiguous(len - copied);
+        if (n == 0)
+            break;
+        memcpy(buf + copied, m_buffer + m_head, n);
+        consume(n);
+        copied += n;
+    }
+    return copied;
+}
+
+size_t LRTPCapture::drain(Print &out, size_t maxBytes) {
+    size_t written = 0;
+    while (written < maxBytes) {
+        size_t n = contiguous(maxBytes - written);
+        if (n == 0)
+            break;
+        size_t sent = out.write(m_buffer + m_head, n);
+        consume(sent);
+        written += sent;
+        if (sent < n)
+            break;
+    }
+    m_stats.drained += written;
+    return written;
+}
+
+size_t LRTPCapture::drain(FILE *file, size_t maxBytes) {
+    size_t written = 0;
+    while (written < maxBytes) {
+        size_t n = contiguous(maxBytes - written);
+        if (n == 0)
+            break;
+        size_t sent = fwrite(m_buffer + m_head, 1, n, file);
+        consume(sent);
+        written += sent;
+        if (sent < n)
+            break;
+    }
+    m_stats.drained += written;
+    return written;
+}
+
+const LRTPCaptureStats &LRTPCapture::getStats() {
+    return m_stats;
+}
+
+void LRTPCapture::push(const uint8_t *buf, size_t len) {
+    // copy in up to two runs, wrapping at the end of the ring
+    size_t tail = (m_head + m_count) % m_size;
+    size_t first = min(len, m_size - tail);
+    memcpy(m_buffer + tail, buf, first);
+    memcpy(m_buffer, buf + first, len - first);
+    m_count += len;
+}
+
+size_t LRTPCapture::contiguous(size_t maxBytes) {
+    if (m_buffer == nullptr)
+        return 0;
+    return min(maxBytes, min(m_count, m_size - m_head));
+}
+
+void LRTPCapture::consume(size_t len) {
+    m_head = (m_head + len) % m_size;
+    m_count -= len;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <Arduino.h>
+#include <stdio.h>
+
+#include "LRTPConstants.hpp"
+
+/**
+ * @brief Packet capture in pcap format.
+ *
+ * Frames are recorded into a RAM ring as complete pcap records, so recording
+ * a frame is a couple of memcpy()s and never blocks the protocol. The ring is
+ * streamed out in bulk with drain(), for example to Serial from the main loop
+ * or to a file on a host. When the ring is full new records are dropped and
+ * counted, the capture never waits for its reader.
+ *
+ * Records use the link type LRTP_CAPTURE_LINKTYPE (LINKTYPE_USER0). Each
+ * frame is preceded by a pseudo-header of LRTP_CAPTURE_PSEUDO_SZ bytes:
+ * direction (LRTP_CAPTURE_RX or LRTP_CAPTURE_TX), SNR in quarter dB (signed),
+ * and RSSI in dBm (signed, 16 bit big-endian). Timestamps count from begin().
+ *
+ * Recording and draining must happen on the same thread (the LRTP loop).
+ */
+class LRTPCapture {
+  public:
+    ~LRTPCapture();
+
+    /**
+     * @brief Allocate the capture ring and start capturing. The ring starts
+     * with the pcap file header
+     *
+     * @param bufferSize the size of the ring in bytes
+     * @return true on success
+     * @return false if the ring could not be allocated
+     */
+    bool begin(size_t bufferSize = LRTP_CAPTURE_BUFFER_SZ);
+
+    // stop capturing and free the ring. Records not yet drained are lost
+    void end();
+
+    bool isEnabled();
+
+    /**
+     * @brief Record a frame. Does nothing if the capture is not enabled
+     *
+     * @param direction LRTP_CAPTURE_RX or LRTP_CAPTURE_TX
+     * @param timestamp the time the frame was received or sent (micros())
+     * @param rssi received signal strength (dBm), 0 for transmitted frames
+     * @param snr signal to noise ratio (dB), 0 for transmitted frames
+     */
+    void record(uint8_t direction, const uint8_t *frame, size_t length, unsigned long timestamp, int rssi, float snr);
+
+    // number of captured bytes waiting to be drained
+    size_t available();
+
+    /**
+     * @brief Copy captured bytes out of the ring
+     *
+     * @return size_t the number of bytes copied
+     */
+    size_t read(uint8_t *buf, size_t len);
+
+    /**
+     * @brief Write captured bytes to a stream in at most two writes. Pass
+     * out.availableForWrite() as maxBytes to never block on a slow port
+     *
+     * @return size_t the number of bytes written
+     */
+    size_t drain(Print &out, size_t maxBytes = (size_t)-1);
+    size_t drain(FILE *file, size_t maxBytes = (size_t)-1);
+
+    const LRTPCaptureStats &getStats();
+
+  private:
+    uint8_t *m_buffer = nullptr;
+    size_t m_size = 0;
+    // read position and number of bytes in the ring
+    size_t m_head = 0;
+    size_t m_count = 0;
+
+    // microseconds since begin(), extended past the 32 bit wrap of micros()
+    uint64_t m_clock = 0;
+    unsigned long m_lastTimestamp = 0;
+
+    LRTPCaptureStats m_stats = {};
+
+    void push(const uint8_t *buf, size_t len);
+    // the contiguous run of bytes at the head of the ring, at most maxBytes
+    size_t contiguous(size_t maxBytes);
+    void consume(size_t len);
+};
@@ -0,0 +1,89 @@
+#include "LRTPChannelAccess.hpp"
+
+LRTPChannelAccess::LRTPChannelAccess() {
+    setParams(LRTPPriority::CONTROL, { LRTP_CSMA_CONTROL_CW_MIN, LRTP_CSMA_CONTROL_CW_MAX, LRTP_CSMA_CONTROL_CAD_ROUNDS });
+    setParams(LRTPPriority::DATA, { LRTP_CSMA_DATA_CW_MIN, LRTP_CSMA_DATA_CW_MAX, LRTP_CSMA_DATA_CAD_ROUNDS });
+    setParams(LRTPPriority::BULK, { LRTP_CSMA_BULK_CW_MIN, LRTP_CSMA_BULK_CW_MAX, LRTP_CSMA_BULK_CAD_ROUNDS });
+    setFrameAirtime(LRTP_CSMA_DEFAULT_FRAME_AIRTIME);
+}
+
+void LRTPChannelAccess::setParams(LRTPPriority priority, const LRTPBackoffParams &params) {
+    size_t i = (size_t)priority;
+    m_params[i] = params;
+    if (m_params[i].cadRounds == 0)
+        m_params[i].cadRounds = 1;
+    if (m_params[i].cwMax < m_params[i].cwMin)
+        m_params[i].cwMax = m_params[i].cwMin;
+    m_cw[i] = m_params[i].cwMin;
+}
+
+const LRTPBackoffParams &LRTPChannelAccess::getParams(LRTPPriority priority) {
+    return m_params[(size_t)priority];
+}
+
+void LRTPChannelAccess::setFrameAirtime(unsigned long airtime) {
+    m_slotTime = max(airtime / LRTP_CSMA_SLOTS_PER_FRAME, (unsigned long)LRTP_CSMA_MIN_SLOT);
+}
+
+unsigned long LRTPChannelAccess::getSlotTime() {
+    return m_slotTime;
+}
+
+bool LRTPChannelAccess::canAttempt(unsigned long t) {
+    if (m_backoffActive && (long)(t - m_backoffEnd) >= 0)
+        m_backoffActive = false;
+    return !m_backoffActive;
+}
+
+unsigned long LRTPChannelAccess::getBackoffEnd() {
+    return m_backoffEnd;
+}
+
+bool LRTPChannelAccess::isBackingOff() {
+    return m_backoffActive;
+}
+
+void LRTPChannelAccess::onAttempt() {
+    m_stats.cadAttempts++;
+}
+
+void LRTPChannelAccess::onChannelBusy(LRTPPriority priority, unsigned long t) {
+    m_stats.cadBusy++;
+    growWindow(priority);
+    // draw a random backoff from the (grown) contention window
+    unsigned long slots = random(0, m_cw[(size_t)priority] + 1);
+    unsigned long backoff = slots * m_slotTime;
+    m_stats.backoffTime += backoff;
+    m_backoffEnd = t + backoff;
+    m_backoffActive = true;
+}
+
+void LRTPChannelAccess::onTransmitted(LRTPPriority priority) {
+    m_stats.transmissions++;
+    size_t i = (size_t)priority;
+    m_cw[i] = max((uint16_t)(m_cw[i] / 2), m_params[i].cwMin);
+}
+
+void LRTPChannelAccess::onCollision(LRTPPriority priority) {
+    m_stats.collisions++;
+    growWindow(priority);
+}
+
+uint16_t LRTPChannelAccess::getContentionWindow(LRTPPriority priority) {
+    return m_cw[(size_t)priority];
+}
+
+const LRTPChannelStats &LRTPChannelAccess::getStats() {
+    return m_stats;
+}
+
+float LRTPChannelAccess::getBusyRate() {
+    if (m_stats.cadAttempts == 0)
+        return 0;
+    return (float)m_stats.cadBusy / m_stats.cadAttempts;
+}
+
+void LRTPChannelAccess::growWindow(LRTPPriority priority) {
+    size_t i = (size_t)priority;
+    m_cw[i] = min((uint16_t)(m_cw[i] * 2 + 1), m_params[i].cwMax);
+}
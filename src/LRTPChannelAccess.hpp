@@ -0,0 +1,76 @@
+#pragma once
+#include <Arduino.h>
+
+#include "LRTPConstants.hpp"
+
+/**
+ * @brief Per priority channel access parameters
+ */
+struct LRTPBackoffParams {
+    // contention window bounds in slots
+    uint16_t cwMin;
+    uint16_t cwMax;
+    // number of CAD rounds that must find the channel free before transmitting
+    uint8_t cadRounds;
+};
+
+/**
+ * @brief CSMA/CA channel access engine.
+ *
+ * A transmission is attempted immediately when the channel was last found
+ * free. When CAD finds the channel busy, the contention window of the frame's
+ * priority grows (doubles, up to cwMax) and a random backoff of [0, cw] slots
+ * is drawn before the next attempt, so backlogged nodes spread their retries
+ * out instead of re-sensing in lockstep. The window shrinks (halves, down to
+ * cwMin) after each successful transmit and grows again on a suspected
+ * collision. Slots are scaled from the airtime of a full frame, since that is
+ * how long a busy channel is likely to stay busy.
+ */
+class LRTPChannelAccess {
+  public:
+    LRTPChannelAccess();
+
+    void setParams(LRTPPriority priority, const LRTPBackoffParams &params);
+    const LRTPBackoffParams &getParams(LRTPPriority priority);
+
+    /**
+     * @brief Set the airtime of a full frame, used to scale the slot time
+     *
+     * @param airtime the airtime in ms
+     */
+    void setFrameAirtime(unsigned long airtime);
+    unsigned long getSlotTime();
+
+    // true if no backoff is pending at time t
+    bool canAttempt(unsigned long t);
+    // time at which the pending backoff expires (only valid if one is pending)
+    unsigned long getBackoffEnd();
+    bool isBackingOff();
+
+    // a CAD sequence was started
+    void onAttempt();
+    // CAD found the channel busy: grow the contention window and back off
+    void onChannelBusy(LRTPPriority priority, unsigned long t);
+    // a frame was transmitted: shrink the contention window
+    void onTransmitted(LRTPPriority priority);
+    // a transmitted frame was not acknowledged in time
+    void onCollision(LRTPPriority priority);
+
+    uint16_t getContentionWindow(LRTPPriority priority);
+
+    const LRTPChannelStats &getStats();
+    // fraction of channel access attempts that found the channel busy
+    float getBusyRate();
+
+  private:
+    LRTPBackoffParams m_params[LRTP_PRIORITY_COUNT];
+    uint16_t m_cw[LRTP_PRIORITY_COUNT];
+
+    unsigned long m_slotTime;
+    bool m_backoffActive = false;
+    unsigned long m_backoffEnd = 0;
+
+    LRTPChannelStats m_stats = {};
+
+    void growWindow(LRTPPriority priority);
+};
@@ -0,0 +1,120 @@
+#include "LRTPCompressor.hpp"
+
+#define LRTP_LZ_WINDOW_SZ (1 << LRTP_LZ_WINDOW_BITS)
+#define LRTP_LZ_WINDOW_MASK (LRTP_LZ_WINDOW_SZ - 1)
+#define LRTP_LZ_MAX_MATCH ((1 << LRTP_LZ_LENGTH_BITS) - 1 + LRTP_LZ_MIN_MATCH)
+#define LRTP_LZ_MATCH_SZ 2
+
+static_assert(LRTP_LZ_WINDOW_BITS + LRTP_LZ_LENGTH_BITS == 16, "LZSS matches must fit in two bytes");
+
+LRTPCompressor::LRTPCompressor() {
+    reset();
+}
+
+void LRTPCompressor::reset() {
+    // both ends start from the same (empty) window
+    memset(m_window, 0, sizeof(m_window));
+    m_pos = 0;
+}
+
+size_t LRTPCompressor::compress(CircularBuffer<uint8_t, LRTP_TX_DATA_BUFFER_SZ> &in, size_t maxInput, uint8_t *out, size_t outSize) {
+    size_t outLength = 0;
+    size_t consumed = 0;
+    uint8_t *flags = nullptr;
+    uint8_t bit = 8;
+    while (consumed < maxInput && in.count() > 0) {
+        // leave room for a match, and for the flag byte starting a group
+        if (outLength + LRTP_LZ_MATCH_SZ + (bit == 8 ? 1 : 0) > outSize)
+            break;
+        if (bit == 8) {
+            flags = out + outLength++;
+            *flags = 0;
+            bit = 0;
+        }
+        const size_t lookahead = min(min(in.count(), maxInput - consumed), (size_t)LRTP_LZ_MAX_MATCH);
+        // longest match in the window. A match may run on into the bytes it
+        // copies, as the decompressor copies one byte at a time
+        size_t bestLength = 0;
+        size_t bestDistance = 0;
+        if (lookahead >= LRTP_LZ_MIN_MATCH) {
+            const uint8_t first = *in[0];
+            for (size_t distance = 1; distance <= LRTP_LZ_WINDOW_SZ && bestLength < lookahead; distance++) {
+                if (byteAt(in, distance, 0) != first)
+                    continue;
+                size_t length = 1;
+                while (length < lookahead && byteAt(in, distance, length) == *in[length])
+                    length++;
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = distance;
+                }
+            }
+        }
+        size_t tokenLength = 1;
+        if (bestLength >= LRTP_LZ_MIN_MATCH) {
+            uint16_t token = ((bestDistance - 1) << LRTP_LZ_LENGTH_BITS) | (bestLength - LRTP_LZ_MIN_MATCH);
+            out[outLength++] = token >> 0x08;
+            out[outLength++] = token & 0xff;
+            *flags |= 1 << bit;
+            tokenLength = bestLength;
+        } else {
+            out[outLength++] = *in[0];
+        }
+        for (size_t i = 0; i < tokenLength; i++)
+            push(*in.dequeue());
+        consumed += tokenLength;
+        bit++;
+    }
+    return outLength;
+}
+
+uint8_t LRTPCompressor::byteAt(CircularBuffer<uint8_t, LRTP_TX_DATA_BUFFER_SZ> &in, size_t distance, size_t offset) {
+    if (offset < distance)
+        return m_window[(m_pos - distance + offset) & LRTP_LZ_WINDOW_MASK];
+    return *in[offset - distance];
+}
+
+void LRTPCompressor::push(uint8_t value) {
+    m_window[m_pos++ & LRTP_LZ_WINDOW_MASK] = value;
+}
+
+LRTPDecompressor::LRTPDecompressor() {
+    reset();
+}
+
+void LRTPDecompressor::reset() {
+    memset(m_window, 0, sizeof(m_window));
+    m_pos = 0;
+}
+
+bool LRTPDecompressor::decompress(const uint8_t *in, size_t len, uint8_t *out, size_t outSize, size_t &outLength) {
+    size_t pos = 0;
+    outLength = 0;
+    while (pos < len) {
+        const uint8_t flags = in[pos++];
+        for (uint8_t bit = 0; bit < 8 && pos < len; bit++) {
+            if (flags & (1 << bit)) {
+                if (pos + LRTP_LZ_MATCH_SZ > len)
+                    return false;
+                uint16_t token = (in[pos] << 0x08) | in[pos + 1];
+                pos += LRTP_LZ_MATCH_SZ;
+                const size_t distance = (token >> LRTP_LZ_LENGTH_BITS) + 1;
+                const size_t length = (token & ((1 << LRTP_LZ_LENGTH_BITS) - 1)) + LRTP_LZ_MIN_MATCH;
+                if (outLength + length > outSize)
+                    return false;
+                for (size_t i = 0; i < length; i++) {
+                    uint8_t value = m_window[(m_pos - distance) & LRTP_LZ_WINDOW_MASK];
+                    m_window[m_pos++ & LRTP_LZ_WINDOW_MASK] = value;
+                    out[outLength++] = value;
+                }
+            } else {
+                if (outLength >= outSize)
+                    return false;
+                uint8_t value = in[pos++];
+                m_window[m_pos++ & LRTP_LZ_WINDOW_MASK] = value;
+                out[outLength++] = value;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <Arduino.h>
+
+#include "CircularBuffer.hpp"
+#include "LRTPConstants.hpp"
+
+/**
+ * @brief Streaming LZSS compressor for the data sent on a connection.
+ *
+ * Data is coded as groups of up to eight tokens, each group preceded by a flag
+ * byte whose bits (LSB first) tell literals (one byte) from matches. A match
+ * is two bytes, big-endian: the distance back into the last
+ * 2^LRTP_LZ_WINDOW_BITS bytes minus one, and the length minus
+ * LRTP_LZ_MIN_MATCH in the low LRTP_LZ_LENGTH_BITS bits.
+ *
+ * Every frame starts a new group, so each frame's payload decodes on its own,
+ * but the window carries over from frame to frame: repeated telemetry is
+ * coded as matches into earlier frames. This relies on the connection
+ * delivering frames exactly once and in order. A frame that is retransmitted
+ * is sent as it was first compressed.
+ *
+ * The compressor and decompressor each keep only their window, and the match
+ * search is a plain scan of the window, so no other memory is needed.
+ */
+class LRTPCompressor {
+  public:
+    LRTPCompressor();
+
+    // forget the window, at the start of a connection
+    void reset();
+
+    /**
+     * @brief Compress data from the head of a buffer into a frame payload
+     *
+     * @param in the data to compress. Bytes that were compressed are removed
+     * @param maxInput the most bytes to take from in
+     * @param out the payload buffer
+     * @param outSize the size of out, at least 3 bytes
+     * @return size_t the payload length
+     */
+    size_t compress(CircularBuffer<uint8_t, LRTP_TX_DATA_BUFFER_SZ> &in, size_t maxInput, uint8_t *out, size_t outSize);
+
+  private:
+    uint8_t m_window[1 << LRTP_LZ_WINDOW_BITS];
+    // free running position of the next byte in the window
+    size_t m_pos = 0;
+
+    // the byte at distance back from the next input byte, plus offset
+    uint8_t byteAt(CircularBuffer<uint8_t, LRTP_TX_DATA_BUFFER_SZ> &in, size_t distance, size_t offset);
+    void push(uint8_t value);
+};
+
+/**
+ * @brief Decompressor for payloads made by LRTPCompressor. See LRTPCompressor
+ * for the format
+ */
+class LRTPDecompressor {
+  public:
+    LRTPDecompressor();
+
+    void reset();
+
+    /**
+     * @brief Decompress a frame payload
+     *
+     * @param in the payload
+     * @param len the payload length
+     * @param out the buffer to write the data to
+     * @param outSize the size of out
+     * @param outLength set to the length of the data
+     * @return true on success
+     * @return false if the payload is malformed or its data does not fit in
+     * out. The window is then out of step with the compressor's
+     */
+    bool decompress(const uint8_t *in, size_t len, uint8_t *out, size_t outSize, size_t &outLength);
+
+  private:
+    uint8_t m_window[1 << LRTP_LZ_WINDOW_BITS];
+    size_t m_pos = 0;
+};
@@ -1,17 +1,29 @@
 #include "LRTPConnection.hpp"
+#include "LRTP.h"
 
 // #include "CircularBuffer.hpp"
 
-LRTPConnection::LRTPConnection(uint16_t source, uint16_t destination)
-    : m_srcAddr(source), m_destAddr(destination), m_currentSeqNum(0), m_nextAckNum(0), m_seqBase(0), m_windowSize(LRTP_TX_PACKET_BUFFER_SZ),
-      m_txDataBuffer(LRTP_MAX_PAYLOAD_SZ * LRTP_TX_PACKET_BUFFER_SZ), m_txWindow(m_windowSize), m_connectionState(LRTPConnState::CLOSED) {
+static_assert(LRTP_TX_DATA_BUFFER_SZ >= LRTP_MAX_PAYLOAD_SZ * LRTP_TX_PACKET_BUFFER_SZ, "LRTP_TX_DATA_BUFFER_SZ is too small for the window");
+
+// the timer callbacks only capture this, so std::function holds them without
+// allocating
+LRTPConnection::LRTPConnection(uint16_t source, uint16_t destination, LRTP *owner, uint8_t *rxStorage, size_t rxSize)
+    : m_owner(owner), m_srcAddr(source), m_destAddr(destination), m_currentSeqNum(0), m_nextAckNum(0), m_seqBase(0), m_windowSize(LRTP_TX_PACKET_BUFFER_SZ),
+      m_fec(m_reorder), m_packetTimer([this]() { onPacketTimeout(); }), m_piggybackTimer([this]() { onPiggybackTimeout(); }),
+      m_coalesceTimer([this]() { onCoalesceTimeout(); }),
+      m_rxBuffer(rxStorage, rxSize), m_connectionState(LRTPConnState::CLOSED) {
     // set piggyback packet data to default
     m_piggybackPacket.payloadLength = 0;
     m_piggybackPacket.payload = nullptr;
+    m_piggybackPacket.wrapPayload = nullptr;
+    m_piggybackPacket.wrapLength = 0;
     m_piggybackPacket.version = LRTP_DEFAULT_VERSION;
     m_piggybackPacket.payloadType = LRTP_DEFAULT_TYPE;
     m_piggybackPacket.src = m_srcAddr;
     m_piggybackPacket.dest = m_destAddr;
+    m_rtt.rto = LRTP_PACKET_TIMEOUT;
+    m_lastReceived = millis();
+    resetCongestion();
 }
 
 LRTPConnection::~LRTPConnection() {
@@ -19,33 +31,27 @@ LRTPConnection::~LRTPConnection() {
     // Serial.println("LRTPConnection: Destructor called");
 #endif
     lrtp_infof("[%u] LRTPConnection: Destructor called", m_destAddr);
-    // free the payload buffers for all packets still in the transmit buffer
-    LRTPPacket *p = m_txWindow.dequeue();
-    while (p != nullptr) {
-        if (p->payload != nullptr) {
-            free(p->payload);
-        }
-        p = m_txWindow.dequeue();
-    }
 }
 
 // Stream implementation
 int LRTPConnection::read() {
-    if (m_rxBuffLen > 0 && m_rxBuffLen - m_rxBuffPos > 0) {
-        return m_rxBuffer[m_rxBuffPos++];
-    }
-    return -1;
+    LRTPLock lock(m_owner);
+    uint8_t *val = m_rxBuffer.dequeue();
+    if (val == nullptr)
+        return -1;
+    int result = *val;
+    onRxRead();
+    return result;
 }
 int LRTPConnection::available() {
-    if (m_rxBuffLen <= 0) {
-        return 0;
-    } else {
-        return m_rxBuffLen - m_rxBuffPos;
-    }
+    LRTPLock lock(m_owner);
+    return m_rxBuffer.count();
 }
 int LRTPConnection::peek() {
-    if (m_rxBuffLen > 0 && m_rxBuffLen - m_rxBuffPos > 0) {
-        return m_rxBuffer[m_rxBuffPos];
+    LRTPLock lock(m_owner);
+    uint8_t *val = m_rxBuffer.peek();
+    if (val != nullptr) {
+        return *val;
     }
     return -1;
 }
@@ -53,26 +59,42 @@ int LRTPConnection::peek() {
 
 // Print implementation
 size_t LRTPConnection::write(uint8_t val) {
+    LRTPLock lock(m_owner);
+    // data written after close() is not sent
+    if (m_connectionState == LRTPConnState::CLOSE_FIN || m_connectionState == LRTPConnState::CLOSE_FIN_ACK)
+        return 0;
     // try and append the byte to the data buffer
-    return m_txDataBuffer.enqueue(val);
+    size_t written = m_txDataBuffer.enqueue(val);
+    if (written) {
+        holdTxData();
+        notifyOwner();
+    }
+    return written;
 }
 
 size_t LRTPConnection::write(const uint8_t *buf, size_t size) {
+    LRTPLock lock(m_owner);
     // Serial.printf("Stream wrote (str): %s\n", buf);
     lrtp_infof("[%u] %u bytes written to LRTP connection\n", m_destAddr, size);
-    // TODO: Improve this
-    unsigned int i;
-    for (i = 0; i < size; i++) {
-        if (!write(buf[i]))
-            break;
+    if (m_connectionState == LRTPConnState::CLOSE_FIN || m_connectionState == LRTPConnState::CLOSE_FIN_ACK)
+        return 0;
+    size_t written = m_txDataBuffer.enqueue(buf, size);
+    if (written > 0) {
+        holdTxData();
+        notifyOwner();
     }
-    return i;
+    return written;
 }
 
 void LRTPConnection::flush() {
+    LRTPLock lock(m_owner);
+    m_txPushed = getTxBytesWaiting();
+    if (m_txPushed > 0)
+        notifyOwner();
 }
 
 int LRTPConnection::availableForWrite() {
+    LRTPLock lock(m_owner);
     // data may be written in either connected or connect_syn_ack state
     if (m_connectionState == LRTPConnState::CONNECT_SYN_ACK || m_connectionState == LRTPConnState::CONNECTED) {
         return m_txDataBuffer.size() - m_txDataBuffer.count();
@@ -82,46 +104,104 @@ int LRTPConnection::availableForWrite() {
 
 // end print implementation
 
+void LRTPConnection::setCoalescing(size_t minFill, unsigned long maxDelay) {
+    LRTPLock lock(m_owner);
+    m_coalesceFill = minFill;
+    m_coalesceDelay = maxDelay;
+    holdTxData();
+    notifyOwner();
+}
+
+void LRTPConnection::cork() {
+    LRTPLock lock(m_owner);
+    m_corked = true;
+    holdTxData();
+}
+
+void LRTPConnection::uncork() {
+    LRTPLock lock(m_owner);
+    m_corked = false;
+    flush();
+}
+
 bool LRTPConnection::connect() {
+    LRTPLock lock(m_owner);
     if (m_connectionState != LRTPConnState::CLOSED)
         return false;
 
     // set up a new random sequence number
     m_currentSeqNum = random(0, 256);
     m_seqBase = m_currentSeqNum;
+    // learned again from the SYN-ACK
+    m_peerCapabilities = 0;
+    m_compressor.reset();
+    m_decompressor.reset();
+    m_sackedMask = 0;
+    m_resendMask = 0;
+    m_packetRetries = 0;
+    m_rttTiming = false;
+    m_txPushed = 0;
+    m_coalesceExpired = false;
+    resetCongestion();
     // send SYN-ACK
     m_piggybackFlags = {
         .syn = true,
         .fin = false,
         .ack = false,
+        .sack = false,
     };
     m_sendPiggybackPacket = true;
     // start timeout timer
     startPacketTimeoutTimer();
     // set state to CONNECT_SYN
     setConnectionState(LRTPConnState::CONNECT_SYN);
+    notifyOwner();
     return true;
 }
 
 bool LRTPConnection::close() {
+    LRTPLock lock(m_owner);
     /*
-    1. wait for all pending packets to be send & add FIN flag to final packet
-       --  OR  --
-       send empty/piggyback FIN packet
-    2. set CLOSE_FIN state
-    3. handle FIN/ACK packet from remote host (in HandleCloseFin)
-    4. - set CLOSED state
+    1. send the data waiting, then a FIN once all of it is acknowledged
+       (CLOSE_FIN -> CLOSE_FIN_ACK)
+    2. frames sent after the FIN repeat it until the peer's FIN arrives, which
+       follows the last of the peer's data
+    3. set CLOSED state. A peer that closes second is CLOSED once it has sent
+       its FIN, and answers the FIN again from CLOSED if its answer is lost
     */
+    switch (m_connectionState) {
+    case LRTPConnState::CLOSED:
+        return false;
+    case LRTPConnState::CONNECT_SYN:
+    case LRTPConnState::CONNECT_SYN_ACK:
+        // no data has been exchanged yet
+        m_sendPiggybackPacket = false;
+        setConnectionState(LRTPConnState::CLOSED);
+        return true;
+    case LRTPConnState::CONNECTED:
+        flush();
+        setConnectionState(LRTPConnState::CLOSE_FIN);
+        sendFinIfDone();
+        return true;
+    default:
+        // already closing
+        return true;
+    }
+}
 
-    setConnectionState(LRTPConnState::CLOSE_FIN);
-    return true;
+void LRTPConnection::abort() {
+    LRTPLock lock(m_owner);
+    m_sendPiggybackPacket = false;
+    setConnectionState(LRTPConnState::CLOSED);
 }
 
 void LRTPConnection::onDataReceived(std::function<void(void)> callback) {
+    LRTPLock lock(m_owner);
     m_onDataReceived = callback;
 }
 
 void LRTPConnection::onClose(std::function<void(void)> callback) {
+    LRTPLock lock(m_owner);
     m_onClose = callback;
 }
 
@@ -133,26 +213,69 @@ LRTPConnState LRTPConnection::getConnectionState() {
     return m_connectionState;
 }
 
-void LRTPConnection::updateTimers(unsigned long t) {
-    // check if timers have elapsed
-    if (m_timer_packetTimeoutActive && t - m_timer_packetTimeout > LRTP_PACKET_TIMEOUT) {
-        onPacketTimeout();
-    }
-    // handle piggyback timeout
-    if (m_timer_piggybackTimeoutActive && t - m_timer_piggybackTimeout > LRTP_PIGGYBACK_TIMEOUT) {
-        onPiggybackTimeout();
-    }
+unsigned long LRTPConnection::getLastReceived() {
+    return m_lastReceived;
+}
+
+void LRTPConnection::setReleased(bool released) {
+    m_released = released;
+}
+
+bool LRTPConnection::isReleased() {
+    return m_released;
+}
+
+void LRTPConnection::setPriority(LRTPPriority priority) {
+    LRTPLock lock(m_owner);
+    // CONTROL is reserved for frames without data
+    m_priority = priority == LRTPPriority::CONTROL ? LRTPPriority::DATA : priority;
+}
+
+LRTPPriority LRTPConnection::getPriority() {
+    return m_priority;
+}
+
+void LRTPConnection::setWeight(uint8_t weight) {
+    LRTPLock lock(m_owner);
+    m_weight = max(weight, (uint8_t)1);
+}
+
+uint8_t LRTPConnection::getWeight() {
+    return m_weight;
+}
+
+LRTPLinkState &LRTPConnection::getLink() {
+    return m_link;
+}
+
+LRTPFec &LRTPConnection::getFec() {
+    return m_fec;
+}
+
+const LRTPRttStats &LRTPConnection::getRtt() {
+    return m_rtt;
+}
+
+const LRTPCongestionStats &LRTPConnection::getCongestion() {
+    return m_congestion;
+}
+
+void LRTPConnection::notifyOwner() {
+    if (m_owner != nullptr)
+        m_owner->wake();
 }
 
 bool LRTPConnection::isReadyForTransmit() {
     // we can transmit a packet if there is data in the send buffer, or if we need
     // to send a control packet
-    bool dataWaitingForTransmit = m_txDataBuffer.count() > 0;
-    bool connectionOpen = m_connectionState == LRTPConnState::CONNECTED;
+    bool dataWaitingForTransmit = txDataDue();
+    // the data written before close() is still sent
+    bool connectionOpen = m_connectionState == LRTPConnState::CONNECTED || m_connectionState == LRTPConnState::CLOSE_FIN;
 
     uint8_t positionInWindow = m_currentSeqNum - m_seqBase;
 
-    bool canTransmitData = connectionOpen && ((dataWaitingForTransmit && positionInWindow < m_windowSize) || (positionInWindow < m_txWindow.count()));
+    bool canTransmitData =
+        connectionOpen && ((positionInWindow < getSendWindow() && (dataWaitingForTransmit || positionInWindow < m_txWindow.count())) || m_resendMask != 0);
 
     if (m_sendPiggybackPacket || canTransmitData) {
         lrtp_infof("[%u] dataWaiting: %u, connectionOpen: %u, canTransmit: %u, sendPiggyback: %u\n",
@@ -162,46 +285,137 @@ bool LRTPConnection::isReadyForTransmit() {
             canTransmitData,
             m_sendPiggybackPacket);
     }
-    return m_sendPiggybackPacket || canTransmitData;
+    return m_sendPiggybackPacket || canTransmitData || m_link.reportDue || m_fec.parityDue() || m_fec.reportDue();
+}
+
+LRTPPriority LRTPConnection::getTxPriority() {
+    // data is sent in preference to a piggyback packet, see getNextTxPacket()
+    bool connectionOpen = m_connectionState == LRTPConnState::CONNECTED || m_connectionState == LRTPConnState::CLOSE_FIN;
+    uint8_t positionInWindow = m_currentSeqNum - m_seqBase;
+    bool canTransmitData = connectionOpen && ((positionInWindow < getSendWindow() && (txDataDue() || positionInWindow < m_txWindow.count())) ||
+                                                 m_resendMask != 0);
+    if (m_link.reportDue)
+        return LRTPPriority::CONTROL;
+    if (m_fec.parityDue())
+        return m_priority;
+    return canTransmitData && !m_fec.reportDue() ? m_priority : LRTPPriority::CONTROL;
+}
+
+size_t LRTPConnection::getNextTxPayloadLength() {
+    // mirrors the choice made by getNextTxPacket()
+    if (m_link.reportDue)
+        return LRTP_RATE_PAYLOAD_SZ;
+    if (m_fec.parityDue())
+        return m_fec.getParityLength();
+    if (m_fec.reportDue())
+        return LRTP_FEC_REPORT_SZ;
+    if (optionsDue())
+        return LRTP_OPTIONS_SZ;
+    const int resendIndex = getResendIndex();
+    if (resendIndex >= 0)
+        return m_txWindow[resendIndex]->payloadLength;
+    const uint8_t relativeSeqNo = m_currentSeqNum - m_seqBase;
+    if (relativeSeqNo < getSendWindow()) {
+        if (relativeSeqNo < m_txWindow.count())
+            return m_txWindow[relativeSeqNo]->payloadLength;
+        if (m_connectionState == LRTPConnState::CONNECTED || m_connectionState == LRTPConnState::CONNECT_SYN_ACK ||
+            m_connectionState == LRTPConnState::CLOSE_FIN)
+            return txDataDue() ? min(getTxBytesWaiting(), getDataPayloadLimit()) : 0;
+    }
+    return 0;
+}
+
+void LRTPConnection::setMaxPayload(size_t maxPayload) {
+    m_maxPayload = min(maxPayload, (size_t)LRTP_MAX_PAYLOAD_SZ);
+}
+
+void LRTPConnection::setCapabilities(uint8_t capabilities, uint16_t connectionId) {
+    m_capabilities = capabilities;
+    m_connectionId = connectionId;
+}
+
+uint8_t LRTPConnection::getCapabilities() {
+    return m_capabilities;
+}
+
+uint16_t LRTPConnection::getConnectionId() {
+    return m_connectionId;
+}
+
+void LRTPConnection::resolveCompactPacket(LRTPPacket &packet, bool ackOnly) {
+    packet.src = m_destAddr;
+    packet.dest = m_srcAddr;
+    if (ackOnly)
+        packet.seqNum = m_nextAckNum;
+}
+
+void LRTPConnection::setTimeouts(unsigned long packetTimeout, unsigned long piggybackTimeout) {
+    m_rtt.rto = constrain(packetTimeout, m_minTimeout, m_maxTimeout);
+    m_piggybackTimeout = piggybackTimeout;
+}
+
+void LRTPConnection::setTimeoutBounds(unsigned long minTimeout, unsigned long maxTimeout) {
+    m_minTimeout = minTimeout;
+    m_maxTimeout = max(minTimeout, maxTimeout);
+    m_rtt.rto = constrain(m_rtt.rto, m_minTimeout, m_maxTimeout);
 }
 
 LRTPPacket *LRTPConnection::prepareNextPacket() {
-    lrtp_infof("[%u] Creating LRTP Packet, payload size: %u bytes\n", m_destAddr, m_txDataBuffer.count());
+    lrtp_infof("[%u] Creating LRTP Packet, payload size: %u bytes\n", m_destAddr, getTxBytesWaiting());
     // check if we're connected
     if (!(m_connectionState == LRTPConnState::CONNECTED /*|| m_connectionState == LRTPConnState::CONNECT_SYN*/ ||
-            m_connectionState == LRTPConnState::CONNECT_SYN_ACK)) {
+            m_connectionState == LRTPConnState::CONNECT_SYN_ACK || m_connectionState == LRTPConnState::CLOSE_FIN)) {
         lrtp_infof("[%u] NOT CONNECTED\n", m_destAddr);
         return nullptr;
     }
     // check that there is data waiting to transmit and that there is space inside
     // the transmit window to queue the packet
-    size_t bytesWaiting = m_txDataBuffer.count();
-    if (bytesWaiting > 0 && m_txWindow.count() < m_windowSize) {
+    size_t bytesWaiting = getTxBytesWaiting();
+    if (txDataDue() && m_txWindow.count() < m_windowSize) {
         // get the next free packet in the queue
         LRTPPacket *nextPacket = m_txWindow.enqueueEmpty();
         if (nextPacket != nullptr) {
-            const int packetPayloadSz = min(m_txDataBuffer.count(), (size_t)LRTP_MAX_PAYLOAD_SZ);
-            if (packetPayloadSz > 0) {
-                lrtp_infof(" TODO: arena allocator/stack?\n");
-                // TODO: arena allocator/stack?
-                uint8_t *payloadBuff = (uint8_t *)malloc(sizeof(uint8_t) * packetPayloadSz);
-
-                nextPacket->payload = payloadBuff;
-                // copy payload to packet struct
-                for (int i = 0; i < packetPayloadSz; i++) {
-                    *(payloadBuff++) = *m_txDataBuffer.dequeue();
-                }
+            size_t packetPayloadSz = min(bytesWaiting, getDataPayloadLimit());
+            if (useCompression()) {
+                // compressed once, retransmissions resend this payload from
+                // the frame buffer. Compress straight into it unless its free
+                // space wraps around before a whole payload would fit
+                uint8_t compressed[LRTP_MAX_PAYLOAD_SZ];
+                const size_t offset = m_txFrameBuffer.count();
+                size_t room;
+                uint8_t *out = m_txFrameBuffer.writeRegion(room);
+                const bool inPlace = room >= getDataPayloadLimit();
+                packetPayloadSz = m_compressor.compress(m_txDataBuffer, LRTP_LZ_MAX_FRAME_DATA, inPlace ? out : compressed, getDataPayloadLimit());
+                if (inPlace)
+                    m_txFrameBuffer.commit(packetPayloadSz);
+                else
+                    m_txFrameBuffer.enqueue(compressed, packetPayloadSz);
+                setTxPayload(*nextPacket, m_txFrameBuffer, offset, packetPayloadSz);
             } else {
-                lrtp_infof("Packet with no payload\n");
-                nextPacket->payload = nullptr;
+                // the payload is sent from the data buffer, where it stays
+                // until it is acknowledged
+                setTxPayload(*nextPacket, m_txDataBuffer, m_txInFlight, packetPayloadSz);
+                m_txInFlight += packetPayloadSz;
             }
+            // the data left waits for the next frame to fill again
+            const size_t taken = bytesWaiting - getTxBytesWaiting();
+            m_txPushed = m_txPushed > taken ? m_txPushed - taken : 0;
+            m_coalesceTimer.cancel();
+            m_coalesceExpired = false;
+            holdTxData();
             // set "static" header fields
-            nextPacket->payloadLength = packetPayloadSz;
             nextPacket->version = LRTP_DEFAULT_VERSION;
             nextPacket->payloadType = LRTP_DEFAULT_TYPE;
             nextPacket->src = m_srcAddr;
             nextPacket->dest = m_destAddr;
 
+            // frames sent while closing are not protected, the FIN must not be
+            // lost with a frame rebuilt from parity
+            if (useFec() && m_connectionState == LRTPConnState::CONNECTED) {
+                m_fec.addTxFrame(m_currentSeqNum, *nextPacket);
+                if (getTxBytesWaiting() == 0)
+                    m_fec.flushTxBlock();
+            }
             return nextPacket;
         } else {
             lrtp_infof("Could not enqueue empty packet\n");
@@ -212,11 +426,46 @@ LRTPPacket *LRTPConnection::prepareNextPacket() {
     return nullptr;
 }
 
+LRTPPacket *LRTPConnection::prepareRatePacket() {
+    m_ratePacket = {};
+    m_ratePacket.version = LRTP_DEFAULT_VERSION;
+    m_ratePacket.payloadType = LRTP_TYPE_RATE;
+    m_ratePacket.src = m_srcAddr;
+    m_ratePacket.dest = m_destAddr;
+    m_ratePacket.payload = m_ratePayload;
+    m_ratePacket.payloadLength = m_owner->m_rateControl.prepareReport(m_link, m_ratePayload, millis());
+    return &m_ratePacket;
+}
+
+LRTPPacket *LRTPConnection::prepareFecPacket(uint8_t payloadType) {
+    m_fecPacket = {};
+    m_fecPacket.version = LRTP_DEFAULT_VERSION;
+    m_fecPacket.payloadType = payloadType;
+    m_fecPacket.src = m_srcAddr;
+    m_fecPacket.dest = m_destAddr;
+    if (payloadType == LRTP_TYPE_PARITY)
+        m_fec.prepareParity(m_fecPacket);
+    else
+        m_fec.prepareReport(m_fecPacket);
+    return &m_fecPacket;
+}
+
 LRTPPacket *LRTPConnection::getNextTxPacket() {
     lrtp_infof("[%u] getNextTxPacket() begin\n", m_destAddr);
 
+    // rate reports go out before anything else, they are not sequenced
+    if (m_link.reportDue && m_owner != nullptr)
+        return prepareRatePacket();
+    // parity follows the block it protects
+    if (m_fec.parityDue())
+        return prepareFecPacket(LRTP_TYPE_PARITY);
+    if (m_fec.reportDue())
+        return prepareFecPacket(LRTP_TYPE_FEC_REPORT);
+
     LRTPPacket *nextPacket = nullptr;
     const uint8_t relativeSeqNo = m_currentSeqNum - m_seqBase;
+    // selective repeat sends the frames the peer is missing before new ones
+    const int resendIndex = optionsDue() ? -1 : getResendIndex();
 
     // TODO: What is this?
     lrtp_infof("[%u] DEBUG LRTP connection state: relativeSeqNo %u (m_currentSeqNum (%u) - (m_seqBase (%u)) < m_windowSize (%u)\n",
@@ -226,8 +475,14 @@ LRTPPacket *LRTPConnection::getNextTxPacket() {
         m_seqBase,
         m_windowSize);
 
-    // implement ARQ Go Back N
-    if (relativeSeqNo < m_windowSize) {
+    if (resendIndex >= 0) {
+        lrtp_infof("[%u] Selective resend of Seq: %u\n", m_destAddr, (uint8_t)(m_seqBase + resendIndex));
+        m_resendMask &= ~(1 << resendIndex);
+        nextPacket = m_txWindow[resendIndex];
+        // an ACK may now be for either copy of a frame
+        m_rttTiming = false;
+    } else if (relativeSeqNo < getSendWindow() && !optionsDue()) {
+        // implement ARQ Go Back N
         lrtp_infof("Assertion: [%u] (relativeSeqNo < m_windowSize): entire window not sent yet. check if we are ready for the next packet. relativeSeqNo (%d) "
                    "< m_txWindow.count() (%d)\n",
             m_destAddr,
@@ -238,11 +493,17 @@ LRTPPacket *LRTPConnection::getNextTxPacket() {
         if (relativeSeqNo < m_txWindow.count() && m_txWindow.count() > 0) {
             // get packet from buffer
             nextPacket = m_txWindow[relativeSeqNo];
+            m_rttTiming = false;
         } else {
             // fill buffer with next packet to send
             nextPacket = prepareNextPacket();
             if (!nextPacket) {
                 lrtp_infof("[%u] prepareNextPacket returned null!\n", m_destAddr);
+            } else {
+                // time the newest frame, sent for the first time
+                m_rttTiming = true;
+                m_rttSeq = m_currentSeqNum;
+                m_rttStart = millis();
             }
         }
     } else {
@@ -257,24 +518,29 @@ LRTPPacket *LRTPConnection::getNextTxPacket() {
     if (nextPacket == nullptr && m_sendPiggybackPacket) {
         lrtp_infof("[%u] SENDING PIGGYBACK\n", m_destAddr);
         nextPacket = &m_piggybackPacket;
+        // SYN frames without data announce our capabilities
+        bool options = optionsDue();
+        m_optionsPayload[0] = m_capabilities;
+        m_optionsPayload[1] = m_connectionId >> 0x08;
+        m_optionsPayload[2] = m_connectionId & 0xff;
+        nextPacket->payloadType = options ? LRTP_TYPE_OPTIONS : LRTP_DEFAULT_TYPE;
+        nextPacket->payload = options ? m_optionsPayload : nullptr;
+        nextPacket->payloadLength = options ? LRTP_OPTIONS_SZ : 0;
     }
     if (nextPacket != nullptr) {
-
-        // set FIN flag on final packet if closing connection
-        if (m_connectionState == LRTPConnState::CLOSE_FIN && relativeSeqNo >= m_txWindow.count()) {
-
-            lrtp_infof("[%u] FINAL PACKET Seq: %u\n", m_destAddr, m_currentSeqNum);
-            m_sendPiggybackPacket = true;
-            m_piggybackFlags.fin = true;
-        }
-
         setTxPacketHeader(*nextPacket);
-        if (nextPacket->payloadLength > 0) {
+        if (resendIndex >= 0) {
+            // sent again out of order, the next sequence number is unchanged
+            nextPacket->seqNum = m_seqBase + resendIndex;
+            startPacketTimeoutTimer();
+        } else if (nextPacket->payloadLength > 0 && nextPacket->payloadType == LRTP_DEFAULT_TYPE) {
+            // handshake options don't take a sequence number
             incrementSeqNum();
 
             // start the timeout timer
             startPacketTimeoutTimer();
         }
+
     } else {
 
         lrtp_infof("Error: [%u] Could not get next packet\n", m_destAddr);
@@ -291,24 +557,110 @@ void LRTPConnection::setTxPacketHeader(LRTPPacket &packet) {
         // we have handled the piggybacking
         m_sendPiggybackPacket = false;
         // stop the piggyback timer
-        m_timer_piggybackTimeoutActive = false;
+        m_piggybackTimer.cancel();
     } else {
         packet.flags.ack = true;
         packet.flags.syn = false;
         packet.flags.fin = false;
     }
-    packet.ackWindow = m_windowSize;
+    // every frame sent after our FIN repeats it, until the peer's FIN arrives
+    if (m_connectionState == LRTPConnState::CLOSE_FIN_ACK)
+        packet.flags.fin = true;
+    // list the frames held after a lost one
+    packet.sackBitmap = packet.flags.ack && useSelectiveRepeat() ? m_reorder.getSackBitmap(m_nextAckNum) : 0;
+    packet.flags.sack = packet.sackBitmap != 0;
+    packet.ackWindow = getReceiveWindow();
+    m_advertisedWindow = packet.ackWindow;
 
     packet.seqNum = m_currentSeqNum;
     packet.ackNum = m_nextAckNum;
+    packet.compact = useCompactHeader(packet);
+    packet.connectionId = m_peerConnectionId;
+}
+
+bool LRTPConnection::useCompactHeader(const LRTPPacket &packet) {
+    if (!(m_capabilities & m_peerCapabilities & LRTP_CAP_COMPACT) || packet.flags.syn || packet.payloadType != LRTP_DEFAULT_TYPE)
+        return false;
+    // relays need the addresses of the frames they forward
+    return m_owner == nullptr || m_owner->m_router.nextHop(m_destAddr, millis()) == m_destAddr;
+}
+
+void LRTPConnection::handleOptions(const LRTPPacket &packet) {
+    if (packet.payloadType != LRTP_TYPE_OPTIONS || packet.payloadLength < LRTP_OPTIONS_SZ) {
+        m_peerCapabilities = 0;
+        return;
+    }
+    m_peerCapabilities = packet.payload[0];
+    m_peerConnectionId = (packet.payload[1] << 0x08) | packet.payload[2];
+}
+
+bool LRTPConnection::useCompression() {
+    return m_capabilities & m_peerCapabilities & LRTP_CAP_LZSS;
+}
+
+bool LRTPConnection::useFec() {
+    return m_capabilities & m_peerCapabilities & LRTP_CAP_FEC;
+}
+
+bool LRTPConnection::useSelectiveRepeat() {
+    return m_capabilities & m_peerCapabilities & LRTP_CAP_SACK;
+}
+
+int LRTPConnection::getResendIndex() {
+    for (size_t i = 0; i < m_txWindow.count(); i++) {
+        if (m_resendMask & (1 << i))
+            return i;
+    }
+    return -1;
+}
+
+void LRTPConnection::resendUnacked() {
+    m_resendMask = ((1 << m_txWindow.count()) - 1) & ~m_sackedMask;
+}
+
+size_t LRTPConnection::getDataPayloadLimit() {
+    size_t limit = m_maxPayload;
+    // a parity frame is as long as the longest frame of its block
+    if (useFec())
+        limit -= LRTP_PARITY_HEADER_SZ;
+    // data frames may carry a SACK bitmap
+    if (useSelectiveRepeat())
+        limit -= LRTP_SACK_SZ;
+    return limit;
+}
+
+bool LRTPConnection::optionsDue() {
+    return m_sendPiggybackPacket && m_piggybackFlags.syn && m_capabilities != 0;
 }
 
 bool LRTPConnection::handleStateClosed(const LRTPPacket &packet) {
     lrtp_infof("[%u] handleStateClosed begin\n", m_destAddr);
 
-    if (packet.flags.syn && !packet.flags.ack && packet.payloadLength == 0) {
+    if (packet.flags.fin && !packet.flags.syn) {
+        // the peer did not get the FIN we answered its FIN with
+        m_piggybackFlags = {
+            .syn = false,
+            .fin = true,
+            .ack = true,
+            .sack = false,
+        };
+        m_sendPiggybackPacket = true;
+        notifyOwner();
+        return false;
+    }
+    if (packet.flags.syn && !packet.flags.ack && (packet.payloadLength == 0 || packet.payloadType == LRTP_TYPE_OPTIONS)) {
+        handleOptions(packet);
+        m_compressor.reset();
+        m_decompressor.reset();
         // set up acknowledgement number
         m_nextAckNum = packet.seqNum + 1;
+        m_reorder.clear();
+        m_fec.reset(m_nextAckNum);
+        m_sackedMask = 0;
+        m_resendMask = 0;
+        m_packetRetries = 0;
+        m_remoteWindowSize = packet.ackWindow;
+        resetCongestion();
         // set random sequence number
         m_currentSeqNum = random(0, 256);
 
@@ -318,6 +670,7 @@ bool LRTPConnection::handleStateClosed(const LRTPPacket &packet) {
             .syn = true,
             .fin = false,
             .ack = true,
+            .sack = false,
         };
         m_sendPiggybackPacket = true;
         // set state to CONNECT_SYN_ACK
@@ -336,7 +689,11 @@ bool LRTPConnection::handleStateClosed(const LRTPPacket &packet) {
 bool LRTPConnection::handleStateConnectSYN(const LRTPPacket &packet) {
     lrtp_infof("[%u] handleStateConnectSYN begin\n", m_destAddr);
     if (packet.flags.syn && packet.flags.ack && packet.ackNum == m_currentSeqNum + 1) {
+        handleOptions(packet);
         m_nextAckNum = packet.seqNum + 1;
+        m_reorder.clear();
+        m_fec.reset(m_nextAckNum);
+        m_remoteWindowSize = packet.ackWindow;
 
         incrementSeqNum();
         m_seqBase = m_currentSeqNum;
@@ -345,9 +702,11 @@ bool LRTPConnection::handleStateConnectSYN(const LRTPPacket &packet) {
             .syn = false,
             .fin = false,
             .ack = true,
+            .sack = false,
         };
         // stop packet timeout timer
-        m_timer_packetTimeoutActive = false;
+        m_packetTimer.cancel();
+        m_packetRetries = 0;
 
         startPiggybackTimeoutTimer();
         // set state to connected
@@ -367,6 +726,7 @@ bool LRTPConnection::handleStateConnectSYN(const LRTPPacket &packet) {
             .syn = true,
             .fin = false,
             .ack = false,
+            .sack = false,
         };
        
         m_sendPiggybackPacket = true;
@@ -383,6 +743,7 @@ bool LRTPConnection::handleStateConnectSYNACK(const LRTPPacket &packet) {
     if (packet.flags.ack && packet.seqNum == m_nextAckNum) {
         incrementSeqNum();
         m_seqBase = m_currentSeqNum;
+        m_packetRetries = 0;
         setConnectionState(LRTPConnState::CONNECTED);
         return true;
     } else {
@@ -393,6 +754,7 @@ bool LRTPConnection::handleStateConnectSYNACK(const LRTPPacket &packet) {
             .syn = true,
             .fin = false,
             .ack = true,
+            .sack = false,
         };
         m_sendPiggybackPacket = true;
         // TODO timeout:
@@ -405,19 +767,36 @@ bool LRTPConnection::handleStateConnectSYNACK(const LRTPPacket &packet) {
 bool LRTPConnection::handleStateConnected(const LRTPPacket &packet) {
     lrtp_infof("[%u] handleStateConnected() begin\n", m_destAddr);
 
-    const bool hasPayload = packet.payloadLength > 0;
-
-    if (packet.seqNum == m_nextAckNum) {
+    // handshake options are not data
+    const bool hasPayload = packet.payloadLength > 0 && packet.payloadType == LRTP_DEFAULT_TYPE;
+    if (hasPayload && useFec())
+        m_fec.observe(packet.seqNum);
+
+    if (packet.seqNum == m_nextAckNum && hasPayload && !hasRxRoom(packet.payloadLength)) {
+        // the receive buffer is full. The frame is kept and delivered once the
+        // application reads, or else sent again by the peer. It is not
+        // acknowledged until then
+        lrtp_infof("WARNING: [%u] Receive buffer full, Seq: %u\n", m_destAddr, packet.seqNum);
+        m_reorder.keep(packet);
+        if (packet.flags.ack)
+            handlePacketAckFlag(packet);
+        return false;
+    } else if (packet.seqNum == m_nextAckNum) {
         // valid packet
         if (hasPayload) {
+            // kept until the parity of its block has been received
+            if (useFec() && m_fec.wantsParity())
+                m_reorder.keep(packet);
             // m_currentAckNum = m_nextAckNum;
             m_nextAckNum++;
+            // no block reaching the next frame can start this far back
+            m_reorder.release(m_nextAckNum - LRTP_FEC_MAX_BLOCK);
         }
         if (packet.flags.ack) {
             handlePacketAckFlag(packet);
         }
         if (packet.flags.fin) {
-            setConnectionState(LRTPConnState::CLOSE_FIN);
+            onFinReceived();
         }
         if (hasPayload) {
             // we need to send an ACK for this payload
@@ -425,12 +804,18 @@ bool LRTPConnection::handleStateConnected(const LRTPPacket &packet) {
                 .syn = false,
                 .fin = false,
                 .ack = true,
+                .sack = false,
             };
             // start piggyback timer
             startPiggybackTimeoutTimer();
         }
         return true;
     } else {
+        // a frame ahead of a lost one is kept, and delivered once the lost
+        // frame is rebuilt from parity or sent again
+        const uint8_t ahead = packet.seqNum - m_nextAckNum;
+        if (hasPayload && ahead < LRTP_TX_PACKET_BUFFER_SZ && (useSelectiveRepeat() || (useFec() && m_fec.wantsParity())))
+            m_reorder.keep(packet);
         lrtp_infof("WARNING: [%u] Invalid Sequence number: %u\n", m_destAddr, packet.seqNum);
         // packet has an invalid sequence number
         // send an ack for the last acknowledged sequence number to trigger a full
@@ -439,6 +824,7 @@ bool LRTPConnection::handleStateConnected(const LRTPPacket &packet) {
             .syn = false,
             .fin = false,
             .ack = true,
+            .sack = false,
         };
         // TODO: start piggyback timer
         startPiggybackTimeoutTimer();
@@ -448,6 +834,7 @@ bool LRTPConnection::handleStateConnected(const LRTPPacket &packet) {
 
 void LRTPConnection::handleIncomingPacket(const LRTPPacket &packet) {
     lrtp_infof(" ==== [%u] Handle %s === \n", m_destAddr, connStateToStr(m_connectionState)) bool validPacket = false;
+    m_lastReceived = millis();
     switch (m_connectionState) {
     case LRTPConnState::CLOSED:
         validPacket = handleStateClosed(packet);
@@ -470,9 +857,15 @@ void LRTPConnection::handleIncomingPacket(const LRTPPacket &packet) {
         break;
 
     case LRTPConnState::CLOSE_FIN_ACK:
-        // Serial.printf(" ==== Error: [%u] Unimplemented State %s ===\n", m_destAddr, connStateToStr(m_connectionState));
-        lrtp_infof(" ==== Error: [%u] Unimplemented State %s ===\n", m_destAddr, connStateToStr(m_connectionState));
-        m_connectionError = LRTPError::CLOSE_FIN_ACK;
+        // the peer may still be sending data before its FIN
+        validPacket = handleStateConnected(packet);
+        if (m_connectionState == LRTPConnState::CLOSE_FIN_ACK) {
+            if (validPacket)
+                m_packetRetries = 0;
+            // an ACK stops the timer, keep repeating the FIN
+            if (!m_packetTimer.isActive())
+                startPacketTimeoutTimer();
+        }
         break;
     default:
         m_connectionError = LRTPError::INVALID_STATE;
@@ -480,22 +873,236 @@ void LRTPConnection::handleIncomingPacket(const LRTPPacket &packet) {
         lrtp_infof("[%u] Invalid state: %s\n", m_destAddr, connStateToStr(m_connectionState));
     }
     // copy payload into rx buffer
-    if (validPacket && packet.payloadLength > 0) {
-        // TODO: use circular buffer on receive side too?
-        memcpy(m_rxBuffer, packet.payload, sizeof(uint8_t) * packet.payloadLength);
-        m_rxBuffLen = packet.payloadLength;
-        m_rxBuffPos = 0;
+    if (validPacket && packet.payloadLength > 0 && packet.payloadType == LRTP_DEFAULT_TYPE) {
+        // handleStateConnected() checked that the data fits
+        if (useCompression()) {
+            // decompress straight into the buffer unless the free space wraps
+            // around before a whole frame's data would fit
+            uint8_t data[LRTP_LZ_MAX_FRAME_DATA];
+            size_t room;
+            uint8_t *out = m_rxBuffer.writeRegion(room);
+            const bool inPlace = room >= LRTP_LZ_MAX_FRAME_DATA;
+            if (!inPlace) {
+                out = data;
+                room = sizeof(data);
+            }
+            size_t length = 0;
+            if (!m_decompressor.decompress(packet.payload, packet.payloadLength, out, room, length)) {
+                lrtp_infof("ERROR: [%u] Invalid compressed payload\n", m_destAddr);
+                m_connectionError = LRTPError::INVALID_PAYLOAD;
+                length = 0;
+            }
+            if (inPlace)
+                m_rxBuffer.commit(length);
+            else
+                m_rxBuffer.enqueue(data, length);
+        } else {
+            m_rxBuffer.enqueue(packet.payload, packet.payloadLength);
+        }
         // call the callback function for this connection
         if (m_onDataReceived != nullptr) {
             m_onDataReceived();
         }
     }
+    deliverKeptFrames();
+}
+
+void LRTPConnection::handleFecPacket(const LRTPPacket &packet) {
+    if (!useFec() || !(m_connectionState == LRTPConnState::CONNECTED || m_connectionState == LRTPConnState::CLOSE_FIN ||
+                          m_connectionState == LRTPConnState::CLOSE_FIN_ACK))
+        return;
+    if (packet.payloadType == LRTP_TYPE_FEC_REPORT) {
+        if (packet.payloadLength >= LRTP_FEC_REPORT_SZ)
+            m_fec.setBlockSize(packet.payload[0]);
+        return;
+    }
+    // the peer is still sending, acknowledge at the end of its burst
+    if (m_piggybackTimer.isActive())
+        startPiggybackTimeoutTimer();
+    if (m_fec.recover(packet, m_nextAckNum))
+        deliverKeptFrames();
+}
+
+void LRTPConnection::deliverKeptFrames() {
+    if (m_deliveringKept)
+        return;
+    m_deliveringKept = true;
+    LRTPPacket packet;
+    while (m_reorder.get(m_nextAckNum, packet) && hasRxRoom(packet.payloadLength)) {
+        packet.src = m_destAddr;
+        packet.dest = m_srcAddr;
+        handleIncomingPacket(packet);
+        // still needed if its block's parity has not arrived
+        if (!(useFec() && m_fec.wantsParity()))
+            m_reorder.release(packet.seqNum);
+    }
+    m_deliveringKept = false;
+}
+
+size_t LRTPConnection::getTxBytesWaiting() {
+    return m_txDataBuffer.count() - m_txInFlight;
+}
+
+bool LRTPConnection::txDataDue() {
+    const size_t waiting = getTxBytesWaiting();
+    if (waiting == 0)
+        return false;
+    // compressed frames carry up to LRTP_LZ_MAX_FRAME_DATA bytes of data
+    const size_t frameData = useCompression() ? LRTP_LZ_MAX_FRAME_DATA : getDataPayloadLimit();
+    if (m_coalesceFill == 0 || waiting >= min(m_coalesceFill, frameData) || m_txPushed > 0 || m_coalesceExpired)
+        return true;
+    // Nagle's algorithm: a short frame may go when no frame is waiting to be
+    // acknowledged
+    return !m_corked && m_txWindow.count() == 0;
+}
+
+void LRTPConnection::holdTxData() {
+    // held data is sent after at most the coalescing delay, counted from when
+    // it started waiting
+    if (!m_coalesceTimer.isActive() && m_owner != nullptr && getTxBytesWaiting() > 0 && !txDataDue())
+        m_owner->m_timers.start(m_coalesceTimer, m_coalesceDelay, millis());
+}
+
+void LRTPConnection::onCoalesceTimeout() {
+    lrtp_infof("[%u] Sending the data held for %lu ms\n", m_destAddr, m_coalesceDelay);
+    m_coalesceExpired = true;
+}
+
+void LRTPConnection::setTxPayload(LRTPPacket &packet, CircularBuffer<uint8_t, LRTP_TX_DATA_BUFFER_SZ> &buffer, size_t offset, size_t length) {
+    size_t first = 0;
+    packet.payload = buffer.peekRegion(offset, first);
+    packet.payloadLength = length;
+    // the rest of a payload that wraps around the end of the buffer
+    packet.wrapLength = length - min(first, length);
+    size_t rest = 0;
+    packet.wrapPayload = packet.wrapLength > 0 ? buffer.peekRegion(offset + first, rest) : nullptr;
+}
+
+bool LRTPConnection::hasRxRoom(size_t payloadLength) {
+    // a compressed frame may expand to LRTP_LZ_MAX_FRAME_DATA bytes
+    size_t length = useCompression() ? LRTP_LZ_MAX_FRAME_DATA : payloadLength;
+    return m_rxBuffer.size() - m_rxBuffer.count() >= length;
+}
+
+uint8_t LRTPConnection::getReceiveWindow() {
+    size_t frameLength = useCompression() ? LRTP_LZ_MAX_FRAME_DATA : LRTP_MAX_PAYLOAD_SZ;
+    return min((m_rxBuffer.size() - m_rxBuffer.count()) / frameLength, (size_t)LRTP_MAX_ACKWIN);
+}
+
+void LRTPConnection::onRxRead() {
+    deliverKeptFrames();
+    // let the peer know as soon as its window opens again, rather than leave
+    // it waiting for its retransmission timeout
+    if (m_advertisedWindow == 0 && m_connectionState == LRTPConnState::CONNECTED && getReceiveWindow() > 0) {
+        m_piggybackFlags = {
+            .syn = false,
+            .fin = false,
+            .ack = true,
+            .sack = false,
+        };
+        m_sendPiggybackPacket = true;
+        m_advertisedWindow = getReceiveWindow();
+        notifyOwner();
+    }
+}
+
+bool LRTPConnection::owesAck() {
+    if (m_connectionState != LRTPConnState::CONNECTED)
+        return false;
+    // only plain ACKs, SYN and FIN frames are always sent on their own
+    if (m_piggybackFlags.syn || m_piggybackFlags.fin || !m_piggybackFlags.ack)
+        return false;
+    if (!m_sendPiggybackPacket && !m_piggybackTimer.isActive())
+        return false;
+    // an aggregate ACK has no room for a SACK bitmap
+    if (useSelectiveRepeat() && m_reorder.getSackBitmap(m_nextAckNum) != 0)
+        return false;
+    // an ACK which can ride on a data frame is sent with it
+    return getTxPriority() == LRTPPriority::CONTROL;
+}
+
+void LRTPConnection::takeAck(uint8_t &ackNum, uint8_t &window) {
+    m_sendPiggybackPacket = false;
+    m_piggybackTimer.cancel();
+    ackNum = m_nextAckNum;
+    window = getReceiveWindow();
+    m_advertisedWindow = window;
+}
+
+void LRTPConnection::handleAggregateAck(uint8_t ackNum, uint8_t window) {
+    if (m_connectionState != LRTPConnState::CONNECTED && m_connectionState != LRTPConnState::CLOSE_FIN &&
+        m_connectionState != LRTPConnState::CLOSE_FIN_ACK)
+        return;
+    lrtp_infof("[%u] Aggregate ACK: %u\n", m_destAddr, ackNum);
+    m_lastReceived = millis();
+    LRTPPacket packet = {};
+    packet.flags.ack = true;
+    packet.ackNum = ackNum;
+    packet.ackWindow = window;
+    handlePacketAckFlag(packet);
 }
 
 void LRTPConnection::setConnectionState(LRTPConnState newState) {
     lrtp_infof("[%u] Connection change state: %s -> %s\n", m_destAddr, connStateToStr(m_connectionState), connStateToStr(newState));
 
+    LRTPConnState oldState = m_connectionState;
     m_connectionState = newState;
+    if (newState == LRTPConnState::CLOSED && oldState != LRTPConnState::CLOSED)
+        onClosed();
+}
+
+void LRTPConnection::sendFinIfDone() {
+    if (m_connectionState != LRTPConnState::CLOSE_FIN || m_txDataBuffer.count() > 0 || m_txWindow.count() > 0)
+        return;
+    lrtp_infof("[%u] All data acknowledged, sending FIN\n", m_destAddr);
+    m_piggybackFlags = {
+        .syn = false,
+        .fin = true,
+        .ack = true,
+        .sack = false,
+    };
+    m_sendPiggybackPacket = true;
+    notifyOwner();
+    if (m_finReceived) {
+        // the peer is done too. It sends its FIN again if ours is lost, and
+        // that is answered from CLOSED
+        setConnectionState(LRTPConnState::CLOSED);
+    } else {
+        setConnectionState(LRTPConnState::CLOSE_FIN_ACK);
+        startPacketTimeoutTimer();
+    }
+}
+
+void LRTPConnection::onFinReceived() {
+    if (m_connectionState == LRTPConnState::CLOSE_FIN_ACK) {
+        // both ends have sent all their data
+        setConnectionState(LRTPConnState::CLOSED);
+        return;
+    }
+    if (!m_finReceived)
+        lrtp_infof("[%u] Peer closed the connection\n", m_destAddr);
+    m_finReceived = true;
+    // our data is still sent before our FIN
+    if (m_connectionState == LRTPConnState::CONNECTED)
+        setConnectionState(LRTPConnState::CLOSE_FIN);
+    sendFinIfDone();
+}
+
+void LRTPConnection::onClosed() {
+    m_packetTimer.cancel();
+    m_piggybackTimer.cancel();
+    m_coalesceTimer.cancel();
+    // nothing more is sent, apart from an answer to the peer's FIN
+    m_txWindow.consume(m_txWindow.count());
+    m_txDataBuffer.consume(m_txDataBuffer.count());
+    m_txFrameBuffer.consume(m_txFrameBuffer.count());
+    m_txInFlight = 0;
+    m_txPushed = 0;
+    m_sackedMask = 0;
+    m_resendMask = 0;
+    m_finReceived = false;
+    if (m_onClose != nullptr)
+        m_onClose();
 }
 
 void LRTPConnection::advanceSendWindow(uint16_t ackNum) {
@@ -506,21 +1113,31 @@ void LRTPConnection::advanceSendWindow(uint16_t ackNum) {
         if (oldPacket != nullptr) {
 
             lrtp_infof("[%u] Acknowledge Seq: %u\n", m_destAddr, oldPacket->seqNum);
-            if (oldPacket->payload != nullptr) {
-                // free malloced payload buffer
-                free(oldPacket->payload);
+            // the payload is no longer needed for a retransmission
+            if (useCompression()) {
+                m_txFrameBuffer.consume(oldPacket->payloadLength);
+            } else {
+                m_txDataBuffer.consume(oldPacket->payloadLength);
+                m_txInFlight -= oldPacket->payloadLength;
             }
             longSeqBase++;
         }
     }
     lrtp_infof("===== [%u] advanceSendWindow() m_currentSeqNum = %u =====\n", m_destAddr, m_seqBase);
+    const uint8_t advanced = longSeqBase - m_seqBase;
+    m_sackedMask = advanced < 8 ? m_sackedMask >> advanced : 0;
+    m_resendMask = advanced < 8 ? m_resendMask >> advanced : 0;
     m_seqBase = longSeqBase;
-    m_currentSeqNum = m_seqBase;
+    // selective repeat only sends the frames the peer is missing again,
+    // Go-Back-N resends the rest of the window
+    m_currentSeqNum = useSelectiveRepeat() ? m_seqBase + m_txWindow.count() : m_seqBase;
+    sendFinIfDone();
 }
 
 void LRTPConnection::handlePacketAckFlag(const LRTPPacket &packet) {
     // stop send timeout timer
-    m_timer_packetTimeoutActive = false;
+    m_packetTimer.cancel();
+    m_remoteWindowSize = packet.ackWindow;
 
     const size_t sendWindowCount = m_txWindow.count();
     const uint16_t sendWindowEnd = m_seqBase + sendWindowCount;
@@ -550,10 +1167,32 @@ void LRTPConnection::handlePacketAckFlag(const LRTPPacket &packet) {
 
             lrtp_infof("[%u] Acknowledge %u (m_seqBase) -> %u (packet.ackNum)\n", m_destAddr, m_seqBase, packet.ackNum);
 
+            if (m_rttTiming && (uint8_t)(m_rttSeq - m_seqBase) < adjustedAckNum - m_seqBase) {
+                m_rttTiming = false;
+                sampleRtt(millis() - m_rttStart);
+            }
+
+            const uint8_t acked = adjustedAckNum - m_seqBase;
+            // frames after the ACK are lost, they are sent again below
+            if (adjustedAckNum < sendWindowEnd)
+                onFramesLost(false);
+            else
+                onFramesAcked(acked);
             advanceSendWindow(adjustedAckNum);
             m_packetRetries = 0;
+            m_link.losses = 0;
+            if (useSelectiveRepeat()) {
+                // the bitmap lists every frame the peer holds after ackNum
+                m_sackedMask = packet.flags.sack ? packet.sackBitmap << 1 : 0;
+                resendUnacked();
+            }
+        } else if (useSelectiveRepeat()) {
+            onFramesLost(false);
+            lrtp_infof("===== [%u] seqBase = %u ===== (RESEND UNACKED FRAMES) \n", m_destAddr, m_seqBase);
+            resendUnacked();
         } else {
             // resend entire window
+            onFramesLost(false);
             lrtp_infof("===== [%u] m_currentSeqNum = %u, seqBase = $u ===== (RESEND ENTIRE WINDOW) \n", m_destAddr, m_currentSeqNum, m_seqBase);
             m_currentSeqNum = m_seqBase;
         }
@@ -562,36 +1201,127 @@ void LRTPConnection::handlePacketAckFlag(const LRTPPacket &packet) {
 
 void LRTPConnection::startPacketTimeoutTimer() {
     lrtp_infof("[%u] == Start Packet Timeout Timer ==\n", m_destAddr);
-    m_timer_packetTimeoutActive = true;
-    m_timer_packetTimeout = millis();
+    if (m_owner != nullptr)
+        m_owner->m_timers.start(m_packetTimer, m_rtt.rto, millis());
 }
 void LRTPConnection::onPacketTimeout() {
     // handle timeout
-    lrtp_infof("== [%u] Packet currentSeqNum: %u, seqBase: %u. TIMEOUT [retries %u of ?] ==\n", m_destAddr, m_currentSeqNum, m_seqBase, m_packetRetries);
+    lrtp_infof("== [%u] Packet currentSeqNum: %u, seqBase: %u. TIMEOUT [retries %u of %u] ==\n",
+        m_destAddr,
+        m_currentSeqNum,
+        m_seqBase,
+        m_packetRetries,
+        LRTP_MAX_RETRIES);
+    if (m_packetRetries >= LRTP_MAX_RETRIES) {
+        lrtp_infof("[%u] Peer not answering, closing the connection\n", m_destAddr);
+        m_sendPiggybackPacket = false;
+        setConnectionState(LRTPConnState::CLOSED);
+        return;
+    }
+    // back off until a frame is acknowledged without being sent again
+    m_rttTiming = false;
+    m_rtt.rto = min(2 * m_rtt.rto, m_maxTimeout);
+    m_rtt.timeouts++;
     if (m_connectionState == LRTPConnState::CONNECT_SYN || m_connectionState == LRTPConnState::CONNECT_SYN_ACK) {
         m_sendPiggybackPacket = true;
         startPacketTimeoutTimer();
+    } else if (m_connectionState == LRTPConnState::CLOSE_FIN_ACK) {
+        // the FIN or the peer's answer was lost
+        m_piggybackFlags = {
+            .syn = false,
+            .fin = true,
+            .ack = true,
+            .sack = false,
+        };
+        m_sendPiggybackPacket = true;
+        startPacketTimeoutTimer();
+    } else if (useSelectiveRepeat()) {
+        onFramesLost(true);
+        // the peer may have dropped frames it acknowledged selectively, once
+        // a resend times out too
+        if (m_packetRetries > 0)
+            m_sackedMask = 0;
+        resendUnacked();
+        m_packetTimer.cancel();
     } else {
+        onFramesLost(true);
         // reset nextsequencenumber to the start of the window
         m_currentSeqNum = m_seqBase;
-        // m_timer_packetTimeout = t;
-        m_timer_packetTimeoutActive = false;
+        m_packetTimer.cancel();
     }
     m_packetRetries++;
+    if (m_owner != nullptr)
+        m_owner->onConnectionTimeout(*this);
+}
+
+void LRTPConnection::sampleRtt(unsigned long rtt) {
+    if (m_rtt.samples == 0) {
+        m_rtt.srtt = rtt;
+        m_rtt.rttvar = rtt / 2;
+    } else {
+        unsigned long error = rtt > m_rtt.srtt ? rtt - m_rtt.srtt : m_rtt.srtt - rtt;
+        m_rtt.rttvar += ((long)error - (long)m_rtt.rttvar) / LRTP_RTTVAR_GAIN_DIV;
+        m_rtt.srtt += ((long)rtt - (long)m_rtt.srtt) / LRTP_RTT_GAIN_DIV;
+    }
+    m_rtt.samples++;
+    // the variance term is at least one timer tick
+    m_rtt.rto = m_rtt.srtt + max(LRTP_RTO_VAR_FACTOR * m_rtt.rttvar, (unsigned long)LRTP_TIMER_TICK);
+    m_rtt.rto = constrain(m_rtt.rto, m_minTimeout, m_maxTimeout);
+    lrtp_infof("[%u] RTT %lu ms, srtt %lu ms, rttvar %lu ms, rto %lu ms\n", m_destAddr, rtt, m_rtt.srtt, m_rtt.rttvar, m_rtt.rto);
+}
+
+uint8_t LRTPConnection::getSendWindow() {
+    // a window of at least one frame is kept open to the peer, so that a
+    // closed window is probed
+    uint8_t window = min(m_windowSize, (uint8_t)m_congestion.cwnd);
+    return max(min(window, m_remoteWindowSize), (uint8_t)1);
+}
+
+void LRTPConnection::resetCongestion() {
+    m_congestion.cwnd = LRTP_CWND_INITIAL;
+    m_congestion.ssthresh = m_windowSize;
+    m_inRecovery = false;
+}
+
+void LRTPConnection::onFramesAcked(uint8_t count) {
+    // every frame sent has been acknowledged
+    m_inRecovery = false;
+    for (uint8_t i = 0; i < count; i++) {
+        if (m_congestion.cwnd < m_congestion.ssthresh)
+            m_congestion.cwnd += 1;
+        else
+            m_congestion.cwnd += 1 / m_congestion.cwnd;
+    }
+    m_congestion.cwnd = min(m_congestion.cwnd, (float)m_windowSize);
+}
+
+void LRTPConnection::onFramesLost(bool timeout) {
+    if (m_inRecovery && !timeout)
+        return;
+    m_congestion.ssthresh = max(m_congestion.cwnd / 2, (float)LRTP_CWND_MIN);
+    if (timeout) {
+        m_congestion.cwnd = LRTP_CWND_MIN;
+        m_congestion.collapses++;
+    } else {
+        m_congestion.cwnd = m_congestion.ssthresh;
+        m_congestion.reductions++;
+    }
+    m_inRecovery = true;
+    lrtp_infof("[%u] Congestion window %.2f, threshold %.2f\n", m_destAddr, m_congestion.cwnd, m_congestion.ssthresh);
 }
 
 void LRTPConnection::startPiggybackTimeoutTimer() {
 
     lrtp_infof("== [%u] Start Piggyback Timeout Timer ==\n", m_destAddr);
 
-    m_timer_piggybackTimeoutActive = true;
-    m_timer_piggybackTimeout = millis();
+    if (m_owner != nullptr)
+        m_owner->m_timers.start(m_piggybackTimer, m_piggybackTimeout, millis());
 }
 void LRTPConnection::onPiggybackTimeout() {
 
     lrtp_infof("== [%u] Piggyback Timer TIMEOUT ==\n", m_destAddr);
 
-    m_timer_piggybackTimeoutActive = false;
+    m_piggybackTimer.cancel();
     m_sendPiggybackPacket = true;
 }
 
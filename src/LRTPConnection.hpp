@@ -4,7 +4,12 @@
 #include <functional>
 
 #include "CircularBuffer.hpp"
+#include "LRTPCompressor.hpp"
 #include "LRTPConstants.hpp"
+#include "LRTPFec.hpp"
+#include "LRTPRateControl.hpp"
+#include "LRTPReorderBuffer.hpp"
+#include "LRTPTimerWheel.hpp"
 
 #include "LRTPDebug.h"
 
@@ -12,8 +17,13 @@ class LRTP;
 
 class LRTPConnection : public Stream {
   public:
-    // constructor
-    LRTPConnection(uint16_t source, uint16_t destination);
+    /**
+     * @brief Construct a connection, see LRTPConnectionTable::create()
+     *
+     * @param rxStorage the storage of the receive ring, rxSize bytes. Owned by
+     * the caller, and must outlive the connection
+     */
+    LRTPConnection(uint16_t source, uint16_t destination, LRTP *owner, uint8_t *rxStorage, size_t rxSize);
     // destructor
     ~LRTPConnection();
 
@@ -26,9 +36,32 @@ class LRTPConnection : public Stream {
     virtual size_t write(uint8_t val) override;
     virtual size_t write(const uint8_t *buf, size_t size) override;
     using Print::write; // include "Print" methods
+    // send the data waiting at once, without waiting for a full frame
     virtual void flush() override;
     virtual int availableForWrite() override;
 
+    /**
+     * @brief Set how data written is gathered into frames. Data waits until
+     * minFill bytes are waiting (a full frame at most), until it has waited
+     * maxDelay ms, or until flush() is called. Unless the connection is
+     * corked, a short frame is also sent when no frame is waiting to be
+     * acknowledged (Nagle's algorithm), so a lone write is not delayed
+     *
+     * @param minFill the bytes to wait for, 0 to send data as soon as the
+     * window allows
+     * @param maxDelay the longest data waits (ms)
+     */
+    void setCoalescing(size_t minFill, unsigned long maxDelay);
+
+    /**
+     * @brief Hold data that does not fill a frame even when no frame is in
+     * flight, until uncork() or flush() is called or the data has waited the
+     * coalescing delay. Use around a burst of small writes
+     */
+    void cork();
+    // stop holding data, and send the data waiting
+    void uncork();
+
     /**
      * @brief opens the connection if it is currently closed (Sends SYN packet)
      *
@@ -37,7 +70,21 @@ class LRTPConnection : public Stream {
      */
     bool connect();
 
+    /**
+     * @brief Close the connection. The data already written is sent first,
+     * then a FIN, and the connection is CLOSED once the peer has sent all its
+     * data and its own FIN, or has stopped answering (LRTP_MAX_RETRIES).
+     * Data written after this call is not sent
+     *
+     * @return false if the connection is already closed
+     */
     bool close();
+
+    /**
+     * @brief Close the connection at once, without the closing handshake.
+     * Data not yet acknowledged by the peer is dropped
+     */
+    void abort();
     /**
      * @brief Attaches a callback to be called when a new packet is received for
      * this connection
@@ -48,7 +95,8 @@ class LRTPConnection : public Stream {
     void onDataReceived(std::function<void(void)> callback);
 
     /**
-     * @brief Attach a callback hander to be called when the connection closes
+     * @brief Attach a callback hander to be called when the connection closes:
+     * both ends have closed it, the peer stopped answering, or it was aborted
      *
      * @param the function to call on close
      */
@@ -58,8 +106,51 @@ class LRTPConnection : public Stream {
 
     LRTPConnState getConnectionState();
 
+    // the time a frame was last received from the peer (ms)
+    unsigned long getLastReceived();
+
+    /**
+     * @brief Set the priority class used to access the channel when sending
+     * data on this connection. Frames without data are always sent as
+     * LRTPPriority::CONTROL
+     */
+    void setPriority(LRTPPriority priority);
+    LRTPPriority getPriority();
+
+    /**
+     * @brief Set the weight of this connection in the transmit scheduler.
+     * Connections in the same priority class get airtime in proportion to
+     * their weights
+     *
+     * @param weight the weight, at least 1
+     */
+    void setWeight(uint8_t weight);
+    uint8_t getWeight();
+
+    /**
+     * @brief Get the adaptive data rate state of the link to the peer
+     */
+    LRTPLinkState &getLink();
+
+    /**
+     * @brief Get the forward error correction state of the connection, used
+     * once both ends enable it, see LRTP::setForwardErrorCorrection()
+     */
+    LRTPFec &getFec();
+
+    /**
+     * @brief Get the round trip time estimates of the connection and the
+     * retransmission timeout derived from them
+     */
+    const LRTPRttStats &getRtt();
+
+    /**
+     * @brief Get the congestion window of the connection and the number of
+     * times it has been reduced
+     */
+    const LRTPCongestionStats &getCongestion();
+
     // private:
-    void updateTimers(unsigned long t);
     /**
      * @brief Checks if the current connection is ready to transmit a packet or
      * not
@@ -69,15 +160,91 @@ class LRTPConnection : public Stream {
      */
     bool isReadyForTransmit();
 
+    /**
+     * @brief Get the priority of the next frame this connection will transmit
+     */
+    LRTPPriority getTxPriority();
+
+    /**
+     * @brief Get the payload length of the next frame this connection will
+     * transmit, so that its airtime can be checked before channel access
+     */
+    size_t getNextTxPayloadLength();
+
+    /**
+     * @brief Set the retransmission and piggyback (delayed ACK) timeouts
+     *
+     * @param packetTimeout time to wait for an ACK before resending (ms)
+     * @param piggybackTimeout time to wait for outgoing data to carry an ACK
+     * before sending an ACK only packet (ms)
+     */
+    void setTimeouts(unsigned long packetTimeout, unsigned long piggybackTimeout);
+
+    /**
+     * @brief Set the range the retransmission timeout is kept in as it adapts
+     * to the measured round trip time and backs off (ms)
+     */
+    void setTimeoutBounds(unsigned long minTimeout, unsigned long maxTimeout);
+
+    // limit the payload of the data frames sent from now on
+    void setMaxPayload(size_t maxPayload);
+
+    /**
+     * @brief Set the capabilities announced to the peer in the handshake, and
+     * the id the peer should put in compact frames sent to us
+     */
+    void setCapabilities(uint8_t capabilities, uint16_t connectionId);
+    uint8_t getCapabilities();
+    uint16_t getConnectionId();
+
+    /**
+     * @brief Fill in the addresses of a compact frame received for this
+     * connection, and the sequence number of an ACK only frame (which leaves
+     * it out) so that it is accepted in sequence
+     */
+    void resolveCompactPacket(LRTPPacket &packet, bool ackOnly);
+
     // packet handling methods
     void handleIncomingPacket(const LRTPPacket &packet);
 
+    // handle a PARITY or FEC_REPORT frame from the peer
+    void handleFecPacket(const LRTPPacket &packet);
+
+    /**
+     * @brief Returns true if the connection owes its peer an ACK that is not
+     * carried by a data frame, so that it can be sent in an aggregate ACK
+     * frame. ACKs still waiting for their piggyback timeout are included
+     */
+    bool owesAck();
+
+    /**
+     * @brief Hand the owed ACK over to an aggregate ACK frame, as if an ACK
+     * only frame had been sent
+     *
+     * @param ackNum set to the acknowledgement number
+     * @param window set to the advertised window
+     */
+    void takeAck(uint8_t &ackNum, uint8_t &window);
+
+    /**
+     * @brief Handle this connection's entry of an aggregate ACK frame received
+     * from the peer
+     */
+    void handleAggregateAck(uint8_t ackNum, uint8_t window);
+
     // LRTPPacket *getNextTxPacket(unsigned long t);
     LRTPPacket *getNextTxPacket();
 
+    // set once the application has given the connection up, see LRTP::release()
+    void setReleased(bool released);
+    bool isReleased();
+
     LRTPError m_connectionError = LRTPError::NONE;
 
   private:
+    // the LRTP instance this connection belongs to (may be null)
+    LRTP *m_owner;
+
     //  connection variables
     uint16_t m_srcAddr;
     uint16_t m_destAddr;
@@ -89,47 +256,177 @@ class LRTPConnection : public Stream {
     uint8_t m_seqBase;
     uint8_t m_windowSize;
 
-    uint8_t m_remoteWindowSize = 0;
+    uint8_t m_remoteWindowSize = LRTP_DEFAULT_ACKWIN;
+
+    LRTPCongestionStats m_congestion = {};
+    // set after the window is halved, until all frames sent are acknowledged
+    bool m_inRecovery = false;
 
     uint8_t m_packetRetries = 0;
-    // timer to handle packet timeout
-    unsigned long m_timer_packetTimeout = 0;
-    bool m_timer_packetTimeoutActive = false;
+
+    // the peer has sent its FIN, so it has no more data to send
+    bool m_finReceived = false;
+    unsigned long m_lastReceived = 0;
+    bool m_released = false;
+
+    // selective repeat: bit i is set if frame m_seqBase + i has been
+    // selectively acknowledged by the peer, or is to be sent again
+    uint8_t m_sackedMask = 0;
+    uint8_t m_resendMask = 0;
+
+    size_t m_maxPayload = LRTP_MAX_PAYLOAD_SZ;
+
+    // capabilities exchanged in the handshake, and the connection ids used in
+    // compact frames to us and to the peer
+    uint8_t m_capabilities = 0;
+    uint8_t m_peerCapabilities = 0;
+    uint16_t m_connectionId = 0;
+    uint16_t m_peerConnectionId = 0;
+    uint8_t m_optionsPayload[LRTP_OPTIONS_SZ];
+
+    // stream compression state, used once both ends announce LRTP_CAP_LZSS
+    LRTPCompressor m_compressor;
+    LRTPDecompressor m_decompressor;
+
+    // data frames received ahead of a lost frame, or kept for parity
+    LRTPReorderBuffer m_reorder;
+    LRTPFec m_fec;
+    // PARITY or FEC_REPORT frame
+    LRTPPacket m_fecPacket;
+    // set while kept frames are being delivered
+    bool m_deliveringKept = false;
+
+    unsigned long m_piggybackTimeout = LRTP_PIGGYBACK_TIMEOUT;
+    // round trip time estimates, m_rtt.rto is the packet timeout
+    LRTPRttStats m_rtt = {};
+    unsigned long m_minTimeout = 0;
+    unsigned long m_maxTimeout = LRTP_PACKET_TIMEOUT;
+    // the frame being timed: only frames acknowledged without being sent
+    // again are timed (Karn's rule)
+    bool m_rttTiming = false;
+    uint8_t m_rttSeq = 0;
+    unsigned long m_rttStart = 0;
+    // timer to handle packet timeout. Connection timers run on the owner's
+    // timer wheel, so they are inactive for connections without an owner
+    LRTPTimer m_packetTimer;
 
     // timer to handle piggybacking of flags
-    unsigned long m_timer_piggybackTimeout = 0;
-    bool m_timer_piggybackTimeoutActive = false;
+    LRTPTimer m_piggybackTimer;
+
+    // send coalescing, see setCoalescing()
+    size_t m_coalesceFill = LRTP_COALESCE_FILL;
+    unsigned long m_coalesceDelay = LRTP_COALESCE_DELAY;
+    bool m_corked = false;
+    // bytes waiting that flush() asked to be sent at once
+    size_t m_txPushed = 0;
+    // runs while data is held, the data is sent when it expires
+    LRTPTimer m_coalesceTimer;
+    bool m_coalesceExpired = false;
 
     bool m_sendPiggybackPacket = false;
     LRTPFlags m_piggybackFlags;
     // outgoing packet buffer
     // CircularBuffer<LRTPBufferItem> m_txBuffer;
-    CircularBuffer<uint8_t> m_txDataBuffer;
-    CircularBuffer<LRTPPacket> m_txWindow;
+    CircularBuffer<uint8_t, LRTP_TX_DATA_BUFFER_SZ> m_txDataBuffer;
+    // the first m_txInFlight bytes of the data buffer are the payloads of the
+    // frames in the window
+    size_t m_txInFlight = 0;
+    // payloads of the frames in the window when they are compressed
+    CircularBuffer<uint8_t, LRTP_TX_DATA_BUFFER_SZ> m_txFrameBuffer;
+    // frames sent and not yet acknowledged. Their payloads point into the
+    // data or frame buffer
+    CircularBuffer<LRTPPacket, LRTP_TX_PACKET_BUFFER_SZ> m_txWindow;
 
     LRTPPacket m_piggybackPacket;
-    // incoming data buffer
-    uint8_t m_rxBuffer[LRTP_MAX_PAYLOAD_SZ * LRTP_RX_PACKET_BUFFER_SZ];
-    size_t m_rxBuffPos = 0;
-    size_t m_rxBuffLen = 0;
+
+    LRTPLinkState m_link;
+    // RATE frame reporting our listen rate to the peer
+    LRTPPacket m_ratePacket;
+    uint8_t m_ratePayload[LRTP_RATE_PAYLOAD_SZ];
+    // incoming data buffer, in storage owned by the connection table. The
+    // window advertised to the peer shrinks as it fills
+    CircularBuffer<uint8_t> m_rxBuffer;
+    // the window last advertised to the peer
+    uint8_t m_advertisedWindow = 0;
 
     LRTPConnState m_connectionState;
 
+    LRTPPriority m_priority = LRTPPriority::DATA;
+    uint8_t m_weight = LRTP_SCHED_DEFAULT_WEIGHT;
+
     // callbacks
     std::function<void(void)> m_onClose = nullptr;
     std::function<void(void)> m_onDataReceived = nullptr;
 
     // private methods
     LRTPPacket *prepareNextPacket();
+    LRTPPacket *prepareRatePacket();
 
     // LRTPPacket *prepareNextTxPacket();
 
     void setTxPacketHeader(LRTPPacket &packet);
+    // true if the packet can be sent with a compact header
+    bool useCompactHeader(const LRTPPacket &packet);
+    // read the peer's capabilities from a SYN frame
+    void handleOptions(const LRTPPacket &packet);
+    // true if the data sent in both directions is compressed
+    bool useCompression();
+    // true if parity may be sent in both directions
+    bool useFec();
+    // true if lost frames are sent again selectively in both directions
+    bool useSelectiveRepeat();
+    // the index in the window of the next frame to send again, or -1
+    int getResendIndex();
+    // mark the frames in the window not acknowledged by the peer to be sent again
+    void resendUnacked();
+    // the most data that a data frame may carry
+    size_t getDataPayloadLimit();
+    // the bytes written that are not yet sent in a frame
+    size_t getTxBytesWaiting();
+    // true if the data waiting should be sent now, see setCoalescing()
+    bool txDataDue();
+    // start the coalescing delay if the data waiting is held back
+    void holdTxData();
+    void onCoalesceTimeout();
+    // point a frame's payload at length bytes of a send buffer, from offset
+    void setTxPayload(LRTPPacket &packet, CircularBuffer<uint8_t, LRTP_TX_DATA_BUFFER_SZ> &buffer, size_t offset, size_t length);
+    LRTPPacket *prepareFecPacket(uint8_t payloadType);
+    // deliver the kept frames that are next in sequence, while the receive
+    // buffer has room for them
+    void deliverKeptFrames();
+    // true if the receive buffer has room for the data of a frame
+    bool hasRxRoom(size_t payloadLength);
+    // the number of frames the free space of the receive buffer can hold
+    uint8_t getReceiveWindow();
+    // call after the application reads data, to let the peer know if its
+    // window opens again
+    void onRxRead();
+    // true if the next frame is a SYN announcing our capabilities, which is
+    // sent without data so that the peer learns them before any data arrives
+    bool optionsDue();
 
     void setConnectionState(LRTPConnState newState);
+    // send our FIN once all the data written has been acknowledged
+    void sendFinIfDone();
+    void onFinReceived();
+    // stop sending, drop the data not yet acknowledged and tell the application
+    void onClosed();
+
+    // tell the owning LRTP instance that there may be something to send
+    void notifyOwner();
 
     void startPacketTimeoutTimer();
     void onPacketTimeout();
+    // update the estimates with a round trip time measured (ms)
+    void sampleRtt(unsigned long rtt);
+
+    // the most frames that may be in flight
+    uint8_t getSendWindow();
+    void resetCongestion();
+    // grow the congestion window for frames acknowledged
+    void onFramesAcked(uint8_t count);
+    // shrink the congestion window after a loss
+    void onFramesLost(bool timeout);
     void startPiggybackTimeoutTimer();
     void onPiggybackTimeout();
     // LRTPPacket *preparePiggybackPacket();
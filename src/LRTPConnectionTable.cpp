@@ -0,0 +1,155 @@
+#include "LRTPConnectionTable.hpp"
+
+#include <new>
+
+LRTPConnection *LRTPConnectionHandle::get() const {
+    if (m_table == nullptr)
+        return nullptr;
+    return m_table->get(m_slot, m_generation);
+}
+
+LRTPConnectionTable::~LRTPConnectionTable() {
+    release();
+}
+
+bool LRTPConnectionTable::begin(size_t capacity, size_t rxBufferSize) {
+    release();
+    if (capacity == 0 || capacity >= LRTP_CONN_SLOT_EMPTY)
+        return false;
+
+    // keep the index at most half full so that probe sequences stay short
+    size_t indexSize = 1;
+    while (indexSize < 2 * capacity)
+        indexSize <<= 1;
+
+    m_pool = static_cast<LRTPConnection *>(::operator new(capacity * sizeof(LRTPConnection), std::nothrow));
+    m_rxStorage = new (std::nothrow) uint8_t[capacity * rxBufferSize];
+    m_slots = new (std::nothrow) Slot[capacity];
+    m_freeSlots = new (std::nothrow) uint16_t[capacity];
+    m_index = new (std::nothrow) IndexEntry[indexSize];
+    if (m_pool == nullptr || m_rxStorage == nullptr || m_slots == nullptr || m_freeSlots == nullptr || m_index == nullptr) {
+        release();
+        return false;
+    }
+    m_capacity = capacity;
+    m_rxBufferSize = rxBufferSize;
+    m_indexMask = indexSize - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        m_slots[i] = { 0, false };
+        // hand out the lowest slots first
+        m_freeSlots[i] = capacity - 1 - i;
+    }
+    m_freeCount = capacity;
+    for (size_t i = 0; i < indexSize; i++) {
+        m_index[i].slot = LRTP_CONN_SLOT_EMPTY;
+    }
+    return true;
+}
+
+LRTPConnectionHandle LRTPConnectionTable::find(uint16_t addr) {
+    if (m_index == nullptr)
+        return nullptr;
+    for (size_t i = home(addr);; i = (i + 1) & m_indexMask) {
+        const IndexEntry &entry = m_index[i];
+        if (entry.slot == LRTP_CONN_SLOT_EMPTY)
+            return nullptr;
+        if (entry.addr == addr)
+            return LRTPConnectionHandle(this, entry.slot, m_slots[entry.slot].generation);
+    }
+}
+
+LRTPConnectionHandle LRTPConnectionTable::create(uint16_t source, uint16_t addr, LRTP *owner) {
+    if (m_freeCount == 0)
+        return nullptr;
+    uint16_t slot = m_freeSlots[--m_freeCount];
+    new (&m_pool[slot]) LRTPConnection(source, addr, owner, &m_rxStorage[slot * m_rxBufferSize], m_rxBufferSize);
+    m_slots[slot].used = true;
+
+    size_t i = home(addr);
+    while (m_index[i].slot != LRTP_CONN_SLOT_EMPTY)
+        i = (i + 1) & m_indexMask;
+    m_index[i] = { addr, slot };
+    m_count++;
+    return LRTPConnectionHandle(this, slot, m_slots[slot].generation);
+}
+
+void LRTPConnectionTable::remove(uint16_t addr) {
+    if (m_index == nullptr)
+        return;
+    size_t i = home(addr);
+    while (m_index[i].slot != LRTP_CONN_SLOT_EMPTY && m_index[i].addr != addr)
+        i = (i + 1) & m_indexMask;
+    if (m_index[i].slot == LRTP_CONN_SLOT_EMPTY)
+        return;
+
+    uint16_t slot = m_index[i].slot;
+    m_pool[slot].~LRTPConnection();
+    m_slots[slot].used = false;
+    // invalidate outstanding handles
+    m_slots[slot].generation++;
+    m_freeSlots[m_freeCount++] = slot;
+    m_count--;
+
+    // backward shift deletion: move later entries of the probe sequence into
+    // the hole so that lookups never need tombstones
+    m_index[i].slot = LRTP_CONN_SLOT_EMPTY;
+    for (size_t j = (i + 1) & m_indexMask; m_index[j].slot != LRTP_CONN_SLOT_EMPTY; j = (j + 1) & m_indexMask) {
+        size_t k = home(m_index[j].addr);
+        // the entry can fill the hole unless its home lies cyclically in (i, j]
+        bool inRange = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!inRange) {
+            m_index[i] = m_index[j];
+            m_index[j].slot = LRTP_CONN_SLOT_EMPTY;
+            i = j;
+        }
+    }
+}
+
+LRTPConnection *LRTPConnectionTable::at(size_t slot) {
+    if (slot >= m_capacity || !m_slots[slot].used)
+        return nullptr;
+    return &m_pool[slot];
+}
+
+size_t LRTPConnectionTable::count() {
+    return m_count;
+}
+
+size_t LRTPConnectionTable::capacity() {
+    return m_capacity;
+}
+
+LRTPConnection *LRTPConnectionTable::get(uint16_t slot, uint16_t generation) {
+    if (slot >= m_capacity || !m_slots[slot].used || m_slots[slot].generation != generation)
+        return nullptr;
+    return &m_pool[slot];
+}
+
+size_t LRTPConnectionTable::home(uint16_t addr) {
+    // multiplicative hash, spreads sequential addresses across the index
+    return ((uint32_t)addr * 40503u >> 4) & m_indexMask;
+}
+
+void LRTPConnectionTable::release() {
+    if (m_pool != nullptr && m_slots != nullptr) {
+        for (size_t i = 0; i < m_capacity; i++) {
+            if (m_slots[i].used)
+                m_pool[i].~LRTPConnection();
+        }
+    }
+    ::operator delete(m_pool);
+    delete[] m_rxStorage;
+    delete[] m_slots;
+    delete[] m_freeSlots;
+    delete[] m_index;
+    m_pool = nullptr;
+    m_rxStorage = nullptr;
+    m_rxBufferSize = 0;
+    m_slots = nullptr;
+    m_freeSlots = nullptr;
+    m_index = nullptr;
+    m_capacity = 0;
+    m_freeCount = 0;
+    m_indexMask = 0;
+    m_count = 0;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <Arduino.h>
+#include <cstddef>
+
+#include "LRTPConnection.hpp"
+#include "LRTPConstants.hpp"
+
+class LRTPConnectionTable;
+
+/**
+ * @brief Lightweight reference to a connection held in an LRTPConnectionTable.
+ *
+ * A handle is only an index and a generation number. It becomes null once its
+ * connection has been released and the slot reused, so applications can keep
+ * handles to closed connections safely. Always check a handle before using
+ * it.
+ */
+class LRTPConnectionHandle {
+  public:
+    LRTPConnectionHandle(std::nullptr_t = nullptr) {
+    }
+    LRTPConnectionHandle(LRTPConnectionTable *table, uint16_t slot, uint16_t generation) : m_table(table), m_slot(slot), m_generation(generation) {
+    }
+
+    // the connection, or nullptr if the handle is null or stale
+    LRTPConnection *get() const;
+
+    LRTPConnection *operator->() const {
+        return get();
+    }
+    LRTPConnection &operator*() const {
+        return *get();
+    }
+    explicit operator bool() const {
+        return get() != nullptr;
+    }
+    bool operator==(std::nullptr_t) const {
+        return get() == nullptr;
+    }
+    bool operator!=(std::nullptr_t) const {
+        return get() != nullptr;
+    }
+    bool operator==(const LRTPConnectionHandle &other) const {
+        return get() == other.get();
+    }
+    bool operator!=(const LRTPConnectionHandle &other) const {
+        return get() != other.get();
+    }
+
+  private:
+    LRTPConnectionTable *m_table = nullptr;
+    uint16_t m_slot = 0;
+    uint16_t m_generation = 0;
+};
+
+/**
+ * @brief Fixed capacity table of connections keyed by remote address.
+ *
+ * Connection objects live in a pool allocated once by begin(), and are found
+ * through an open addressing (linear probing) index of 16-bit addresses. The
+ * receive ring of each pool slot is carved out of one block allocated with
+ * the pool. No memory is allocated or freed for the table after begin(), so
+ * its footprint is known up front and it cannot fragment the heap.
+ */
+class LRTPConnectionTable {
+  public:
+    ~LRTPConnectionTable();
+
+    /**
+     * @brief Allocate the pool, the receive rings and the index
+     *
+     * @param capacity the maximum number of connections
+     * @param rxBufferSize the size of each connection's receive ring (bytes)
+     * @return true on success, false if the memory could not be allocated
+     */
+    bool begin(size_t capacity, size_t rxBufferSize);
+
+    LRTPConnectionHandle find(uint16_t addr);
+
+    /**
+     * @brief Create a connection to addr in a free slot. There must not already
+     * be a connection to addr
+     *
+     * @return LRTPConnectionHandle the new connection, or a null handle if the
+     * table is full
+     */
+    LRTPConnectionHandle create(uint16_t source, uint16_t addr, LRTP *owner);
+
+    // destroy a connection, invalidating every handle to it
+    void remove(uint16_t addr);
+
+    // the connection in a pool slot, or nullptr if the slot is free
+    LRTPConnection *at(size_t slot);
+
+    size_t count();
+    size_t capacity();
+
+  private:
+    friend class LRTPConnectionHandle;
+
+    struct Slot {
+        uint16_t generation;
+        bool used;
+    };
+    struct IndexEntry {
+        uint16_t addr;
+        // pool slot, or LRTP_CONN_SLOT_EMPTY
+        uint16_t slot;
+    };
+
+    // raw storage for the connection objects, constructed in place
+    LRTPConnection *m_pool = nullptr;
+    // the receive rings, rxBufferSize bytes per slot
+    uint8_t *m_rxStorage = nullptr;
+    size_t m_rxBufferSize = 0;
+    Slot *m_slots = nullptr;
+    // stack of free pool slots
+    uint16_t *m_freeSlots = nullptr;
+    size_t m_freeCount = 0;
+    size_t m_capacity = 0;
+
+    IndexEntry *m_index = nullptr;
+    // index size minus one, the index size is a power of two
+    size_t m_indexMask = 0;
+
+    size_t m_count = 0;
+
+    LRTPConnection *get(uint16_t slot, uint16_t generation);
+    size_t home(uint16_t addr);
+    void release();
+};
@@ -1,26 +1,323 @@
 #pragma once
 
+// radio backends. The LoRa.h backend is built for Arduino targets, the UDP
+// "ether" backend wherever BSD sockets are available (Linux hosts, ESP32)
+#if !defined(LRTP_RADIO_LORA)
+#if defined(ARDUINO)
+#define LRTP_RADIO_LORA 1
+#else
+#define LRTP_RADIO_LORA 0
+#endif
+#endif
+
+#if !defined(LRTP_RADIO_UDP)
+#if defined(__linux__) || defined(ESP32)
+#define LRTP_RADIO_UDP 1
+#else
+#define LRTP_RADIO_UDP 0
+#endif
+#endif
+
+// event loop runners: a FreeRTOS task on ESP32, a poll() based runner on Linux
+#if !defined(LRTP_POSIX_RUNNER)
+#if defined(__linux__)
+#define LRTP_POSIX_RUNNER 1
+#else
+#define LRTP_POSIX_RUNNER 0
+#endif
+#endif
+
+#define LRTP_TASK_STACK_SZ 4096
+#define LRTP_TASK_PRIORITY 2
+#define LRTP_TASK_CORE 1
+// longest wait of the runner task when the radio has to be polled
+#define LRTP_TASK_POLL_INTERVAL 5
+
+// connection timer wheel: tick length (ms) and number of slots, both powers of
+// two. One revolution covers about two seconds
+#define LRTP_TIMER_TICK 8
+#define LRTP_TIMER_WHEEL_SLOTS 256
+
+// packet capture: default ring size (bytes), pcap link type (LINKTYPE_USER0),
+// and the pseudo-header written before each frame
+#define LRTP_CAPTURE_BUFFER_SZ 4096
+#define LRTP_CAPTURE_LINKTYPE 147
+#define LRTP_CAPTURE_PSEUDO_SZ 4
+#define LRTP_CAPTURE_RX 0
+#define LRTP_CAPTURE_TX 1
+
+// adaptive data rate. Rates step the spreading factor down from the base
+// configuration to LRTP_RATE_MIN_SF. SNR margins are in dB
+#define LRTP_RATE_MIN_SF 7
+#define LRTP_RATE_MARGIN 5
+// extra margin needed to move to a faster rate
+#define LRTP_RATE_HYSTERESIS 3
+#define LRTP_RATE_MIN_TXPOWER 2
+// interval between rate decisions, and between SNR reports to a peer (ms)
+#define LRTP_RATE_UPDATE_INTERVAL 1000
+#define LRTP_RATE_REPORT_INTERVAL 10000
+// a peer not heard from for this many full frame airtimes (at the base rate)
+// is assumed to need the base rate
+#define LRTP_RATE_LEASE_SLOTS 8
+// leases for which a peer that went silent is kept at the base rate
+#define LRTP_RATE_HOLDOFF_LEASES 4
+// unacknowledged frames after which frames to a peer are sent at full power
+#define LRTP_RATE_FALLBACK_LOSSES 2
+
+// multi-hop forwarding. Routes are learned from traffic and from the route
+// beacons nodes send every LRTP_ROUTE_BEACON_INTERVAL (ms, jittered by up to a
+// quarter), and expire when not refreshed for LRTP_ROUTE_TIMEOUT
+#define LRTP_ROUTE_TABLE_SZ 16
+#define LRTP_ROUTE_BEACON_INTERVAL 30000
+#define LRTP_ROUTE_TIMEOUT (3 * LRTP_ROUTE_BEACON_INTERVAL)
+// a new or changed route brings the next beacon forward to within this time
+#define LRTP_ROUTE_TRIGGER_DELAY 5000
+// longest path in hops (transmissions) a frame may travel
+#define LRTP_FORWARD_MAX_HOPS 4
+// frames waiting at a relay to be forwarded
+#define LRTP_FORWARD_QUEUE_SZ 4
+// recently forwarded (origin, frame id) pairs remembered to drop duplicates
+#define LRTP_FORWARD_DEDUP_SZ 16
+
+// default number of connections allocated by LRTP::begin()
+#define LRTP_MAX_CONNECTIONS 16
+#define LRTP_CONN_SLOT_EMPTY 0xFFFF
+// once the table is full, a connection whose peer has not been heard from for
+// this long may be dropped to make room for a new peer (ms)
+#define LRTP_CONN_IDLE_TIMEOUT (10 * 60 * 1000UL)
+
+// returned by nextDeadline() when nothing is pending
+#define LRTP_NO_DEADLINE ((unsigned long)-1)
+
+// multicast group, port and interface used by the UDP ether backend
+#define LRTP_UDP_GROUP_ADDR "239.255.76.84"
+#define LRTP_UDP_PORT 47654
+#define LRTP_UDP_IFACE_ADDR "127.0.0.1"
+
 #define LORA_SIGNAL_TIMEOUT_ROUNDS 3
 #define LORA_SIGNAL_TIMEOUT 250
 
 #define LRTP_BROADCAST_ADDR 0xFFFF
+// multicast group addresses
+#define LRTP_MULTICAST_MIN 0xFF00
+#define LRTP_MULTICAST_MAX 0xFFFE
 
 #define LRTP_MAX_PACKET 255
+// frames a connection may have in flight. Must be a power of two
 #define LRTP_TX_PACKET_BUFFER_SZ 4
+// data written to a connection waits here to be sent, and stays until it is
+// acknowledged. Must be a power of two
+#define LRTP_TX_DATA_BUFFER_SZ 1024
+// send coalescing, see LRTPConnection::setCoalescing(). By default data waits
+// for a full frame while frames are in flight, for at most
+// LRTP_COALESCE_DELAY ms
+#define LRTP_COALESCE_FILL LRTP_MAX_PAYLOAD_SZ
+#define LRTP_COALESCE_DELAY 200
 #define LRTP_RX_PACKET_BUFFER_SZ 1
-#define LRTP_GLOBAL_RX_BUFFER_SZ 1
+// number of received frames that can be queued between the radio ISR and
+// LRTP::loop(). Must be a power of two
+#define LRTP_GLOBAL_RX_BUFFER_SZ 8
 #define LRTP_HEADER_SZ 8
+// the leading header bytes (version/type, flags/window, src and dest) read by
+// the receive ISR to filter out frames addressed to other nodes
+#define LRTP_ADDR_PREFIX_SZ 6
 #define LRTP_MAX_PAYLOAD_SZ (LRTP_MAX_PACKET - LRTP_HEADER_SZ)
 
-#define LRTP_PACKET_TIMEOUT 7.5 * 1000 // 15 seconds
+// retransmission timeout until the owner sizes it from airtime (ms)
+#define LRTP_PACKET_TIMEOUT 7.5 * 1000 // 7.5 seconds
+// retransmission timeouts in a row after which the peer is taken to be gone,
+// and the connection is closed
+#define LRTP_MAX_RETRIES 8
 
 #define LRTP_PIGGYBACK_TIMEOUT_DIV 6 // 2
 #define LRTP_PIGGYBACK_TIMEOUT (LRTP_PACKET_TIMEOUT / LRTP_PIGGYBACK_TIMEOUT_DIV)
 
+// slack added to airtime derived timeouts for processing, radio turnaround and
+// channel access (ms)
+#define LRTP_TIMEOUT_MARGIN 500
+
+// retransmission timeout estimation (RFC 6298). The smoothed round trip time
+// and its mean deviation move by 1/LRTP_RTT_GAIN_DIV and 1/LRTP_RTTVAR_GAIN_DIV
+// of each error, and the timeout is the smoothed round trip time plus
+// LRTP_RTO_VAR_FACTOR deviations, doubled on each timeout. It backs off to at
+// most LRTP_RTO_MAX_FRAMES full frame airtimes per hop (or the initial timeout)
+#define LRTP_RTT_GAIN_DIV 8
+#define LRTP_RTTVAR_GAIN_DIV 4
+#define LRTP_RTO_VAR_FACTOR 4
+#define LRTP_RTO_MAX_FRAMES 32
+
+// congestion control (AIMD). The number of frames in flight is limited by the
+// congestion window as well as the peer's advertised window. The congestion
+// window starts at LRTP_CWND_INITIAL frames and grows by a frame per frame
+// acknowledged up to the slow start threshold, then by a frame per window. It
+// is halved when frames are lost, at most once per window, and closes to
+// LRTP_CWND_MIN frames on a retransmission timeout
+#define LRTP_CWND_INITIAL 2
+#define LRTP_CWND_MIN 1
+
+// regulatory duty cycle limits are enforced over this window (ms)
+#define LRTP_DUTY_CYCLE_WINDOW (3600UL * 1000)
+#define LRTP_DUTY_CYCLE_MAX_BANDS 8
+
 #define LRTP_CAD_ROUNDS 3
 
+// transmit scheduling. A lower priority class with frames waiting is served at
+// least once every LRTP_SCHED_STARVATION_LIMIT frames
+#define LRTP_SCHED_STARVATION_LIMIT 8
+#define LRTP_SCHED_DEFAULT_WEIGHT 1
+
+// channel access (CSMA/CA). Contention windows are in slots, a slot is the
+// airtime of a full frame divided by LRTP_CSMA_SLOTS_PER_FRAME
+#define LRTP_CSMA_SLOTS_PER_FRAME 4
+#define LRTP_CSMA_MIN_SLOT 10 // ms
+// airtime of a full frame assumed when scaling slots (SF12, 125kHz)
+#define LRTP_CSMA_DEFAULT_FRAME_AIRTIME 9000 // ms
+
+#define LRTP_CSMA_CONTROL_CW_MIN 1
+#define LRTP_CSMA_CONTROL_CW_MAX 7
+#define LRTP_CSMA_CONTROL_CAD_ROUNDS 1
+#define LRTP_CSMA_DATA_CW_MIN 3
+#define LRTP_CSMA_DATA_CW_MAX 31
+#define LRTP_CSMA_DATA_CAD_ROUNDS 2
+#define LRTP_CSMA_BULK_CW_MIN 7
+#define LRTP_CSMA_BULK_CW_MAX 63
+#define LRTP_CSMA_BULK_CAD_ROUNDS LRTP_CAD_ROUNDS
+
 #define LRTP_DEFAULT_VERSION 1
 #define LRTP_DEFAULT_TYPE 0
+// broadcast frame acknowledging several connections at once. The payload is a
+// list of (address (2 bytes, big-endian), ackNum, window) tuples
+#define LRTP_TYPE_ACK_AGGREGATE 1
+#define LRTP_ACK_AGGREGATE_TUPLE_SZ 4
+#define LRTP_ACK_AGGREGATE_MAX (LRTP_MAX_PAYLOAD_SZ / LRTP_ACK_AGGREGATE_TUPLE_SZ)
+// an aggregate ACK is only sent when at least this many ACKs are owed
+#define LRTP_ACK_AGGREGATE_MIN 2
+// sequenced multicast data (seqNum is the stream sequence number, ackNum the
+// oldest frame the sender can repair, an empty payload is a heartbeat
+// announcing the next sequence number), and negative
+// acknowledgements: stream source (2 bytes, big-endian), base sequence number
+// and a bitmap of missing frames from base
+#define LRTP_TYPE_MULTICAST 2
+#define LRTP_TYPE_MULTICAST_NACK 3
+#define LRTP_MCAST_NACK_SZ 4
+// adaptive data rate report: the rate index the sender listens at, and the SNR
+// of the receiver's frames as measured by the sender (quarter dB, signed)
+#define LRTP_TYPE_RATE 4
+#define LRTP_RATE_PAYLOAD_SZ 2
+// frame relayed towards a node out of range. src and dest are the current hop,
+// the payload is the number of hops travelled, the frame id given by the
+// origin and the original frame (header and payload) from origin to final
+// destination
+#define LRTP_TYPE_FORWARD 5
+#define LRTP_FORWARD_HEADER_SZ 2
+#define LRTP_FORWARD_OVERHEAD (LRTP_HEADER_SZ + LRTP_FORWARD_HEADER_SZ)
+// broadcast route beacon: a list of (address (2 bytes, big-endian), hops)
+// entries for the nodes the sender can reach
+#define LRTP_TYPE_ROUTE_BEACON 6
+#define LRTP_ROUTE_ENTRY_SZ 3
+// handshake options: a SYN frame without data may carry the sender's
+// capabilities and the id it wants compact frames sent to it to use
+// (2 bytes, big-endian)
+#define LRTP_TYPE_OPTIONS 7
+#define LRTP_OPTIONS_SZ 3
+// compact frames are only told apart by the connection id, whose high byte is
+// the receiver's low address byte and whose low byte is random, so nodes whose
+// addresses share a low byte (0x0101 and 0x0201) could accept each other's
+// frames. A node that has heard another address with its low byte does not
+// announce LRTP_CAP_COMPACT on connections opened afterwards
+#define LRTP_CAP_COMPACT 0x01
+#define LRTP_CAP_LZSS 0x02
+#define LRTP_CAP_FEC 0x04
+#define LRTP_CAP_SACK 0x08
+// XOR parity over a block of data frames. seqNum is the sequence number of the
+// first frame of the block, the payload the number of frames, the XOR of their
+// payload lengths and the XOR of their payloads, zero padded to the longest
+#define LRTP_TYPE_PARITY 8
+#define LRTP_PARITY_HEADER_SZ 2
+// the parity block size (frames per parity frame, 0 for none) the receiver of
+// a connection asks its peer to send
+#define LRTP_TYPE_FEC_REPORT 9
+#define LRTP_FEC_REPORT_SZ 1
+
+// compact headers, used on a connection once both ends have announced
+// LRTP_CAP_COMPACT. The first byte has the top bit set (full headers start with
+// the version, below 8), then the fin, ack and sack flags and the window.
+// It is followed by the connection id chosen by the receiver (2 bytes,
+// big-endian, the high byte is the low byte of the receiver's address), the
+// sequence number and the acknowledgement number. The version and type are the
+// defaults, and ACK only frames leave out the sequence number. A SACK bitmap
+// follows the acknowledgement number
+#define LRTP_COMPACT_FLAG 0x80
+#define LRTP_COMPACT_HEADER_SZ 5
+#define LRTP_COMPACT_ACK_SZ 4
+
+// stream compression, used on a connection once both ends have announced
+// LRTP_CAP_LZSS. Matches reach back 2^LRTP_LZ_WINDOW_BITS bytes and copy up to
+// 2^LRTP_LZ_LENGTH_BITS - 1 + LRTP_LZ_MIN_MATCH bytes. The window is kept by
+// both ends of each connection
+#define LRTP_LZ_WINDOW_BITS 9
+#define LRTP_LZ_LENGTH_BITS 7
+#define LRTP_LZ_MIN_MATCH 3
+// most data a compressed frame may carry
+#define LRTP_LZ_MAX_FRAME_DATA (2 * LRTP_MAX_PAYLOAD_SZ)
+
+// receive buffer of a connection: data accepted from the peer waits there to
+// be read. The window advertised to the peer is the number of frames the free
+// space can hold, counting LRTP_LZ_MAX_FRAME_DATA bytes for compressed frames.
+// The buffer holds at least one compressed frame
+#define LRTP_RX_BUFFER_SZ (LRTP_MAX_PAYLOAD_SZ * LRTP_TX_PACKET_BUFFER_SZ)
+#define LRTP_RX_BUFFER_MIN LRTP_LZ_MAX_FRAME_DATA
+// largest window the 4 bit ackWindow field can advertise
+#define LRTP_MAX_ACKWIN 0x0f
+
+// selective repeat, used on a connection once both ends have announced
+// LRTP_CAP_SACK. A receiver holding frames after a lost one sets the sack flag
+// (bit 0 of the flags) in its ACKs, and the header is followed by a bitmap of
+// those frames: bit i is set if frame ackNum + 1 + i has been received. The
+// sender then only sends the frames not received again
+#define LRTP_SACK_SZ 1
+// data frames kept by the receiver of a connection, see LRTPReorderBuffer.
+// Each takes a full payload of memory in every connection. Must be a power of
+// two
+#define LRTP_REORDER_FRAMES 8
+
+// forward error correction, used on a connection once both ends have announced
+// LRTP_CAP_FEC. One parity frame is sent for each block of data frames, which
+// lets the receiver rebuild one lost frame of the block without waiting for
+// the retransmission timeout
+#define LRTP_FEC_MIN_BLOCK 2
+#define LRTP_FEC_MAX_BLOCK LRTP_TX_PACKET_BUFFER_SZ
+// the receiver's loss estimate is a moving average of the frames lost, with
+// this gain. Parity is asked for once the estimate exceeds LRTP_FEC_LOSS_ON,
+// and stopped when it falls below LRTP_FEC_LOSS_OFF. In between the block is
+// the longest one expected to lose at most LRTP_FEC_BLOCK_LOSSES frames
+#define LRTP_FEC_LOSS_GAIN 0.0625f
+#define LRTP_FEC_LOSS_ON 0.02f
+#define LRTP_FEC_LOSS_OFF 0.005f
+#define LRTP_FEC_BLOCK_LOSSES 0.3f
+
+// reliable multicast. Times are counted in slots of one full frame airtime
+// number of groups that can be joined
+#define LRTP_MCAST_MAX_GROUPS 4
+// number of groups this node can send to, and of streams it can receive
+#define LRTP_MCAST_TX_STREAMS 1
+#define LRTP_MCAST_RX_STREAMS 2
+// frames kept by the sender for repair, and buffered out of order by receivers.
+// At most 8, the size of the NACK bitmap
+#define LRTP_MCAST_WINDOW 8
+// time a sent frame is kept for repair before it may be replaced (slots)
+#define LRTP_MCAST_HOLD_SLOTS 12
+// receivers wait a random 1..N slots before sending a NACK, so that the first
+// NACK suppresses the others
+#define LRTP_MCAST_NACK_SLOTS 4
+// time to wait for a repair before sending another NACK (slots)
+#define LRTP_MCAST_REPAIR_SLOTS 6
+// NACKs sent without progress before the missing frames are given up
+#define LRTP_MCAST_NACK_RETRIES 4
+// heartbeats sent after the last data frame, at 2, 4, 8... slots, so that
+// receivers detect lost frames at the end of a burst
+#define LRTP_MCAST_HEARTBEATS 3
+#define LRTP_MCAST_HEARTBEAT_SLOTS 2
 
 #define LRTP_DEFAULT_ACKWIN LRTP_TX_PACKET_BUFFER_SZ
 
@@ -47,12 +344,14 @@ enum class LRTPError {
     CLOSE_FIN_ACK,
     INVALID_SYN_ACK_SYN,
     INVALID_STATE,
+    INVALID_PAYLOAD,
 };
 
 struct LRTPFlags {
     bool syn;
     bool fin;
     bool ack;
+    bool sack;
 };
 
 struct LRTPPacket {
@@ -64,8 +363,138 @@ struct LRTPPacket {
     uint16_t dest;
     uint8_t seqNum;
     uint8_t ackNum;
+    // frames received after ackNum, sent when flags.sack is set
+    uint8_t sackBitmap;
     uint8_t *payload;
     size_t payloadLength;
+    // a payload sent from a connection's send buffer may wrap around its end:
+    // its last wrapLength bytes are then at wrapPayload
+    uint8_t *wrapPayload;
+    size_t wrapLength;
+    // sent or received with a compact header. The connection id replaces src
+    // and dest, which the receiver fills in from its connection
+    bool compact;
+    uint16_t connectionId;
+};
+
+// transmit priority classes. CONTROL is used for frames that carry no data
+// (e.g. ACK only or SYN frames)
+enum class LRTPPriority {
+    CONTROL,
+    DATA,
+    BULK,
+};
+#define LRTP_PRIORITY_COUNT 3
+
+// channel access statistics
+struct LRTPChannelStats {
+    // channel access attempts (CAD sequences started)
+    unsigned long cadAttempts;
+    // CAD sequences that found the channel busy
+    unsigned long cadBusy;
+    // frames transmitted
+    unsigned long transmissions;
+    // retransmission timeouts, counted as suspected collisions
+    unsigned long collisions;
+    // total time spent in backoff (ms)
+    unsigned long backoffTime;
+};
+
+// duty cycle statistics
+struct LRTPDutyCycleStats {
+    // transmissions deferred because a sub-band budget was exhausted
+    unsigned long deferrals;
+    // total airtime used (ms)
+    unsigned long airtime;
+};
+
+// receive path statistics
+struct LRTPRxStats {
+    // frames queued for processing
+    unsigned long received;
+    // frames dropped by the receive ISR because they were addressed to another
+    // node
+    unsigned long filtered;
+    // frames dropped because the receive ring was full
+    unsigned long overruns;
+    // frames dropped because they were empty or longer than LRTP_MAX_PACKET
+    unsigned long invalid;
+};
+
+// packet capture statistics
+struct LRTPCaptureStats {
+    // frames recorded
+    unsigned long records;
+    // frames not recorded because the capture ring was full
+    unsigned long dropped;
+    // bytes written out by drain()
+    unsigned long drained;
+};
+
+// reliable multicast statistics
+struct LRTPMulticastStats {
+    // data frames sent for the first time
+    unsigned long sent;
+    // data frames sent again in response to a NACK
+    unsigned long repairs;
+    unsigned long heartbeats;
+    unsigned long nacksSent;
+    // NACKs not sent because another receiver asked for the same frames
+    unsigned long nacksSuppressed;
+    // frames delivered to the application, in order
+    unsigned long delivered;
+    // frames given up on after LRTP_MCAST_NACK_RETRIES
+    unsigned long lost;
+};
+
+// multi-hop forwarding statistics
+struct LRTPRouteStats {
+    // frames relayed towards another node
+    unsigned long forwarded;
+    // frames sent through a relay by this node
+    unsigned long originated;
+    // forwarded frames dropped because they had been seen already
+    unsigned long duplicates;
+    // forwarded frames dropped at the hop limit
+    unsigned long hopLimit;
+    // forwarded frames dropped because no route to their destination was known
+    unsigned long noRoute;
+    // forwarded frames dropped because the forwarding queue was full
+    unsigned long queueFull;
+    unsigned long beacons;
+};
+
+// forward error correction statistics of a connection
+struct LRTPFecStats {
+    unsigned long paritySent;
+    // lost frames rebuilt from parity
+    unsigned long recovered;
+    // parity frames that could not rebuild a lost frame
+    unsigned long unrecoverable;
+    unsigned long reportsSent;
+};
+
+// round trip time estimates of a connection (ms)
+struct LRTPRttStats {
+    // smoothed round trip time and its mean deviation, 0 before the first
+    // sample
+    unsigned long srtt;
+    unsigned long rttvar;
+    // current retransmission timeout, including any backoff
+    unsigned long rto;
+    unsigned long samples;
+    unsigned long timeouts;
+};
+
+// congestion control state of a connection
+struct LRTPCongestionStats {
+    // congestion window and slow start threshold (frames)
+    float cwnd;
+    float ssthresh;
+    // window halved after frames were lost
+    unsigned long reductions;
+    // window closed after a retransmission timeout
+    unsigned long collapses;
 };
 
 enum class LRTPConnState {
@@ -0,0 +1,103 @@
+#include "LRTPDutyCycle.hpp"
+
+#include "LRTPDebug.h"
+
+// ETSI EN 300 220 sub-bands
+static const LRTPSubBand DEFAULT_SUB_BANDS[] = {
+    { 433050000, 434790000, 1000 }, // 10%
+    { 863000000, 868000000, 100 },  // g: 1%
+    { 868000000, 868600000, 100 },  // g1: 1%
+    { 868700000, 869200000, 10 },   // g2: 0.1%
+    { 869400000, 869650000, 1000 }, // g3: 10%
+    { 869700000, 870000000, 100 },  // g4: 1%
+};
+
+LRTPDutyCycle::LRTPDutyCycle() {
+    for (size_t i = 0; i < sizeof(DEFAULT_SUB_BANDS) / sizeof(DEFAULT_SUB_BANDS[0]); i++) {
+        addSubBand(DEFAULT_SUB_BANDS[i]);
+    }
+}
+
+void LRTPDutyCycle::setEnabled(bool enabled) {
+    m_enabled = enabled;
+}
+
+bool LRTPDutyCycle::isEnabled() {
+    return m_enabled;
+}
+
+void LRTPDutyCycle::clearSubBands() {
+    m_bucketCount = 0;
+}
+
+bool LRTPDutyCycle::addSubBand(const LRTPSubBand &band) {
+    if (m_bucketCount >= LRTP_DUTY_CYCLE_MAX_BANDS)
+        return false;
+    Bucket &bucket = m_buckets[m_bucketCount++];
+    bucket.band = band;
+    bucket.tokens = capacity(bucket);
+    bucket.lastRefill = millis();
+    return true;
+}
+
+bool LRTPDutyCycle::canTransmit(long frequency, long bandwidth, unsigned long airtime, unsigned long t) {
+    return timeUntilAvailable(frequency, bandwidth, airtime, t) == 0;
+}
+
+unsigned long LRTPDutyCycle::timeUntilAvailable(long frequency, long bandwidth, unsigned long airtime, unsigned long t) {
+    Bucket *bucket = findBucket(frequency, bandwidth, t);
+    if (bucket == nullptr)
+        return 0;
+    // a frame longer than the whole budget only waits for a full bucket and
+    // then runs it into debt, which later frames wait out
+    float needed = min(airtime / 1000.0f, capacity(*bucket)) - bucket->tokens;
+    if (needed <= 0)
+        return 0;
+    // tokens accumulate at dutyCycle ms per ms
+    return (unsigned long)(needed * 10000.0f / bucket->band.dutyCycle) + 1;
+}
+
+void LRTPDutyCycle::consume(long frequency, long bandwidth, unsigned long airtime, unsigned long t) {
+    m_stats.airtime += airtime / 1000;
+    Bucket *bucket = findBucket(frequency, bandwidth, t);
+    // may go negative: the debt is repaid before the next frame is sent
+    if (bucket != nullptr)
+        bucket->tokens -= airtime / 1000.0f;
+}
+
+void LRTPDutyCycle::onDeferred() {
+    m_stats.deferrals++;
+}
+
+const LRTPDutyCycleStats &LRTPDutyCycle::getStats() {
+    return m_stats;
+}
+
+LRTPDutyCycle::Bucket *LRTPDutyCycle::findBucket(long frequency, long bandwidth, unsigned long t) {
+    if (!m_enabled)
+        return nullptr;
+    // the channel occupies half its bandwidth either side of the centre
+    const long low = frequency - bandwidth / 2;
+    const long high = frequency + bandwidth / 2;
+    Bucket *found = nullptr;
+    for (size_t i = 0; i < m_bucketCount; i++) {
+        Bucket &bucket = m_buckets[i];
+        if (low < bucket.band.freqMax && high > bucket.band.freqMin && (found == nullptr || bucket.band.dutyCycle < found->band.dutyCycle))
+            found = &bucket;
+    }
+    if (found == nullptr) {
+        if (!m_unlimitedLogged && m_bucketCount > 0) {
+            lrtp_infof("No duty cycle limit applies to %ld Hz\n", frequency);
+            m_unlimitedLogged = true;
+        }
+        return nullptr;
+    }
+    // refill for the time elapsed since the last use
+    found->tokens = min(found->tokens + (t - found->lastRefill) * found->band.dutyCycle / 10000.0f, capacity(*found));
+    found->lastRefill = t;
+    return found;
+}
+
+float LRTPDutyCycle::capacity(const Bucket &bucket) {
+    return LRTP_DUTY_CYCLE_WINDOW * (bucket.band.dutyCycle / 10000.0f);
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <Arduino.h>
+
+#include "LRTPConstants.hpp"
+
+/**
+ * @brief A frequency range with a regulatory duty cycle limit
+ */
+struct LRTPSubBand {
+    long freqMin;
+    long freqMax;
+    // duty cycle in units of 0.01% (100 = 1%)
+    uint16_t dutyCycle;
+};
+
+/**
+ * @brief Per sub-band duty cycle budget scheduler.
+ *
+ * Each sub-band has a token bucket holding airtime (ms). The bucket refills at
+ * the band's duty cycle rate and holds at most dutyCycle *
+ * LRTP_DUTY_CYCLE_WINDOW, so over any window the airtime used stays within the
+ * limit. A frame may only be sent once its band holds enough airtime for it,
+ * or is full if the frame is longer than the whole budget (SF11/SF12 frames on
+ * a 0.1% band); until then it is deferred. Sending drives the bucket into debt
+ * when needed, and the debt is repaid before the next frame, so the average
+ * stays within the limit.
+ *
+ * A channel is charged to the band it overlaps, counting the whole bandwidth
+ * it occupies around its centre frequency, so a 125 kHz channel at 433 MHz
+ * falls in the 433.05 MHz band. A channel overlapping several bands is charged
+ * to the strictest. Channels outside every band are not limited, which is
+ * logged once.
+ *
+ * The default bands are the ETSI EN 300 220 limits for EU433 and EU868.
+ */
+class LRTPDutyCycle {
+  public:
+    LRTPDutyCycle();
+
+    void setEnabled(bool enabled);
+    bool isEnabled();
+
+    // remove all sub-bands (disables limiting until bands are added)
+    void clearSubBands();
+    /**
+     * @brief Add a sub-band. Its budget starts full
+     *
+     * @return true if the band was added, false if the table is full
+     */
+    bool addSubBand(const LRTPSubBand &band);
+
+    /**
+     * @brief Check whether a frame can be sent now
+     *
+     * @param frequency the transmit (centre) frequency in Hz
+     * @param bandwidth the signal bandwidth in Hz
+     * @param airtime the airtime of the frame in us
+     * @param t the current time (ms)
+     */
+    bool canTransmit(long frequency, long bandwidth, unsigned long airtime, unsigned long t);
+
+    /**
+     * @brief Time until the budget allows a frame of the given airtime
+     *
+     * @return unsigned long the delay in ms, 0 if the frame can be sent now
+     */
+    unsigned long timeUntilAvailable(long frequency, long bandwidth, unsigned long airtime, unsigned long t);
+
+    // charge a transmitted frame against its band's budget
+    void consume(long frequency, long bandwidth, unsigned long airtime, unsigned long t);
+
+    // record that a frame was deferred
+    void onDeferred();
+
+    const LRTPDutyCycleStats &getStats();
+
+  private:
+    struct Bucket {
+        LRTPSubBand band;
+        // available airtime (ms)
+        float tokens;
+        unsigned long lastRefill;
+    };
+
+    bool m_enabled = true;
+    Bucket m_buckets[LRTP_DUTY_CYCLE_MAX_BANDS];
+    size_t m_bucketCount = 0;
+    // a channel outside every band has been logged
+    bool m_unlimitedLogged = false;
+
+    LRTPDutyCycleStats m_stats = {};
+
+    Bucket *findBucket(long frequency, long bandwidth, unsigned long t);
+    float capacity(const Bucket &bucket);
+};
@@ -0,0 +1,195 @@
+#include "LRTPFec.hpp"
+
+#include "LRTPDebug.h"
+
+LRTPFec::LRTPFec(LRTPReorderBuffer &frames) : m_frames(frames) {
+    reset(0);
+}
+
+void LRTPFec::reset(uint8_t nextSeq) {
+    m_blockSize = 0;
+    m_blockCount = 0;
+    m_parityDue = false;
+    m_rxHighest = nextSeq;
+    m_lossRate = 0;
+    m_rxBlockSize = 0;
+    m_reportDue = false;
+    m_parityHeard = false;
+}
+
+void LRTPFec::setBlockSize(uint8_t blockSize) {
+    if (blockSize > 0)
+        blockSize = constrain(blockSize, LRTP_FEC_MIN_BLOCK, LRTP_FEC_MAX_BLOCK);
+    if (blockSize != m_blockSize)
+        lrtp_infof("FEC: peer asks for parity every %u frames\n", blockSize);
+    m_blockSize = blockSize;
+    if (blockSize == 0) {
+        m_blockCount = 0;
+        m_parityDue = false;
+    } else if (m_blockCount >= blockSize) {
+        m_parityDue = true;
+    }
+}
+
+uint8_t LRTPFec::getBlockSize() {
+    return m_blockSize;
+}
+
+void LRTPFec::addTxFrame(uint8_t seq, const LRTPPacket &packet) {
+    const size_t length = packet.payloadLength;
+    if (m_blockSize == 0 || m_parityDue)
+        return;
+    if (m_blockCount > 0 && seq != (uint8_t)(m_blockFirst + m_blockCount)) {
+        // a block covers consecutive frames only
+        m_parityDue = true;
+        return;
+    }
+    uint8_t *parity = m_parityPayload + LRTP_PARITY_HEADER_SZ;
+    if (m_blockCount == 0) {
+        m_blockFirst = seq;
+        m_blockLength = 0;
+        memset(m_parityPayload, 0, sizeof(m_parityPayload));
+    }
+    // the payload may wrap around the end of the send buffer
+    const size_t first = length - packet.wrapLength;
+    for (size_t i = 0; i < first; i++)
+        parity[i] ^= packet.payload[i];
+    for (size_t i = 0; i < packet.wrapLength; i++)
+        parity[first + i] ^= packet.wrapPayload[i];
+    m_blockLength = max(m_blockLength, length);
+    m_parityPayload[1] ^= length;
+    m_parityPayload[0] = ++m_blockCount;
+    if (m_blockCount >= m_blockSize)
+        m_parityDue = true;
+}
+
+void LRTPFec::flushTxBlock() {
+    if (m_blockCount > 0)
+        m_parityDue = true;
+}
+
+bool LRTPFec::parityDue() {
+    return m_parityDue;
+}
+
+size_t LRTPFec::getParityLength() {
+    return LRTP_PARITY_HEADER_SZ + m_blockLength;
+}
+
+void LRTPFec::prepareParity(LRTPPacket &packet) {
+    packet.seqNum = m_blockFirst;
+    packet.payload = m_parityPayload;
+    packet.payloadLength = getParityLength();
+    m_blockCount = 0;
+    m_parityDue = false;
+    m_stats.paritySent++;
+}
+
+bool LRTPFec::reportDue() {
+    return m_reportDue;
+}
+
+void LRTPFec::prepareReport(LRTPPacket &packet) {
+    m_reportPayload[0] = m_rxBlockSize;
+    packet.payload = m_reportPayload;
+    packet.payloadLength = LRTP_FEC_REPORT_SZ;
+    m_reportDue = false;
+    m_parityHeard = false;
+    m_stats.reportsSent++;
+}
+
+void LRTPFec::observe(uint8_t seq) {
+    int8_t ahead = seq - m_rxHighest;
+    // frames behind the highest are retransmissions
+    if (ahead < 0)
+        return;
+    if (ahead > 2 * LRTP_FEC_MAX_BLOCK)
+        ahead = 0;
+    for (int8_t i = 0; i < ahead; i++)
+        sampleLoss(true);
+    sampleLoss(false);
+    m_rxHighest = seq + 1;
+}
+
+bool LRTPFec::wantsParity() {
+    return m_rxBlockSize > 0;
+}
+
+bool LRTPFec::recover(const LRTPPacket &parity, uint8_t nextSeq) {
+    if (parity.payloadLength < LRTP_PARITY_HEADER_SZ)
+        return false;
+    const uint8_t count = parity.payload[0];
+    m_parityHeard = true;
+    // frames of the block that never arrived are losses too
+    int8_t ahead = (uint8_t)(parity.seqNum + count) - m_rxHighest;
+    if (ahead > 0 && ahead <= 2 * LRTP_FEC_MAX_BLOCK) {
+        for (int8_t i = 0; i < ahead; i++)
+            sampleLoss(true);
+        m_rxHighest += ahead;
+    }
+    if (m_rxBlockSize == 0) {
+        // the peer missed the report asking it to stop
+        m_reportDue = true;
+        return false;
+    }
+    const uint8_t missing = nextSeq - parity.seqNum;
+    LRTPPacket frame;
+    if (count > LRTP_FEC_MAX_BLOCK || missing >= count || m_frames.get(nextSeq, frame))
+        return false;
+
+    const size_t parityLength = parity.payloadLength - LRTP_PARITY_HEADER_SZ;
+    uint8_t payload[LRTP_MAX_PAYLOAD_SZ];
+    memcpy(payload, parity.payload + LRTP_PARITY_HEADER_SZ, sizeof(uint8_t) * parityLength);
+    size_t length = parity.payload[1];
+    for (uint8_t i = 0; i < count; i++) {
+        if (i == missing)
+            continue;
+        if (!m_frames.get(parity.seqNum + i, frame) || frame.payloadLength > parityLength) {
+            m_stats.unrecoverable++;
+            return false;
+        }
+        for (size_t j = 0; j < frame.payloadLength; j++)
+            payload[j] ^= frame.payload[j];
+        length ^= frame.payloadLength;
+    }
+    if (length > parityLength) {
+        m_stats.unrecoverable++;
+        return false;
+    }
+    LRTPPacket rebuilt = {};
+    rebuilt.seqNum = nextSeq;
+    rebuilt.payload = payload;
+    rebuilt.payloadLength = length;
+    if (!m_frames.keep(rebuilt))
+        return false;
+    m_stats.recovered++;
+    lrtp_infof("FEC: rebuilt frame %u from parity\n", nextSeq);
+    return true;
+}
+
+float LRTPFec::getLossRate() {
+    return m_lossRate;
+}
+
+const LRTPFecStats &LRTPFec::getStats() {
+    return m_stats;
+}
+
+void LRTPFec::sampleLoss(bool lost) {
+    m_lossRate += ((lost ? 1.0f : 0.0f) - m_lossRate) * LRTP_FEC_LOSS_GAIN;
+    // the peer may have missed the last report
+    if (lost && m_rxBlockSize > 0 && !m_parityHeard)
+        m_reportDue = true;
+
+    uint8_t blockSize = 0;
+    if (m_lossRate > (m_rxBlockSize > 0 ? LRTP_FEC_LOSS_OFF : LRTP_FEC_LOSS_ON)) {
+        blockSize = LRTP_FEC_MAX_BLOCK;
+        while (blockSize > LRTP_FEC_MIN_BLOCK && m_lossRate * (blockSize + 1) > LRTP_FEC_BLOCK_LOSSES)
+            blockSize--;
+    }
+    if (blockSize != m_rxBlockSize) {
+        lrtp_infof("FEC: loss rate %.3f, asking for parity every %u frames\n", m_lossRate, blockSize);
+        m_rxBlockSize = blockSize;
+        m_reportDue = true;
+    }
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <Arduino.h>
+
+#include "LRTPConstants.hpp"
+#include "LRTPReorderBuffer.hpp"
+
+/**
+ * @brief Forward error correction state of a connection.
+ *
+ * The sender XORs the payloads of each block of data frames it sends for the
+ * first time, and sends the result in a PARITY frame after the last frame of
+ * the block (or as soon as the send buffer runs empty). The receiver keeps the
+ * data frames of the current block in its reorder buffer: those already
+ * delivered, and those received ahead of a lost frame. When the parity arrives
+ * and exactly one frame of the block is missing, the receiver rebuilds it,
+ * delivers it with the frames after it and acknowledges them as if nothing was
+ * lost. The sender only retransmits if two frames of a block (or the parity
+ * and a frame) are lost.
+ *
+ * The receiver estimates the loss rate from the gaps in the sequence numbers
+ * it sees, and asks the sender for shorter blocks (more parity) as it rises,
+ * or for no parity at all on a clean link, in a FEC_REPORT frame. Parity is
+ * not sent until the receiver asks for it.
+ */
+class LRTPFec {
+  public:
+    LRTPFec(LRTPReorderBuffer &frames);
+
+    /**
+     * @brief Forget all state, at the start of a connection
+     *
+     * @param nextSeq the sequence number of the first data frame expected from
+     * the peer
+     */
+    void reset(uint8_t nextSeq);
+
+    // frames per parity frame sent, 0 for none, as asked for by the peer
+    void setBlockSize(uint8_t blockSize);
+    uint8_t getBlockSize();
+
+    // add a data frame sent for the first time to the current block
+    void addTxFrame(uint8_t seq, const LRTPPacket &packet);
+    // end the current block, so that its parity is sent now
+    void flushTxBlock();
+
+    // returns true if a parity frame should be sent
+    bool parityDue();
+    size_t getParityLength();
+    // fill in the sequence number and payload of the parity frame
+    void prepareParity(LRTPPacket &packet);
+
+    // returns true if a report should be sent to the peer
+    bool reportDue();
+    // fill in the payload of the report frame
+    void prepareReport(LRTPPacket &packet);
+
+    // note a data frame received from the peer, to estimate the loss rate
+    void observe(uint8_t seq);
+
+    // returns true if parity has been asked of the peer, so that the frames
+    // delivered should be kept
+    bool wantsParity();
+
+    /**
+     * @brief Rebuild the next frame expected from a parity frame and the
+     * frames of its block in the reorder buffer. The frame is then kept in the
+     * reorder buffer
+     *
+     * @return true if the frame was rebuilt
+     */
+    bool recover(const LRTPPacket &parity, uint8_t nextSeq);
+
+    // the estimated fraction of the peer's frames lost
+    float getLossRate();
+
+    const LRTPFecStats &getStats();
+
+  private:
+    LRTPReorderBuffer &m_frames;
+
+    // sender: the block being sent and the parity payload built over it
+    uint8_t m_blockSize = 0;
+    uint8_t m_blockFirst = 0;
+    uint8_t m_blockCount = 0;
+    size_t m_blockLength = 0;
+    bool m_parityDue = false;
+    uint8_t m_parityPayload[LRTP_MAX_PAYLOAD_SZ];
+
+    // receiver: one past the highest sequence number seen
+    uint8_t m_rxHighest = 0;
+    float m_lossRate = 0;
+    // the block size asked of the peer
+    uint8_t m_rxBlockSize = 0;
+    bool m_reportDue = false;
+    // a parity frame arrived since the last report
+    bool m_parityHeard = false;
+    uint8_t m_reportPayload[LRTP_FEC_REPORT_SZ];
+
+    LRTPFecStats m_stats = {};
+
+    void sampleLoss(bool lost);
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+
+#include "LRTPConstants.hpp"
+
+/**
+ * @brief A raw frame as read from the radio
+ */
+struct LRTPRawFrame {
+    uint8_t data[LRTP_MAX_PACKET];
+    size_t length;
+    // time the frame was received (micros())
+    unsigned long timestamp;
+    // signal quality, only read while a capture is running
+    int16_t rssi;
+    float snr;
+    // spreading factor the radio received at, only read with adaptive rate
+    uint8_t spreadingFactor;
+};
+
+/**
+ * @brief Lock-free single-producer/single-consumer ring of raw frames.
+ *
+ * The producer (the radio receive ISR) fills a slot obtained with reserve()
+ * and publishes it with commit(). The consumer (the LRTP loop) reads the
+ * oldest frame with peek() and frees it with release(). A reserved slot that is
+ * never committed is simply reused by the next reserve().
+ *
+ * @tparam N the number of frames in the ring, must be a power of two
+ */
+template <size_t N>
+class LRTPFrameRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "LRTPFrameRing capacity must be a power of two");
+
+  public:
+    // producer side
+    LRTPRawFrame *reserve() {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) >= N)
+            return nullptr;
+        return &m_frames[tail & (N - 1)];
+    }
+
+    void commit() {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // consumer side
+    LRTPRawFrame *peek() {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return nullptr;
+        return &m_frames[head & (N - 1)];
+    }
+
+    void release() {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    size_t count() const {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    size_t size() const {
+        return N;
+    }
+
+  private:
+    LRTPRawFrame m_frames[N];
+    // free running indices, wrapped with a mask when accessing m_frames
+    std::atomic<size_t> m_head{ 0 };
+    std::atomic<size_t> m_tail{ 0 };
+};
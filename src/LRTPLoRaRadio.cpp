@@ -0,0 +1,159 @@
+#include "LRTPLoRaRadio.hpp"
+
+#if LRTP_RADIO_LORA
+
+// SX127x registers used for burst FIFO access
+#define LRTP_SX127X_REG_FIFO 0x00
+#define LRTP_SX127X_REG_PAYLOAD_LENGTH 0x22
+#define LRTP_SX127X_WRITE 0x80
+
+LRTPLoRaRadio::LRTPLoRaRadio(LoRaClass &lora) : m_lora(lora) {
+}
+
+LRTPLoRaRadio &LRTPLoRaRadio::shared() {
+    static LRTPLoRaRadio radio(LoRa);
+    return radio;
+}
+
+int LRTPLoRaRadio::begin() {
+    // forward the driver callbacks to the ones attached to this backend
+    m_lora.onReceive([this](int packetSize) {
+        m_rxRemaining = packetSize;
+        if (m_onReceive != nullptr)
+            m_onReceive(packetSize);
+    });
+    m_lora.onTxDone([this]() {
+        if (m_onTxDone != nullptr)
+            m_onTxDone();
+    });
+    m_lora.onCadDone([this](bool channelBusy) {
+        if (m_onCadDone != nullptr)
+            m_onCadDone(channelBusy);
+    });
+    return 1;
+}
+
+void LRTPLoRaRadio::setConfig(const LRTPRadioConfig &config) {
+    LRTPRadio::setConfig(config);
+    m_lora.setFrequency(config.frequency);
+    m_lora.setSpreadingFactor(config.spreadingFactor);
+    m_lora.setSignalBandwidth(config.signalBandwidth);
+    m_lora.setCodingRate4(config.codingRate4);
+    m_lora.setPreambleLength(config.preambleLength);
+    m_lora.setTxPower(config.txPower);
+    if (config.crc)
+        m_lora.enableCrc();
+    else
+        m_lora.disableCrc();
+}
+
+void LRTPLoRaRadio::receive() {
+    m_lora.receive();
+}
+
+void LRTPLoRaRadio::channelActivityDetection() {
+    m_lora.channelActivityDetection();
+}
+
+bool LRTPLoRaRadio::rxSignalDetected() {
+    return m_lora.rxSignalDetected();
+}
+
+void LRTPLoRaRadio::setSPI(SPIClass &spi, int ss, uint32_t frequency) {
+    m_spi = &spi;
+    m_ss = ss;
+    m_spiSettings = SPISettings(frequency, MSBFIRST, SPI_MODE0);
+}
+
+int LRTPLoRaRadio::beginPacket() {
+    m_txLength = 0;
+    return m_lora.beginPacket();
+}
+
+size_t LRTPLoRaRadio::write(const uint8_t *buf, size_t size) {
+    if (m_spi == nullptr)
+        return m_lora.write(buf, size);
+    // beginPacket() reset the FIFO pointer and payload length, so the frame can
+    // be streamed into the FIFO and the length set once
+    size = min(size, (size_t)LRTP_MAX_PACKET - m_txLength);
+    burstWriteFifo(buf, size);
+    m_txLength += size;
+    writeRegister(LRTP_SX127X_REG_PAYLOAD_LENGTH, m_txLength);
+    return size;
+}
+
+int LRTPLoRaRadio::endPacket(bool async) {
+    return m_lora.endPacket(async);
+}
+
+int LRTPLoRaRadio::available() {
+    if (m_spi == nullptr)
+        return m_lora.available();
+    return m_rxRemaining;
+}
+
+int LRTPLoRaRadio::read() {
+    if (m_rxRemaining > 0)
+        m_rxRemaining--;
+    return m_lora.read();
+}
+
+size_t LRTPLoRaRadio::readBytes(uint8_t *buf, size_t len) {
+    if (m_spi == nullptr)
+        return LRTPRadio::readBytes(buf, len);
+    // the driver has pointed the FIFO address at the start of the received
+    // packet, and each access auto-increments it
+    len = min(len, m_rxRemaining);
+    burstReadFifo(buf, len);
+    m_rxRemaining -= len;
+    return len;
+}
+
+void LRTPLoRaRadio::burstWriteFifo(const uint8_t *buf, size_t len) {
+    m_spi->beginTransaction(m_spiSettings);
+    digitalWrite(m_ss, LOW);
+    m_spi->transfer(LRTP_SX127X_REG_FIFO | LRTP_SX127X_WRITE);
+#if defined(ESP32) || defined(ESP8266)
+    m_spi->writeBytes(buf, len);
+#else
+    for (size_t i = 0; i < len; i++) {
+        m_spi->transfer(buf[i]);
+    }
+#endif
+    digitalWrite(m_ss, HIGH);
+    m_spi->endTransaction();
+}
+
+void LRTPLoRaRadio::burstReadFifo(uint8_t *buf, size_t len) {
+    m_spi->beginTransaction(m_spiSettings);
+    digitalWrite(m_ss, LOW);
+    m_spi->transfer(LRTP_SX127X_REG_FIFO);
+#if defined(ESP32) || defined(ESP8266)
+    m_spi->transferBytes(nullptr, buf, len);
+#else
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = m_spi->transfer(0x00);
+    }
+#endif
+    digitalWrite(m_ss, HIGH);
+    m_spi->endTransaction();
+}
+
+void LRTPLoRaRadio::writeRegister(uint8_t reg, uint8_t val) {
+    m_spi->beginTransaction(m_spiSettings);
+    digitalWrite(m_ss, LOW);
+    m_spi->transfer(reg | LRTP_SX127X_WRITE);
+    m_spi->transfer(val);
+    digitalWrite(m_ss, HIGH);
+    m_spi->endTransaction();
+}
+
+int LRTPLoRaRadio::packetRssi() {
+    return m_lora.packetRssi();
+}
+
+float LRTPLoRaRadio::packetSnr() {
+    return m_lora.packetSnr();
+}
+
+#endif
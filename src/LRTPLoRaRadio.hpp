@@ -0,0 +1,78 @@
+#pragma once
+#include <Arduino.h>
+#include "LRTPConstants.hpp"
+#include "LRTPRadio.hpp"
+
+#if LRTP_RADIO_LORA
+#include <LoRa.h>
+#include <SPI.h>
+
+/**
+ * @brief LRTPRadio backend for SX127x modules driven by the LoRa.h library.
+ *
+ * The module (pins, sync word) is set up through the LoRa object before
+ * LRTP::begin() is called. Modulation parameters should be set through
+ * setConfig() so that LRTP can compute frame airtimes.
+ */
+class LRTPLoRaRadio : public LRTPRadio {
+  public:
+    LRTPLoRaRadio(LoRaClass &lora = LoRa);
+
+    /**
+     * @brief Returns a backend bound to the global LoRa object. Used by the
+     * LRTP(uint16_t) constructor
+     */
+    static LRTPLoRaRadio &shared();
+
+    /**
+     * @brief Enable burst FIFO transfers. Each frame is then written and read
+     * in a single SPI transaction instead of one register access per byte.
+     * Must match the SPI bus and chip select pin given to the LoRa object
+     *
+     * @param spi the SPI bus the module is attached to
+     * @param ss the chip select pin of the module
+     * @param frequency the SPI clock frequency
+     */
+    void setSPI(SPIClass &spi, int ss, uint32_t frequency = LORA_DEFAULT_SPI_FREQUENCY);
+
+    int begin() override;
+
+    /**
+     * @brief Apply the modulation parameters to the LoRa module
+     */
+    void setConfig(const LRTPRadioConfig &config) override;
+
+    void receive() override;
+    void channelActivityDetection() override;
+    bool rxSignalDetected() override;
+
+    int beginPacket() override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int endPacket(bool async) override;
+
+    int available() override;
+    int read() override;
+    size_t readBytes(uint8_t *buf, size_t len) override;
+
+    int packetRssi() override;
+    float packetSnr() override;
+
+  private:
+    LoRaClass &m_lora;
+
+    // burst transfer settings, m_spi is null if burst transfers are disabled
+    SPIClass *m_spi = nullptr;
+    int m_ss = -1;
+    SPISettings m_spiSettings;
+
+    // bytes written to the FIFO for the current packet
+    size_t m_txLength = 0;
+    // bytes of the received packet not yet read from the FIFO
+    size_t m_rxRemaining = 0;
+
+    void burstWriteFifo(const uint8_t *buf, size_t len);
+    void burstReadFifo(uint8_t *buf, size_t len);
+    void writeRegister(uint8_t reg, uint8_t val);
+};
+
+#endif
@@ -0,0 +1,467 @@
+#include "LRTPMulticast.hpp"
+
+#include "LRTPDebug.h"
+
+// true if sequence number a comes after b
+static inline bool seqAfter(uint8_t a, uint8_t b) {
+    return (int8_t)(a - b) > 0;
+}
+
+LRTPMulticast::LRTPMulticast(uint16_t hostAddr, LRTPTimerWheel &timers) : m_hostAddr(hostAddr), m_timers(timers) {
+    for (TxStream &stream : m_txStreams) {
+        stream.active = false;
+        stream.heartbeatTimer.setCallback(std::bind(&LRTPMulticast::onHeartbeatTimeout, this, std::ref(stream)));
+    }
+    for (RxStream &stream : m_rxStreams) {
+        stream.active = false;
+        stream.nackTimer.setCallback(std::bind(&LRTPMulticast::onNackTimeout, this, std::ref(stream)));
+    }
+}
+
+bool LRTPMulticast::isGroupAddr(uint16_t addr) {
+    return addr >= LRTP_MULTICAST_MIN && addr <= LRTP_MULTICAST_MAX;
+}
+
+void LRTPMulticast::setSlotTime(unsigned long slotTime) {
+    m_slotTime = slotTime;
+}
+
+bool LRTPMulticast::joinGroup(uint16_t group) {
+    if (!isGroupAddr(group))
+        return false;
+    uint16_t *free = nullptr;
+    for (uint16_t &joined : m_groups) {
+        if (joined == group)
+            return true;
+        if (joined == 0 && free == nullptr)
+            free = &joined;
+    }
+    if (free == nullptr)
+        return false;
+    *free = group;
+    return true;
+}
+
+void LRTPMulticast::leaveGroup(uint16_t group) {
+    for (uint16_t &joined : m_groups) {
+        if (joined == group)
+            joined = 0;
+    }
+    for (RxStream &stream : m_rxStreams) {
+        if (stream.active && stream.group == group) {
+            stream.nackTimer.cancel();
+            stream.active = false;
+        }
+    }
+}
+
+bool LRTPMulticast::isActive() {
+    for (uint16_t joined : m_groups) {
+        if (joined != 0)
+            return true;
+    }
+    for (TxStream &stream : m_txStreams) {
+        if (stream.active)
+            return true;
+    }
+    return false;
+}
+
+bool LRTPMulticast::accepts(uint16_t dest) {
+    if (!isGroupAddr(dest))
+        return false;
+    for (uint16_t joined : m_groups) {
+        if (joined == dest)
+            return true;
+    }
+    // senders listen for NACKs to their groups
+    for (TxStream &stream : m_txStreams) {
+        if (stream.active && stream.group == dest)
+            return true;
+    }
+    return false;
+}
+
+size_t LRTPMulticast::write(uint16_t group, const uint8_t *buf, size_t len, unsigned long t) {
+    TxStream *stream = findTxStream(group, true);
+    if (stream == nullptr)
+        return 0;
+    size_t written = 0;
+    while (written < len) {
+        if (stream->count == LRTP_MCAST_WINDOW) {
+            // replace the oldest frame once receivers have had time to NACK it
+            TxFrame &oldest = stream->frames[(uint8_t)(stream->nextSeq - stream->count) % LRTP_MCAST_WINDOW];
+            if (!oldest.sent || t - oldest.sentAt < LRTP_MCAST_HOLD_SLOTS * m_slotTime)
+                break;
+            stream->count--;
+        }
+        TxFrame &frame = stream->frames[stream->nextSeq % LRTP_MCAST_WINDOW];
+        frame.length = min(len - written, (size_t)LRTP_MAX_PAYLOAD_SZ);
+        memcpy(frame.data, buf + written, frame.length);
+        frame.seq = stream->nextSeq;
+        frame.sent = false;
+        frame.repair = false;
+        stream->nextSeq++;
+        stream->count++;
+        written += frame.length;
+    }
+    if (written > 0) {
+        // heartbeats restart after the new data has been sent
+        stream->heartbeatTimer.cancel();
+        stream->heartbeatPending = false;
+    }
+    return written;
+}
+
+void LRTPMulticast::onReceived(std::function<void(const LRTPPacket &)> callback) {
+    m_onReceived = callback;
+}
+
+void LRTPMulticast::handlePacket(const LRTPPacket &packet, unsigned long t) {
+    if (packet.payloadType == LRTP_TYPE_MULTICAST)
+        handleData(packet, t);
+    else if (packet.payloadType == LRTP_TYPE_MULTICAST_NACK)
+        handleNack(packet, t);
+}
+
+bool LRTPMulticast::hasPending() {
+    size_t stream, frame;
+    return selectNext(stream, frame) != TxKind::NONE;
+}
+
+LRTPPriority LRTPMulticast::getTxPriority() {
+    size_t stream, frame;
+    return selectNext(stream, frame) == TxKind::NACK ? LRTPPriority::CONTROL : LRTPPriority::BULK;
+}
+
+size_t LRTPMulticast::getNextTxPayloadLength() {
+    size_t stream, frame;
+    switch (selectNext(stream, frame)) {
+    case TxKind::NACK:
+        return LRTP_MCAST_NACK_SZ;
+    case TxKind::REPAIR:
+    case TxKind::DATA:
+        return m_txStreams[stream].frames[frame].length;
+    default:
+        return 0;
+    }
+}
+
+LRTPPacket *LRTPMulticast::getNextTxPacket(unsigned long t) {
+    size_t index, frameIndex;
+    TxKind kind = selectNext(index, frameIndex);
+    if (kind == TxKind::NONE)
+        return nullptr;
+
+    m_txPacket = {};
+    m_txPacket.version = LRTP_DEFAULT_VERSION;
+    m_txPacket.src = m_hostAddr;
+
+    if (kind == TxKind::NACK) {
+        RxStream &stream = m_rxStreams[index];
+        m_nackPayload[0] = stream.source >> 0x08;
+        m_nackPayload[1] = stream.source & 0xff;
+        m_nackPayload[2] = stream.expected;
+        m_nackPayload[3] = missingFrames(stream);
+        stream.nackPending = false;
+        m_stats.nacksSent++;
+        m_txPacket.payloadType = LRTP_TYPE_MULTICAST_NACK;
+        m_txPacket.dest = stream.group;
+        m_txPacket.payload = m_nackPayload;
+        m_txPacket.payloadLength = LRTP_MCAST_NACK_SZ;
+        return &m_txPacket;
+    }
+
+    TxStream &stream = m_txStreams[index];
+    m_txPacket.payloadType = LRTP_TYPE_MULTICAST;
+    m_txPacket.dest = stream.group;
+    // the oldest frame that can still be repaired, where new receivers start
+    m_txPacket.ackNum = stream.nextSeq - stream.count;
+    if (kind == TxKind::HEARTBEAT) {
+        stream.heartbeatPending = false;
+        stream.heartbeats++;
+        m_stats.heartbeats++;
+        if (stream.heartbeats < LRTP_MCAST_HEARTBEATS)
+            m_timers.start(stream.heartbeatTimer, (LRTP_MCAST_HEARTBEAT_SLOTS << stream.heartbeats) * m_slotTime, t);
+        m_txPacket.seqNum = stream.nextSeq;
+        return &m_txPacket;
+    }
+
+    TxFrame &frame = stream.frames[frameIndex];
+    if (kind == TxKind::REPAIR) {
+        frame.repair = false;
+        m_stats.repairs++;
+    } else {
+        stream.nextToSend++;
+        m_stats.sent++;
+    }
+    frame.sent = true;
+    frame.sentAt = t;
+    m_txPacket.seqNum = frame.seq;
+    m_txPacket.payload = frame.data;
+    m_txPacket.payloadLength = frame.length;
+    onFrameSent(stream);
+    return &m_txPacket;
+}
+
+const LRTPMulticastStats &LRTPMulticast::getStats() {
+    return m_stats;
+}
+
+LRTPMulticast::TxStream *LRTPMulticast::findTxStream(uint16_t group, bool create) {
+    if (!isGroupAddr(group))
+        return nullptr;
+    TxStream *free = nullptr;
+    for (TxStream &stream : m_txStreams) {
+        if (stream.active && stream.group == group)
+            return &stream;
+        if (!stream.active && free == nullptr)
+            free = &stream;
+    }
+    if (!create || free == nullptr)
+        return nullptr;
+    free->active = true;
+    free->group = group;
+    free->nextSeq = random(0, 256);
+    free->nextToSend = free->nextSeq;
+    free->count = 0;
+    free->heartbeats = 0;
+    free->heartbeatPending = false;
+    return free;
+}
+
+LRTPMulticast::RxStream *LRTPMulticast::findRxStream(uint16_t source, uint16_t group, bool create) {
+    RxStream *free = nullptr;
+    for (RxStream &stream : m_rxStreams) {
+        if (stream.active && stream.source == source && stream.group == group)
+            return &stream;
+        if (!stream.active && free == nullptr)
+            free = &stream;
+    }
+    if (!create || free == nullptr)
+        return nullptr;
+    free->active = true;
+    free->source = source;
+    free->group = group;
+    free->synced = false;
+    free->nackPending = false;
+    free->nackRetries = 0;
+    for (RxFrame &frame : free->frames) {
+        frame.present = false;
+    }
+    return free;
+}
+
+LRTPMulticast::TxKind LRTPMulticast::selectNext(size_t &stream, size_t &frame) {
+    // NACKs first, so that repairs can start while the sender is still active
+    for (size_t i = 0; i < LRTP_MCAST_RX_STREAMS; i++) {
+        if (m_rxStreams[i].active && m_rxStreams[i].nackPending) {
+            stream = i;
+            return TxKind::NACK;
+        }
+    }
+    // then repairs, oldest first, then new data
+    for (size_t i = 0; i < LRTP_MCAST_TX_STREAMS; i++) {
+        TxStream &tx = m_txStreams[i];
+        if (!tx.active)
+            continue;
+        for (uint8_t seq = tx.nextSeq - tx.count; seq != tx.nextToSend; seq++) {
+            if (tx.frames[seq % LRTP_MCAST_WINDOW].repair) {
+                stream = i;
+                frame = seq % LRTP_MCAST_WINDOW;
+                return TxKind::REPAIR;
+            }
+        }
+    }
+    for (size_t i = 0; i < LRTP_MCAST_TX_STREAMS; i++) {
+        TxStream &tx = m_txStreams[i];
+        if (tx.active && tx.nextToSend != tx.nextSeq) {
+            stream = i;
+            frame = tx.nextToSend % LRTP_MCAST_WINDOW;
+            return TxKind::DATA;
+        }
+    }
+    for (size_t i = 0; i < LRTP_MCAST_TX_STREAMS; i++) {
+        if (m_txStreams[i].active && m_txStreams[i].heartbeatPending) {
+            stream = i;
+            return TxKind::HEARTBEAT;
+        }
+    }
+    return TxKind::NONE;
+}
+
+void LRTPMulticast::onFrameSent(TxStream &stream) {
+    // start announcing the end of the burst once all data has been sent
+    if (stream.nextToSend == stream.nextSeq && !stream.heartbeatTimer.isActive()) {
+        stream.heartbeats = 0;
+        m_timers.start(stream.heartbeatTimer, LRTP_MCAST_HEARTBEAT_SLOTS * m_slotTime, stream.frames[(uint8_t)(stream.nextSeq - 1) % LRTP_MCAST_WINDOW].sentAt);
+    }
+}
+
+void LRTPMulticast::onHeartbeatTimeout(TxStream &stream) {
+    if (stream.active)
+        stream.heartbeatPending = true;
+}
+
+void LRTPMulticast::handleData(const LRTPPacket &packet, unsigned long t) {
+    RxStream *stream = findRxStream(packet.src, packet.dest, true);
+    if (stream == nullptr) {
+        lrtp_debugf("Multicast: no room for stream from %u\n", packet.src);
+        return;
+    }
+    const bool heartbeat = packet.payloadLength == 0;
+    // a heartbeat carries the next sequence number, a frame its own
+    const uint8_t next = heartbeat ? packet.seqNum : packet.seqNum + 1;
+    if (!stream->synced) {
+        // start from the oldest frame the sender can still repair
+        stream->expected = packet.ackNum;
+        if ((uint8_t)(next - stream->expected) > LRTP_MCAST_WINDOW)
+            stream->expected = next - LRTP_MCAST_WINDOW;
+        stream->highest = stream->expected;
+        stream->synced = true;
+    }
+    if (seqAfter(next, stream->highest))
+        stream->highest = next;
+
+    if (!heartbeat) {
+        uint8_t offset = packet.seqNum - stream->expected;
+        if (offset >= 0x80) {
+            // already delivered
+            return;
+        }
+        // frames too far behind to be buffered are given up
+        while ((uint8_t)(packet.seqNum - stream->expected) >= LRTP_MCAST_WINDOW) {
+            if (isBuffered(*stream, stream->expected))
+                deliver(*stream);
+            else {
+                m_stats.lost++;
+                stream->expected++;
+            }
+        }
+        RxFrame &frame = stream->frames[packet.seqNum % LRTP_MCAST_WINDOW];
+        if (!(frame.present && frame.seq == packet.seqNum)) {
+            memcpy(frame.data, packet.payload, packet.payloadLength);
+            frame.length = packet.payloadLength;
+            frame.seq = packet.seqNum;
+            frame.present = true;
+        }
+        if (isBuffered(*stream, stream->expected)) {
+            // progress, the repair is working
+            stream->nackRetries = 0;
+            while (isBuffered(*stream, stream->expected))
+                deliver(*stream);
+        }
+    }
+    checkGaps(*stream, t);
+}
+
+void LRTPMulticast::handleNack(const LRTPPacket &packet, unsigned long t) {
+    if (packet.payloadLength < LRTP_MCAST_NACK_SZ)
+        return;
+    uint16_t source = (packet.payload[0] << 0x08) | packet.payload[1];
+    uint8_t base = packet.payload[2];
+    uint8_t bitmap = packet.payload[3];
+
+    if (source == m_hostAddr) {
+        // a receiver is missing some of our frames: queue repairs
+        TxStream *stream = findTxStream(packet.dest, false);
+        if (stream == nullptr)
+            return;
+        for (uint8_t i = 0; i < 8; i++) {
+            uint8_t seq = base + i;
+            uint8_t age = stream->nextSeq - seq;
+            if ((bitmap & (1 << i)) && age >= 1 && age <= stream->count) {
+                TxFrame &frame = stream->frames[seq % LRTP_MCAST_WINDOW];
+                if (frame.sent)
+                    frame.repair = true;
+            }
+        }
+        return;
+    }
+
+    // another receiver's NACK: suppress ours if it asks for everything we miss
+    RxStream *stream = findRxStream(source, packet.dest, false);
+    if (stream == nullptr)
+        return;
+    uint8_t missing = missingFrames(*stream);
+    if (missing == 0 || !(stream->nackPending || stream->nackTimer.isActive()))
+        return;
+    uint8_t shift = stream->expected - base;
+    uint8_t covered = shift < 8 ? bitmap >> shift : 0;
+    if ((missing & ~covered) == 0) {
+        m_stats.nacksSuppressed++;
+        stream->nackPending = false;
+        stream->nackRetries++;
+        m_timers.start(stream->nackTimer, randomSlots(LRTP_MCAST_REPAIR_SLOTS, LRTP_MCAST_REPAIR_SLOTS + LRTP_MCAST_NACK_SLOTS), t);
+    }
+}
+
+void LRTPMulticast::deliver(RxStream &stream) {
+    RxFrame &frame = stream.frames[stream.expected % LRTP_MCAST_WINDOW];
+    frame.present = false;
+    stream.expected++;
+    m_stats.delivered++;
+    if (m_onReceived != nullptr) {
+        LRTPPacket packet = {};
+        packet.version = LRTP_DEFAULT_VERSION;
+        packet.payloadType = LRTP_TYPE_MULTICAST;
+        packet.src = stream.source;
+        packet.dest = stream.group;
+        packet.seqNum = frame.seq;
+        packet.payload = frame.data;
+        packet.payloadLength = frame.length;
+        m_onReceived(packet);
+    }
+}
+
+bool LRTPMulticast::isBuffered(RxStream &stream, uint8_t seq) {
+    RxFrame &frame = stream.frames[seq % LRTP_MCAST_WINDOW];
+    return frame.present && frame.seq == seq;
+}
+
+uint8_t LRTPMulticast::missingFrames(RxStream &stream) {
+    uint8_t bitmap = 0;
+    uint8_t outstanding = min((uint8_t)(stream.highest - stream.expected), (uint8_t)LRTP_MCAST_WINDOW);
+    if (outstanding >= 0x80)
+        return 0;
+    for (uint8_t i = 0; i < outstanding; i++) {
+        if (!isBuffered(stream, stream.expected + i))
+            bitmap |= 1 << i;
+    }
+    return bitmap;
+}
+
+void LRTPMulticast::checkGaps(RxStream &stream, unsigned long t) {
+    if (missingFrames(stream) == 0 || stream.nackPending || stream.nackTimer.isActive())
+        return;
+    // wait a random time so that the first receiver's NACK suppresses the rest
+    m_timers.start(stream.nackTimer, randomSlots(1, LRTP_MCAST_NACK_SLOTS), t);
+}
+
+void LRTPMulticast::onNackTimeout(RxStream &stream) {
+    if (!stream.active || missingFrames(stream) == 0)
+        return;
+    if (stream.nackRetries >= LRTP_MCAST_NACK_RETRIES) {
+        // give up on the missing frames and deliver what follows them
+        lrtp_debugf("Multicast: giving up on frames from %u\n", stream.source);
+        stream.nackRetries = 0;
+        while (stream.expected != stream.highest) {
+            if (isBuffered(stream, stream.expected)) {
+                deliver(stream);
+            } else {
+                m_stats.lost++;
+                stream.expected++;
+            }
+        }
+        return;
+    }
+    stream.nackPending = true;
+    stream.nackRetries++;
+    // ask again if the repair does not arrive
+    m_timers.start(stream.nackTimer, randomSlots(LRTP_MCAST_REPAIR_SLOTS, LRTP_MCAST_REPAIR_SLOTS + LRTP_MCAST_NACK_SLOTS), millis());
+}
+
+unsigned long LRTPMulticast::randomSlots(unsigned long min, unsigned long max) {
+    // a random time between min and max slots, at a quarter slot resolution
+    return random(min * 4, max * 4 + 1) * m_slotTime / 4;
+}
@@ -0,0 +1,163 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+
+#include "LRTPConstants.hpp"
+#include "LRTPTimerWheel.hpp"
+
+/**
+ * @brief Reliable multicast: sequenced streams to group addresses with
+ * NACK based repair.
+ *
+ * A sender numbers the frames it sends to a group and keeps the last
+ * LRTP_MCAST_WINDOW of them for repair. Receivers buffer frames that arrive
+ * out of order and deliver them in sequence. When a receiver sees a gap it
+ * waits a random number of slots and multicasts a NACK listing the missing
+ * frames. Other receivers missing the same frames hear the NACK and suppress
+ * their own, so one NACK and one repair serve the whole group. NACKs are
+ * repeated at most every LRTP_MCAST_REPAIR_SLOTS, and frames that cannot be
+ * repaired are given up after LRTP_MCAST_NACK_RETRIES. After a burst the
+ * sender sends a few heartbeats carrying its next sequence number, so that
+ * receivers also notice frames lost at the end of the burst.
+ *
+ * Multicast frames are sent by LRTP between connection frames, see
+ * LRTP::multicastWrite().
+ */
+class LRTPMulticast {
+  public:
+    LRTPMulticast(uint16_t hostAddr, LRTPTimerWheel &timers);
+
+    static bool isGroupAddr(uint16_t addr);
+
+    // set the slot time (ms) that multicast delays are counted in, normally
+    // the airtime of a full frame
+    void setSlotTime(unsigned long slotTime);
+
+    bool joinGroup(uint16_t group);
+    void leaveGroup(uint16_t group);
+
+    // returns true if this node has joined a group or sends to one
+    bool isActive();
+
+    /**
+     * @brief Returns true if frames sent to dest should be received: dest is a
+     * joined group or a group this node sends to. Called from the receive ISR
+     */
+    bool accepts(uint16_t dest);
+
+    /**
+     * @brief Queue data to be sent to a group, split into frames
+     *
+     * @param t the current time (ms)
+     * @return size_t the number of bytes queued. Less than len if the repair
+     * window is full of frames that were sent too recently to be replaced
+     */
+    size_t write(uint16_t group, const uint8_t *buf, size_t len, unsigned long t);
+
+    /**
+     * @brief Set a handler to be called with each multicast frame received, in
+     * sequence order. packet.dest is the group address
+     */
+    void onReceived(std::function<void(const LRTPPacket &)> callback);
+
+    // handle a frame addressed to a group accepted by this node
+    void handlePacket(const LRTPPacket &packet, unsigned long t);
+
+    // returns true if there is a multicast frame (data, repair, NACK or
+    // heartbeat) waiting to be sent
+    bool hasPending();
+    LRTPPriority getTxPriority();
+    size_t getNextTxPayloadLength();
+
+    /**
+     * @brief Get the next multicast frame and mark it as sent
+     *
+     * @return LRTPPacket* the frame, valid until the next call, or nullptr
+     */
+    LRTPPacket *getNextTxPacket(unsigned long t);
+
+    const LRTPMulticastStats &getStats();
+
+  private:
+    enum class TxKind { NONE, NACK, REPAIR, DATA, HEARTBEAT };
+
+    struct TxFrame {
+        uint8_t data[LRTP_MAX_PAYLOAD_SZ];
+        size_t length;
+        uint8_t seq;
+        bool sent;
+        // requested by a NACK
+        bool repair;
+        unsigned long sentAt;
+    };
+
+    struct TxStream {
+        bool active;
+        uint16_t group;
+        // sequence number of the next frame written
+        uint8_t nextSeq;
+        // sequence number of the next frame to send for the first time
+        uint8_t nextToSend;
+        // frames in the window, from nextSeq - count
+        uint8_t count;
+        TxFrame frames[LRTP_MCAST_WINDOW];
+        LRTPTimer heartbeatTimer;
+        uint8_t heartbeats;
+        bool heartbeatPending;
+    };
+
+    struct RxFrame {
+        uint8_t data[LRTP_MAX_PAYLOAD_SZ];
+        size_t length;
+        uint8_t seq;
+        bool present;
+    };
+
+    struct RxStream {
+        bool active;
+        // false until the first frame sets the sequence numbers
+        bool synced;
+        uint16_t source;
+        uint16_t group;
+        // next sequence number to deliver
+        uint8_t expected;
+        // one past the highest sequence number heard of
+        uint8_t highest;
+        RxFrame frames[LRTP_MCAST_WINDOW];
+        LRTPTimer nackTimer;
+        bool nackPending;
+        uint8_t nackRetries;
+    };
+
+    uint16_t m_hostAddr;
+    LRTPTimerWheel &m_timers;
+    unsigned long m_slotTime = LRTP_CSMA_DEFAULT_FRAME_AIRTIME;
+
+    uint16_t m_groups[LRTP_MCAST_MAX_GROUPS] = {};
+    TxStream m_txStreams[LRTP_MCAST_TX_STREAMS];
+    RxStream m_rxStreams[LRTP_MCAST_RX_STREAMS];
+
+    LRTPMulticastStats m_stats = {};
+
+    std::function<void(const LRTPPacket &)> m_onReceived = nullptr;
+
+    // the frame returned by getNextTxPacket()
+    LRTPPacket m_txPacket;
+    uint8_t m_nackPayload[LRTP_MCAST_NACK_SZ];
+
+    TxStream *findTxStream(uint16_t group, bool create);
+    RxStream *findRxStream(uint16_t source, uint16_t group, bool create);
+
+    TxKind selectNext(size_t &stream, size_t &frame);
+    void onFrameSent(TxStream &stream);
+    void onHeartbeatTimeout(TxStream &stream);
+
+    void handleData(const LRTPPacket &packet, unsigned long t);
+    void handleNack(const LRTPPacket &packet, unsigned long t);
+    void deliver(RxStream &stream);
+    bool isBuffered(RxStream &stream, uint8_t seq);
+    uint8_t missingFrames(RxStream &stream);
+    void checkGaps(RxStream &stream, unsigned long t);
+    void onNackTimeout(RxStream &stream);
+    unsigned long randomSlots(unsigned long min, unsigned long max);
+};
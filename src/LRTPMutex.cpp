@@ -0,0 +1,50 @@
+#include "LRTPMutex.hpp"
+
+#if defined(ESP32)
+
+LRTPMutex::LRTPMutex() : m_handle(xSemaphoreCreateRecursiveMutex()) {
+}
+
+LRTPMutex::~LRTPMutex() {
+    vSemaphoreDelete(m_handle);
+}
+
+void LRTPMutex::lock() {
+    xSemaphoreTakeRecursive(m_handle, portMAX_DELAY);
+}
+
+void LRTPMutex::unlock() {
+    xSemaphoreGiveRecursive(m_handle);
+}
+
+#elif defined(__linux__)
+
+LRTPMutex::LRTPMutex() {
+}
+
+LRTPMutex::~LRTPMutex() {
+}
+
+void LRTPMutex::lock() {
+    m_mutex.lock();
+}
+
+void LRTPMutex::unlock() {
+    m_mutex.unlock();
+}
+
+#else
+
+LRTPMutex::LRTPMutex() {
+}
+
+LRTPMutex::~LRTPMutex() {
+}
+
+void LRTPMutex::lock() {
+}
+
+void LRTPMutex::unlock() {
+}
+
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+#include <Arduino.h>
+
+#if defined(ESP32)
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#elif defined(__linux__)
+#include <mutex>
+#endif
+
+/**
+ * @brief Recursive lock guarding the state of an LRTP node.
+ *
+ * A FreeRTOS recursive mutex on ESP32 and a std::recursive_mutex on Linux. It
+ * is recursive so that handlers called from LRTP::loop() may use the
+ * connection API. On targets without threads it does nothing. Must not be
+ * taken from an interrupt.
+ */
+class LRTPMutex {
+  public:
+    LRTPMutex();
+    ~LRTPMutex();
+
+    void lock();
+    void unlock();
+
+  private:
+#if defined(ESP32)
+    SemaphoreHandle_t m_handle;
+#elif defined(__linux__)
+    std::recursive_mutex m_mutex;
+#endif
+};
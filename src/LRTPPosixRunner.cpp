@@ -0,0 +1,86 @@
+#include "LRTPPosixRunner.hpp"
+
+#if LRTP_POSIX_RUNNER
+
+#include <climits>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+LRTPPosixRunner::LRTPPosixRunner(LRTP &lrtp) : m_lrtp(lrtp) {
+}
+
+LRTPPosixRunner::~LRTPPosixRunner() {
+    end();
+}
+
+bool LRTPPosixRunner::begin() {
+    if (m_wakeFds[0] >= 0)
+        return true;
+    if (pipe(m_wakeFds) < 0) {
+        m_wakeFds[0] = m_wakeFds[1] = -1;
+        return false;
+    }
+    for (int fd : m_wakeFds) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+    m_lrtp.onWake(std::bind(&LRTPPosixRunner::wake, this));
+    return true;
+}
+
+void LRTPPosixRunner::end() {
+    if (m_wakeFds[0] < 0)
+        return;
+    m_lrtp.onWake(nullptr);
+    close(m_wakeFds[0]);
+    close(m_wakeFds[1]);
+    m_wakeFds[0] = m_wakeFds[1] = -1;
+}
+
+void LRTPPosixRunner::runOnce(unsigned long maxWait) {
+    m_lrtp.loop();
+
+    unsigned long deadline = min(m_lrtp.nextDeadline(), maxWait);
+    if (deadline == 0)
+        return;
+
+    struct pollfd fds[2];
+    nfds_t count = 0;
+    if (m_wakeFds[0] >= 0)
+        fds[count++] = { m_wakeFds[0], POLLIN, 0 };
+    int radioFd = m_lrtp.getRadio().getEventFd();
+    if (radioFd >= 0)
+        fds[count++] = { radioFd, POLLIN, 0 };
+    int timeout = deadline == LRTP_NO_DEADLINE ? -1 : (int)min(deadline, (unsigned long)INT_MAX);
+    poll(fds, count, timeout);
+
+    // drain the wakeup pipe; the events themselves are handled by loop()
+    if (m_wakeFds[0] >= 0) {
+        uint8_t buf[32];
+        while (read(m_wakeFds[0], buf, sizeof(buf)) > 0) {
+        }
+    }
+}
+
+void LRTPPosixRunner::run() {
+    m_running = true;
+    while (m_running) {
+        runOnce();
+    }
+}
+
+void LRTPPosixRunner::stop() {
+    m_running = false;
+    wake();
+}
+
+void LRTPPosixRunner::wake() {
+    if (m_wakeFds[1] < 0)
+        return;
+    // a full pipe already guarantees a wakeup
+    uint8_t b = 0;
+    ssize_t written = write(m_wakeFds[1], &b, 1);
+    (void)written;
+}
+
+#endif
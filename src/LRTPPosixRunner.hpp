@@ -0,0 +1,57 @@
+#pragma once
+#include <Arduino.h>
+
+#include "LRTP.h"
+
+#if LRTP_POSIX_RUNNER
+
+/**
+ * @brief Runs an LRTP instance on a Linux host without busy waiting.
+ *
+ * Between calls to LRTP::loop() the runner blocks in poll() until
+ * LRTP::nextDeadline(), until the radio's event descriptor becomes readable,
+ * or until LRTP::onWake() is signalled. Wakeups are delivered through a pipe,
+ * so they may come from other threads or from a signal handler. Other threads
+ * may read, write and open connections while the runner runs, as those calls
+ * take the node's lock (see LRTP::lock()); take the lock to use the rest of
+ * the API from another thread.
+ *
+ * Only one thread may call run() or runOnce().
+ */
+class LRTPPosixRunner {
+  public:
+    LRTPPosixRunner(LRTP &lrtp);
+    ~LRTPPosixRunner();
+
+    /**
+     * @brief Attach the runner to its LRTP instance. LRTP::begin() must have
+     * been called
+     *
+     * @return true on success, false if the wakeup pipe could not be created
+     */
+    bool begin();
+    void end();
+
+    /**
+     * @brief Call LRTP::loop() once, then wait for the next deadline or event
+     *
+     * @param maxWait the longest time to wait in ms
+     */
+    void runOnce(unsigned long maxWait = LRTP_NO_DEADLINE);
+
+    // call runOnce() until stop() is called
+    void run();
+
+    // make run() return. May be called from any thread
+    void stop();
+
+  private:
+    LRTP &m_lrtp;
+    // wakeup pipe: written by wake(), drained by runOnce()
+    int m_wakeFds[2] = { -1, -1 };
+    volatile bool m_running = false;
+
+    void wake();
+};
+
+#endif
@@ -0,0 +1,173 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+
+#include "LRTPAirtime.hpp"
+#include "LRTPConstants.hpp"
+
+/**
+ * @brief LoRa modulation parameters of a radio. Defaults match
+ * examples/LoRaConfig.h
+ */
+struct LRTPRadioConfig {
+    long frequency = 433E6;
+    // spreading factor: range: 6-12
+    uint8_t spreadingFactor = 12;
+    long signalBandwidth = 125E3;
+    // coding rate denominator: range: 5-8 (4/5 - 4/8)
+    uint8_t codingRate4 = 5;
+    uint16_t preambleLength = 8;
+    bool crc = true;
+    // transmit power in dBm
+    int8_t txPower = 17;
+};
+
+/**
+ * @brief Abstract radio driver used by LRTP to send and receive raw frames.
+ *
+ * The interface mirrors the asynchronous parts of the LoRa.h driver that LRTP
+ * depends on (receive, transmit, channel activity detection and their
+ * completion callbacks), so that the protocol can run on top of different
+ * backends: the SX127x driver (LRTPLoRaRadio) or a simulated ether
+ * (LRTPUdpRadio).
+ *
+ * Callbacks may be invoked from an interrupt context and must be kept short.
+ */
+class LRTPRadio {
+  public:
+    virtual ~LRTPRadio() {
+    }
+
+    /**
+     * @brief Prepare the backend for use. Must be called before any other
+     * method. Callbacks should be attached before calling begin()
+     *
+     * @return int 1 on success, 0 on failure
+     */
+    virtual int begin() = 0;
+
+    // put the radio into continuous receive mode
+    virtual void receive() = 0;
+    // start a single channel activity detection round. Completion is signalled
+    // through the onCadDone() callback
+    virtual void channelActivityDetection() = 0;
+    // returns true if a preamble/header is currently being received
+    virtual bool rxSignalDetected() = 0;
+
+    // transmit methods
+    virtual int beginPacket() = 0;
+    virtual size_t write(const uint8_t *buf, size_t size) = 0;
+    /**
+     * @brief Finish the current packet and start transmitting it
+     *
+     * @param async if true, return immediately and signal completion through
+     * the onTxDone() callback
+     * @return int 1 on success, 0 on failure
+     */
+    virtual int endPacket(bool async) = 0;
+
+    // receive methods: only valid while handling the onReceive() callback
+    virtual int available() = 0;
+    virtual int read() = 0;
+    /**
+     * @brief Read up to len bytes of the received frame in one burst. Backends
+     * that can't burst the FIFO fall back to read()
+     *
+     * @return size_t the number of bytes read
+     */
+    virtual size_t readBytes(uint8_t *buf, size_t len) {
+        size_t i = 0;
+        while (i < len && available() > 0) {
+            buf[i++] = (uint8_t)read();
+        }
+        return i;
+    }
+
+    /**
+     * @brief Signal strength of the received frame. Only valid while handling
+     * the onReceive() callback. Backends that can't measure it return 0
+     *
+     * @return int the RSSI in dBm
+     */
+    virtual int packetRssi() {
+        return 0;
+    }
+
+    // signal to noise ratio of the received frame in dB, see packetRssi()
+    virtual float packetSnr() {
+        return 0;
+    }
+
+    /**
+     * @brief Give backends that are not interrupt driven a chance to process
+     * pending events and invoke callbacks. Called from LRTP::loop()
+     */
+    virtual void poll() {
+    }
+
+    /**
+     * @brief Time until a polled backend next needs poll() to be called, for
+     * example when a frame on air finishes. Interrupt driven backends return
+     * LRTP_NO_DEADLINE
+     *
+     * @return unsigned long the time in microseconds
+     */
+    virtual unsigned long pollDeadline() {
+        return LRTP_NO_DEADLINE;
+    }
+
+    /**
+     * @brief File descriptor that becomes readable when a polled backend has
+     * new events, so that event loops can wait on it
+     *
+     * @return int the descriptor, or -1 if the backend is interrupt driven
+     */
+    virtual int getEventFd() {
+        return -1;
+    }
+
+    /**
+     * @brief Set the modulation parameters of the radio. The base
+     * implementation only records them, backends apply them to the hardware
+     */
+    virtual void setConfig(const LRTPRadioConfig &config) {
+        m_config = config;
+    }
+
+    const LRTPRadioConfig &getConfig() {
+        return m_config;
+    }
+
+    /**
+     * @brief Time on air of a frame using the current modulation parameters
+     *
+     * @param length the frame length in bytes
+     * @return unsigned long the airtime in microseconds
+     */
+    unsigned long airtime(size_t length) {
+        return airtime(length, m_config);
+    }
+
+    // time on air of a frame using the given modulation parameters
+    static unsigned long airtime(size_t length, const LRTPRadioConfig &config) {
+        return lrtpTimeOnAir(length, config.spreadingFactor, config.signalBandwidth, config.codingRate4, config.preambleLength, config.crc);
+    }
+
+    // callback registration
+    void onReceive(std::function<void(int)> callback) {
+        m_onReceive = callback;
+    }
+    void onTxDone(std::function<void(void)> callback) {
+        m_onTxDone = callback;
+    }
+    void onCadDone(std::function<void(bool)> callback) {
+        m_onCadDone = callback;
+    }
+
+  protected:
+    LRTPRadioConfig m_config;
+
+    std::function<void(int)> m_onReceive = nullptr;
+    std::function<void(void)> m_onTxDone = nullptr;
+    std::function<void(bool)> m_onCadDone = nullptr;
+};
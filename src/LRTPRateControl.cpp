@@ -0,0 +1,190 @@
+#include "LRTPRateControl.hpp"
+
+#include "LRTPConnection.hpp"
+#include "LRTPConnectionTable.hpp"
+#include "LRTPDebug.h"
+
+void LRTPRateControl::begin(const LRTPRadioConfig &base) {
+    m_base = base;
+    m_rateCount = base.spreadingFactor > LRTP_RATE_MIN_SF ? base.spreadingFactor - LRTP_RATE_MIN_SF + 1 : 1;
+    m_listenRate = 0;
+    m_lease = LRTP_RATE_LEASE_SLOTS * LRTPRadio::airtime(LRTP_MAX_PACKET, base) / 1000;
+}
+
+void LRTPRateControl::setEnabled(bool enabled) {
+    m_enabled = enabled;
+    if (!enabled)
+        m_listenRate = 0;
+}
+
+bool LRTPRateControl::isEnabled() {
+    return m_enabled;
+}
+
+uint8_t LRTPRateControl::getRateCount() {
+    return m_rateCount;
+}
+
+uint8_t LRTPRateControl::getListenRate() {
+    return m_listenRate;
+}
+
+LRTPRadioConfig LRTPRateControl::getConfig(uint8_t rate, int8_t txPower) {
+    LRTPRadioConfig config = m_base;
+    config.spreadingFactor = m_base.spreadingFactor - min(rate, (uint8_t)(m_rateCount - 1));
+    config.txPower = txPower;
+    return config;
+}
+
+LRTPRadioConfig LRTPRateControl::getListenConfig() {
+    return getConfig(m_listenRate, m_base.txPower);
+}
+
+LRTPRadioConfig LRTPRateControl::getTxConfig(const LRTPLinkState &link, unsigned long t) {
+    if (!m_enabled)
+        return m_base;
+    if (!isFresh(link, t))
+        return getConfig(0, m_base.txPower);
+    return getConfig(link.peerRate, link.txPower);
+}
+
+void LRTPRateControl::initLink(LRTPLinkState &link) {
+    link = LRTPLinkState();
+    link.txPower = m_base.txPower;
+}
+
+void LRTPRateControl::onFrameReceived(LRTPLinkState &link, int rssi, float snr, uint8_t spreadingFactor, unsigned long t) {
+    if (link.measured) {
+        // exponentially weighted moving average, weight 1/4
+        link.snr += (snr - link.snr) / 4;
+        link.rssi += (rssi - link.rssi) / 4;
+    } else {
+        link.snr = snr;
+        link.rssi = rssi;
+        link.measured = true;
+    }
+    link.lastReceived = t;
+    // a frame sent at our listen rate shows the peer has our report
+    if (spreadingFactor == getListenConfig().spreadingFactor)
+        link.reportUnheard = false;
+}
+
+void LRTPRateControl::onLoss(LRTPLinkState &link) {
+    if (++link.losses < LRTP_RATE_FALLBACK_LOSSES)
+        return;
+    // the peer may have missed our last report, or stopped hearing us
+    if (link.txPower != m_base.txPower)
+        lrtp_infof("Rate: full power after %u losses\n", link.losses);
+    link.txPower = m_base.txPower;
+    link.reportDue = true;
+}
+
+void LRTPRateControl::handleReport(LRTPLinkState &link, const LRTPPacket &packet) {
+    if (packet.payloadLength < LRTP_RATE_PAYLOAD_SZ)
+        return;
+    uint8_t rate = min(packet.payload[0], (uint8_t)(m_rateCount - 1));
+    bool rateChanged = rate != link.peerRate;
+    if (rateChanged) {
+        lrtp_infof("Rate: peer %u listens at rate %u\n", packet.src, rate);
+        // answer at the new rate, so that the peer hears from us before our
+        // lease runs out
+        link.reportDue = true;
+    }
+    link.peerRate = rate;
+    // a report repeated before the peer has heard from us again carries the
+    // SNR measured before our last power change, which must not be applied
+    // twice
+    float snr = (int8_t)packet.payload[1] / 4.0f;
+    bool remeasured = snr != link.reportedSnr;
+    link.reportedSnr = snr;
+    if (rateChanged || remeasured)
+        adjustTxPower(link);
+}
+
+size_t LRTPRateControl::prepareReport(LRTPLinkState &link, uint8_t *buf, unsigned long t) {
+    buf[0] = m_listenRate;
+    buf[1] = (int8_t)constrain(link.snr * 4, -128, 127);
+    link.reportDue = false;
+    link.lastReport = t;
+    return LRTP_RATE_PAYLOAD_SZ;
+}
+
+bool LRTPRateControl::update(LRTPConnectionTable &connections, bool baseOnly, unsigned long t) {
+    uint8_t rate = m_rateCount - 1;
+    bool open = false;
+    for (size_t i = 0; i < connections.capacity(); i++) {
+        LRTPConnection *connection = connections.at(i);
+        if (connection == nullptr || connection->getConnectionState() == LRTPConnState::CLOSED)
+            continue;
+        LRTPLinkState &link = connection->getLink();
+        bool fresh = isFresh(link, t);
+        if (link.fresh && !fresh && m_listenRate > 0) {
+            lrtp_infof("Rate: lost peer %u, holding the base rate\n", connection->getRemoteAddr());
+            link.holdUntil = t + LRTP_RATE_HOLDOFF_LEASES * m_lease;
+        }
+        link.fresh = fresh;
+        open = true;
+        rate = min(rate, linkRate(link, t));
+    }
+    if (!m_enabled || baseOnly || !open)
+        rate = 0;
+
+    bool changed = rate != m_listenRate;
+    if (changed)
+        lrtp_infof("Rate: listening at rate %u (SF%u)\n", rate, m_base.spreadingFactor - rate);
+    m_listenRate = rate;
+
+    for (size_t i = 0; m_enabled && i < connections.capacity(); i++) {
+        LRTPConnection *connection = connections.at(i);
+        if (connection == nullptr || connection->getConnectionState() != LRTPConnState::CONNECTED)
+            continue;
+        LRTPLinkState &link = connection->getLink();
+        // tell peers about a new listen rate until they are heard at it, and
+        // keep active peers updated with the SNR of their frames. A peer
+        // cannot be heard until it has the report, so its lease restarts
+        if (changed) {
+            link.reportUnheard = true;
+            if (link.fresh)
+                link.lastReceived = t;
+        }
+        bool active = link.measured && t - link.lastReceived < LRTP_RATE_REPORT_INTERVAL;
+        if (changed || link.reportUnheard || (active && t - link.lastReport >= LRTP_RATE_REPORT_INTERVAL))
+            link.reportDue = true;
+    }
+    return changed;
+}
+
+bool LRTPRateControl::isFresh(const LRTPLinkState &link, unsigned long t) {
+    return link.measured && t - link.lastReceived < m_lease;
+}
+
+float LRTPRateControl::requiredSnr(uint8_t rate) {
+    return lrtpRequiredSnr(m_base.spreadingFactor - rate) + LRTP_RATE_MARGIN;
+}
+
+uint8_t LRTPRateControl::linkRate(const LRTPLinkState &link, unsigned long t) {
+    if (!isFresh(link, t) || (long)(link.holdUntil - t) > 0)
+        return 0;
+    uint8_t rate = 0;
+    while (rate + 1 < m_rateCount) {
+        float required = requiredSnr(rate + 1);
+        if (rate + 1 > m_listenRate)
+            required += LRTP_RATE_HYSTERESIS;
+        if (link.snr < required)
+            break;
+        rate++;
+    }
+    return rate;
+}
+
+void LRTPRateControl::adjustTxPower(LRTPLinkState &link) {
+    // power is only lowered once the peer listens at the fastest rate
+    if (link.peerRate + 1 < m_rateCount) {
+        link.txPower = m_base.txPower;
+        return;
+    }
+    // aim between the SNR needed to stay at the rate and to move up to it
+    float excess = link.reportedSnr - (requiredSnr(link.peerRate) + LRTP_RATE_HYSTERESIS / 2.0f);
+    int power = link.txPower - (int)excess;
+    link.txPower = constrain(power, LRTP_RATE_MIN_TXPOWER, m_base.txPower);
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <Arduino.h>
+
+#include "LRTPConstants.hpp"
+#include "LRTPRadio.hpp"
+
+class LRTPConnectionTable;
+
+/**
+ * @brief Per peer link state kept by each connection for adaptive data rate
+ */
+struct LRTPLinkState {
+    // smoothed signal quality of the frames received from the peer
+    bool measured = false;
+    float snr = 0;
+    int16_t rssi = 0;
+    unsigned long lastReceived = 0;
+    // the peer was heard from within the lease at the last update
+    bool fresh = false;
+    // the link is kept at the base rate until then, after the peer went silent
+    unsigned long holdUntil = 0;
+    // rate the peer listens at, as reported by the peer
+    uint8_t peerRate = 0;
+    // transmit power used for frames sent to the peer (dBm)
+    int8_t txPower = 0;
+    // SNR the peer last measured on our frames
+    float reportedSnr = 0;
+    // consecutive frames not acknowledged by the peer, reset by the connection
+    uint8_t losses = 0;
+    // a rate report should be sent to the peer
+    bool reportDue = false;
+    unsigned long lastReport = 0;
+    // our listen rate changed and nothing has been heard from the peer since,
+    // so it may have missed the report
+    bool reportUnheard = false;
+};
+
+/**
+ * @brief Adaptive data rate and transmit power control.
+ *
+ * Each node listens at one rate, the fastest that every open connection can
+ * reach given the SNR of the frames received from its peer. Rates step the
+ * spreading factor down from the base configuration, so rate 0 is the base
+ * configuration every node starts (and multicasts) with. The bandwidth and
+ * coding rate are not adapted, they stay those of the base configuration. A
+ * node reports its listen rate, and the SNR it measures, to its peers in RATE
+ * frames. Frames to a peer are sent at the rate it listens at, and once the
+ * peer listens at the fastest rate, with the lowest transmit power that keeps
+ * the reported SNR above the margin.
+ *
+ * Falling back: only the receiving end of a link can change the rate frames
+ * are sent at. A node that stops hearing a peer for LRTP_RATE_LEASE_SLOTS
+ * frame airtimes counts the peer as needing the base rate: it returns to
+ * listening at the base rate and sends to that peer at the base rate, so a
+ * failing link recovers within two leases. The link is then kept at the base
+ * rate for LRTP_RATE_HOLDOFF_LEASES so that it does not flap. A sender that
+ * loses LRTP_RATE_FALLBACK_LOSSES frames in a row returns to full power and
+ * reports its listen rate again, in case the peer missed the last report.
+ * After a node changes its listen rate, it repeats its report every update
+ * until it hears a frame from the peer at the new rate (not one caught while
+ * tuned to send), which shows that the peer has the report. The lease of a
+ * peer heard before the change restarts with it, and a node answers a report
+ * of a new rate with its own, so the lease does not run out while the report
+ * is on its way. Any frame from the peer, aggregate ACKs included, renews its
+ * lease.
+ *
+ * New peers: a node opening a connection does not know the rate the other end
+ * listens at, so it sends its SYN at the base rate. A node accepting
+ * connections (LRTP::setAccepting()) therefore keeps listening at the base
+ * rate, and only nodes that have stopped accepting listen faster: adaptive
+ * rate does nothing for the frames a gateway receives while it accepts
+ * connections. Dropping back to the base rate for short windows instead would
+ * lose the frames existing peers send at the faster rate during each window.
+ */
+class LRTPRateControl {
+  public:
+    /**
+     * @brief Build the rate table from the base radio configuration
+     */
+    void begin(const LRTPRadioConfig &base);
+
+    void setEnabled(bool enabled);
+    bool isEnabled();
+
+    // number of rates in the table, rate 0 is the base configuration
+    uint8_t getRateCount();
+    uint8_t getListenRate();
+
+    // radio configuration of a rate
+    LRTPRadioConfig getConfig(uint8_t rate, int8_t txPower);
+    // configuration to receive with
+    LRTPRadioConfig getListenConfig();
+    // configuration to send to a peer with. A peer that has not been heard from
+    // within the lease has probably returned to the base rate
+    LRTPRadioConfig getTxConfig(const LRTPLinkState &link, unsigned long t);
+
+    // reset the link state of a new connection
+    void initLink(LRTPLinkState &link);
+
+    // record the signal quality of a frame received from the peer, at the
+    // given spreading factor
+    void onFrameReceived(LRTPLinkState &link, int rssi, float snr, uint8_t spreadingFactor, unsigned long t);
+    // a frame sent to the peer was not acknowledged
+    void onLoss(LRTPLinkState &link);
+
+    // handle a RATE frame received from the peer
+    void handleReport(LRTPLinkState &link, const LRTPPacket &packet);
+
+    /**
+     * @brief Fill in a RATE frame payload for the peer
+     *
+     * @param buf buffer of at least LRTP_RATE_PAYLOAD_SZ bytes
+     * @return size_t the payload length
+     */
+    size_t prepareReport(LRTPLinkState &link, uint8_t *buf, unsigned long t);
+
+    /**
+     * @brief Choose the listen rate from the links of all open connections and
+     * schedule rate reports
+     *
+     * @param connections the connection table
+     * @param baseOnly true if the node must listen at the base rate, for
+     * example to receive multicast frames or the SYNs of new peers
+     * @return true if the listen rate changed
+     */
+    bool update(LRTPConnectionTable &connections, bool baseOnly, unsigned long t);
+
+  private:
+    bool m_enabled = false;
+    LRTPRadioConfig m_base;
+    uint8_t m_rateCount = 1;
+    uint8_t m_listenRate = 0;
+    // time after which a silent peer counts as needing the base rate (ms)
+    unsigned long m_lease = 0;
+
+    // true if the peer has been heard from within the lease
+    bool isFresh(const LRTPLinkState &link, unsigned long t);
+    // SNR needed to use a rate, with margin
+    float requiredSnr(uint8_t rate);
+    // fastest rate a link supports. Moving up from current needs the hysteresis
+    uint8_t linkRate(const LRTPLinkState &link, unsigned long t);
+    void adjustTxPower(LRTPLinkState &link);
+};
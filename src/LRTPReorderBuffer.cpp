@@ -0,0 +1,54 @@
+#include "LRTPReorderBuffer.hpp"
+
+static_assert((LRTP_REORDER_FRAMES & (LRTP_REORDER_FRAMES - 1)) == 0, "LRTP_REORDER_FRAMES must be a power of two");
+static_assert(LRTP_REORDER_FRAMES >= LRTP_FEC_MAX_BLOCK - 1 + LRTP_TX_PACKET_BUFFER_SZ, "LRTP_REORDER_FRAMES is too small for the window");
+
+bool LRTPReorderBuffer::keep(const LRTPPacket &packet) {
+    Frame &frame = m_frames[packet.seqNum & (LRTP_REORDER_FRAMES - 1)];
+    if (frame.used && frame.seq == packet.seqNum)
+        return true;
+    if (packet.payloadLength > LRTP_MAX_PAYLOAD_SZ)
+        return false;
+    memcpy(frame.payload, packet.payload, sizeof(uint8_t) * packet.payloadLength);
+    frame.seq = packet.seqNum;
+    frame.flags = packet.flags;
+    frame.length = packet.payloadLength;
+    frame.used = true;
+    return true;
+}
+
+bool LRTPReorderBuffer::get(uint8_t seq, LRTPPacket &packet) {
+    Frame &frame = m_frames[seq & (LRTP_REORDER_FRAMES - 1)];
+    if (!frame.used || frame.seq != seq)
+        return false;
+    packet = {};
+    packet.version = LRTP_DEFAULT_VERSION;
+    packet.payloadType = LRTP_DEFAULT_TYPE;
+    // the frame's ACK is out of date, but a FIN still closes the connection
+    packet.flags.fin = frame.flags.fin;
+    packet.seqNum = frame.seq;
+    packet.payload = frame.payload;
+    packet.payloadLength = frame.length;
+    return true;
+}
+
+void LRTPReorderBuffer::release(uint8_t seq) {
+    Frame &frame = m_frames[seq & (LRTP_REORDER_FRAMES - 1)];
+    if (frame.used && frame.seq == seq)
+        frame.used = false;
+}
+
+void LRTPReorderBuffer::clear() {
+    for (Frame &frame : m_frames)
+        frame.used = false;
+}
+
+uint8_t LRTPReorderBuffer::getSackBitmap(uint8_t nextSeq) {
+    uint8_t bitmap = 0;
+    for (uint8_t i = 0; i < 8; i++) {
+        const Frame &frame = m_frames[(uint8_t)(nextSeq + 1 + i) & (LRTP_REORDER_FRAMES - 1)];
+        if (frame.used && frame.seq == (uint8_t)(nextSeq + 1 + i))
+            bitmap |= 1 << i;
+    }
+    return bitmap;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <Arduino.h>
+
+#include "LRTPConstants.hpp"
+
+/**
+ * @brief Copies of the data frames a connection receives around the next frame
+ * it expects, indexed by sequence number.
+ *
+ * Frames received ahead of a lost frame are kept until the lost frame is sent
+ * again (selective repeat) or rebuilt from parity (forward error correction),
+ * and are then delivered in order. Frames already delivered are kept for as
+ * long as they may be needed to rebuild a lost frame of the same parity block.
+ * The connection decides which frames to keep and releases them when they are
+ * no longer needed. Each slot holds a full payload, so keeping a frame never
+ * allocates.
+ */
+class LRTPReorderBuffer {
+  public:
+    /**
+     * @brief Keep a copy of a data frame, replacing the frame kept in its slot
+     *
+     * @return true if the frame is kept, false if its payload is longer than
+     * LRTP_MAX_PAYLOAD_SZ
+     */
+    bool keep(const LRTPPacket &packet);
+
+    /**
+     * @brief Get a kept frame
+     *
+     * @param packet set to the frame, its payload is valid until the frame is
+     * released or replaced
+     * @return true if the frame is kept
+     */
+    bool get(uint8_t seq, LRTPPacket &packet);
+
+    // forget the frame seq, if it is kept
+    void release(uint8_t seq);
+    void clear();
+
+    /**
+     * @brief Get the selective ACK bitmap of the frames kept after nextSeq
+     *
+     * @return uint8_t bit i is set if frame nextSeq + 1 + i is kept
+     */
+    uint8_t getSackBitmap(uint8_t nextSeq);
+
+  private:
+    struct Frame {
+        uint8_t seq;
+        LRTPFlags flags;
+        size_t length;
+        // false if the slot is unused
+        bool used;
+        uint8_t payload[LRTP_MAX_PAYLOAD_SZ];
+    };
+
+    Frame m_frames[LRTP_REORDER_FRAMES] = {};
+};
@@ -0,0 +1,243 @@
+#include "LRTPRouter.hpp"
+
+#include "LRTPDebug.h"
+
+LRTPRouter::LRTPRouter(uint16_t hostAddr, LRTPTimerWheel &timers) : m_hostAddr(hostAddr), m_timers(timers) {
+    m_beaconTimer.setCallback(std::bind(&LRTPRouter::onBeaconTimeout, this));
+}
+
+void LRTPRouter::setEnabled(bool enabled, unsigned long t) {
+    m_enabled = enabled;
+    if (enabled) {
+        // nodes enabled together should not beacon at the same time
+        m_timers.start(m_beaconTimer, random(1, LRTP_ROUTE_BEACON_INTERVAL / 4), t);
+    } else {
+        m_beaconTimer.cancel();
+        m_beaconPending = false;
+        m_queueCount = 0;
+    }
+}
+
+bool LRTPRouter::isEnabled() {
+    return m_enabled;
+}
+
+uint16_t LRTPRouter::nextHop(uint16_t dest, unsigned long t) {
+    if (!m_enabled)
+        return dest;
+    Route *route = findRoute(dest, t);
+    return route != nullptr ? route->nextHop : dest;
+}
+
+uint8_t LRTPRouter::hops(uint16_t dest, unsigned long t) {
+    Route *route = m_enabled ? findRoute(dest, t) : nullptr;
+    return route != nullptr ? route->hops : 1;
+}
+
+void LRTPRouter::onNeighborHeard(uint16_t addr, unsigned long t) {
+    learn(addr, addr, 1, t);
+}
+
+void LRTPRouter::handleBeacon(const LRTPPacket &packet, unsigned long t) {
+    for (size_t i = 0; i + LRTP_ROUTE_ENTRY_SZ <= packet.payloadLength; i += LRTP_ROUTE_ENTRY_SZ) {
+        const uint8_t *entry = packet.payload + i;
+        uint16_t dest = (entry[0] << 0x08) | entry[1];
+        learn(dest, packet.src, entry[2] + 1, t);
+    }
+}
+
+bool LRTPRouter::handleForward(const LRTPPacket &packet, const uint8_t *&frame, size_t &length, unsigned long t) {
+    if (packet.payloadLength < LRTP_FORWARD_HEADER_SZ + LRTP_HEADER_SZ)
+        return false;
+    uint8_t hops = packet.payload[0];
+    uint8_t id = packet.payload[1];
+    const uint8_t *inner = packet.payload + LRTP_FORWARD_HEADER_SZ;
+    size_t innerLength = packet.payloadLength - LRTP_FORWARD_HEADER_SZ;
+    // addresses of the original frame are big-endian in bytes 2-5
+    uint16_t origin = (inner[2] << 0x08) | inner[3];
+    uint16_t dest = (inner[4] << 0x08) | inner[5];
+
+    // the frame reached us from its origin through the previous hop
+    learn(origin, packet.src, hops + 1, t);
+    if (origin == m_hostAddr || checkSeen(origin, id)) {
+        m_stats.duplicates++;
+        return false;
+    }
+    if (dest == m_hostAddr) {
+        frame = inner;
+        length = innerLength;
+        return true;
+    }
+    // relaying adds a hop to the hops + 1 the frame has travelled
+    if (hops + 2 > LRTP_FORWARD_MAX_HOPS) {
+        m_stats.hopLimit++;
+        return false;
+    }
+    Route *route = findRoute(dest, t);
+    if (route == nullptr || route->nextHop == packet.src) {
+        lrtp_debugf("Route: no route from %u to %u\n", origin, dest);
+        m_stats.noRoute++;
+        return false;
+    }
+    if (m_queueCount == LRTP_FORWARD_QUEUE_SZ) {
+        m_stats.queueFull++;
+        return false;
+    }
+    QueuedFrame &queued = m_queue[(m_queueHead + m_queueCount) % LRTP_FORWARD_QUEUE_SZ];
+    queued.nextHop = route->nextHop;
+    queued.data[0] = hops + 1;
+    queued.data[1] = id;
+    memcpy(queued.data + LRTP_FORWARD_HEADER_SZ, inner, innerLength);
+    queued.length = packet.payloadLength;
+    m_queueCount++;
+    return false;
+}
+
+void LRTPRouter::prepareForward(uint8_t *buf) {
+    buf[0] = 0;
+    buf[1] = m_frameId++;
+    m_stats.originated++;
+}
+
+bool LRTPRouter::hasPending() {
+    return m_queueCount > 0 || m_beaconPending;
+}
+
+LRTPPriority LRTPRouter::getTxPriority() {
+    if (m_queueCount == 0)
+        return LRTPPriority::BULK;
+    // keep the class the origin would have sent the frame with
+    const QueuedFrame &queued = m_queue[m_queueHead];
+    return queued.length > LRTP_FORWARD_OVERHEAD ? LRTPPriority::DATA : LRTPPriority::CONTROL;
+}
+
+size_t LRTPRouter::getNextTxPayloadLength() {
+    if (m_queueCount > 0)
+        return m_queue[m_queueHead].length;
+    if (!m_beaconPending)
+        return 0;
+    // an upper bound, expired routes are left out of the beacon
+    size_t length = 0;
+    for (const Route &route : m_routes) {
+        if (route.hops != 0 && route.hops < LRTP_FORWARD_MAX_HOPS)
+            length += LRTP_ROUTE_ENTRY_SZ;
+    }
+    return length;
+}
+
+LRTPPacket *LRTPRouter::getNextTxPacket(unsigned long t) {
+    m_txPacket = {};
+    m_txPacket.version = LRTP_DEFAULT_VERSION;
+    m_txPacket.src = m_hostAddr;
+    if (m_queueCount > 0) {
+        // the slot stays intact until the next frame is queued
+        QueuedFrame &queued = m_queue[m_queueHead];
+        m_queueHead = (m_queueHead + 1) % LRTP_FORWARD_QUEUE_SZ;
+        m_queueCount--;
+        m_txPacket.payloadType = LRTP_TYPE_FORWARD;
+        m_txPacket.dest = queued.nextHop;
+        m_txPacket.payload = queued.data;
+        m_txPacket.payloadLength = queued.length;
+        m_stats.forwarded++;
+        return &m_txPacket;
+    }
+    if (m_beaconPending) {
+        m_beaconPending = false;
+        m_txPacket.payloadType = LRTP_TYPE_ROUTE_BEACON;
+        m_txPacket.dest = LRTP_BROADCAST_ADDR;
+        m_txPacket.payload = m_beaconPayload;
+        m_txPacket.payloadLength = prepareBeacon(t);
+        m_stats.beacons++;
+        return &m_txPacket;
+    }
+    return nullptr;
+}
+
+const LRTPRouteStats &LRTPRouter::getStats() {
+    return m_stats;
+}
+
+LRTPRouter::Route *LRTPRouter::findRoute(uint16_t dest, unsigned long t) {
+    for (Route &route : m_routes) {
+        if (route.hops != 0 && route.dest == dest && !isExpired(route, t))
+            return &route;
+    }
+    return nullptr;
+}
+
+void LRTPRouter::learn(uint16_t dest, uint16_t via, uint8_t hops, unsigned long t) {
+    if (dest == m_hostAddr || dest >= LRTP_MULTICAST_MIN)
+        return;
+    Route *route = findRoute(dest, t);
+    if (hops > LRTP_FORWARD_MAX_HOPS) {
+        // the next hop can no longer reach dest within the hop limit
+        if (route != nullptr && route->nextHop == via)
+            route->hops = 0;
+        return;
+    }
+    if (route != nullptr) {
+        // a route is updated by its next hop, or replaced by a shorter one
+        if (route->nextHop != via && hops >= route->hops)
+            return;
+        if (route->hops != hops)
+            triggerBeacon(t);
+    } else {
+        // take a free or expired entry, otherwise replace the longest route,
+        // the oldest of those
+        for (Route &candidate : m_routes) {
+            if (candidate.hops == 0 || isExpired(candidate, t)) {
+                route = &candidate;
+                break;
+            }
+            if (route == nullptr || candidate.hops > route->hops || (candidate.hops == route->hops && (long)(candidate.updated - route->updated) < 0))
+                route = &candidate;
+        }
+        lrtp_infof("Route: %u reachable through %u in %u hops\n", dest, via, hops);
+        triggerBeacon(t);
+    }
+    route->dest = dest;
+    route->nextHop = via;
+    route->hops = hops;
+    route->updated = t;
+}
+
+bool LRTPRouter::isExpired(const Route &route, unsigned long t) {
+    return t - route.updated > LRTP_ROUTE_TIMEOUT;
+}
+
+bool LRTPRouter::checkSeen(uint16_t origin, uint8_t id) {
+    for (size_t i = 0; i < m_seenCount; i++) {
+        if (m_seen[i].origin == origin && m_seen[i].id == id)
+            return true;
+    }
+    m_seen[m_seenNext] = { origin, id };
+    m_seenNext = (m_seenNext + 1) % LRTP_FORWARD_DEDUP_SZ;
+    if (m_seenCount < LRTP_FORWARD_DEDUP_SZ)
+        m_seenCount++;
+    return false;
+}
+
+void LRTPRouter::onBeaconTimeout() {
+    m_beaconPending = true;
+    m_timers.start(m_beaconTimer, random(LRTP_ROUTE_BEACON_INTERVAL * 3 / 4, LRTP_ROUTE_BEACON_INTERVAL * 5 / 4), millis());
+}
+
+void LRTPRouter::triggerBeacon(unsigned long t) {
+    if (m_enabled && m_beaconTimer.getExpiry() - t > LRTP_ROUTE_TRIGGER_DELAY)
+        m_timers.start(m_beaconTimer, random(1, LRTP_ROUTE_TRIGGER_DELAY), t);
+}
+
+size_t LRTPRouter::prepareBeacon(unsigned long t) {
+    size_t length = 0;
+    for (const Route &route : m_routes) {
+        // routes at the hop limit can't be extended by the receivers
+        if (route.hops == 0 || route.hops >= LRTP_FORWARD_MAX_HOPS || isExpired(route, t))
+            continue;
+        uint8_t *entry = m_beaconPayload + length;
+        entry[0] = route.dest >> 0x08;
+        entry[1] = route.dest & 0xff;
+        entry[2] = route.hops;
+        length += LRTP_ROUTE_ENTRY_SZ;
+    }
+    return length;
+}
@@ -0,0 +1,150 @@
+#pragma once
+#include <Arduino.h>
+
+#include "LRTPConstants.hpp"
+#include "LRTPTimerWheel.hpp"
+
+/**
+ * @brief Multi-hop forwarding towards nodes that are out of radio range.
+ *
+ * Each node keeps a small route table of (destination, next hop, hops)
+ * entries. A node hearing a frame addressed to it (or broadcast) learns a one
+ * hop route to the sender. Nodes periodically broadcast a route beacon listing
+ * the destinations they can reach, and neighbors learn routes one hop longer
+ * through them. A forwarded frame also teaches each relay the route back to
+ * its origin. A new or changed route brings the next beacon forward, so that
+ * routes spread quickly. Routes are refreshed by their next hop and expire after
+ * LRTP_ROUTE_TIMEOUT, and a route through a next hop that now advertises more
+ * than LRTP_FORWARD_MAX_HOPS is removed, so stale routes cannot count upwards
+ * forever.
+ *
+ * A frame to a destination reached through another node is sent to the next
+ * hop as the payload of a FORWARD frame, together with the hop count and a
+ * frame id given by the origin. Relays drop frames they have already seen
+ * (by origin and frame id) or which would exceed the hop limit, and queue the
+ * rest in a fixed queue of LRTP_FORWARD_QUEUE_SZ frames. Relays keep no state
+ * per forwarded flow: the end points' connections handle ordering, loss and
+ * retransmission.
+ *
+ * Forwarded frames and beacons are sent by LRTP between connection frames.
+ * Every node on a path must have forwarding enabled, see LRTP::setForwarding().
+ */
+class LRTPRouter {
+  public:
+    LRTPRouter(uint16_t hostAddr, LRTPTimerWheel &timers);
+
+    /**
+     * @brief Enable or disable forwarding. Enabling starts sending beacons,
+     * the first one after a random delay of up to a quarter interval
+     *
+     * @param t the current time (ms)
+     */
+    void setEnabled(bool enabled, unsigned long t);
+    bool isEnabled();
+
+    /**
+     * @brief The node to send a frame for dest to: the next hop of a known
+     * route, or dest itself when it is a neighbor or no route is known
+     */
+    uint16_t nextHop(uint16_t dest, unsigned long t);
+
+    // the length of the route to dest in hops, 1 if no route is known
+    uint8_t hops(uint16_t dest, unsigned long t);
+
+    // learn a one hop route to a node whose frame was heard directly
+    void onNeighborHeard(uint16_t addr, unsigned long t);
+
+    // learn the routes advertised in a route beacon
+    void handleBeacon(const LRTPPacket &packet, unsigned long t);
+
+    /**
+     * @brief Handle a FORWARD frame addressed to this node. Frames for other
+     * nodes are queued to be relayed
+     *
+     * @param frame set to the original frame if it is addressed to this node
+     * @param length set to the length of the original frame
+     * @return true if the original frame is addressed to this node and should
+     * be processed
+     */
+    bool handleForward(const LRTPPacket &packet, const uint8_t *&frame, size_t &length, unsigned long t);
+
+    /**
+     * @brief Write the forwarding header for a frame this node originates
+     *
+     * @param buf the 2 bytes before the original frame
+     */
+    void prepareForward(uint8_t *buf);
+
+    // returns true if a forwarded frame or a beacon is waiting to be sent
+    bool hasPending();
+    LRTPPriority getTxPriority();
+    size_t getNextTxPayloadLength();
+
+    /**
+     * @brief Get the next forwarded frame or beacon and remove it from the
+     * queue
+     *
+     * @return LRTPPacket* the frame, valid until the next call or until
+     * another frame is queued, or nullptr
+     */
+    LRTPPacket *getNextTxPacket(unsigned long t);
+
+    const LRTPRouteStats &getStats();
+
+  private:
+    struct Route {
+        uint16_t dest;
+        uint16_t nextHop;
+        uint8_t hops;
+        unsigned long updated;
+    };
+
+    struct QueuedFrame {
+        uint16_t nextHop;
+        uint8_t data[LRTP_MAX_PAYLOAD_SZ];
+        size_t length;
+    };
+
+    struct SeenFrame {
+        uint16_t origin;
+        uint8_t id;
+    };
+
+    uint16_t m_hostAddr;
+    LRTPTimerWheel &m_timers;
+    bool m_enabled = false;
+
+    // a route with hops == 0 is unused
+    Route m_routes[LRTP_ROUTE_TABLE_SZ] = {};
+
+    QueuedFrame m_queue[LRTP_FORWARD_QUEUE_SZ];
+    size_t m_queueHead = 0;
+    size_t m_queueCount = 0;
+
+    // ring of the frames seen last
+    SeenFrame m_seen[LRTP_FORWARD_DEDUP_SZ];
+    size_t m_seenNext = 0;
+    size_t m_seenCount = 0;
+
+    // id of the next frame this node originates
+    uint8_t m_frameId = 0;
+
+    LRTPTimer m_beaconTimer;
+    bool m_beaconPending = false;
+
+    LRTPRouteStats m_stats = {};
+
+    // the frame returned by getNextTxPacket()
+    LRTPPacket m_txPacket;
+    uint8_t m_beaconPayload[LRTP_ROUTE_TABLE_SZ * LRTP_ROUTE_ENTRY_SZ];
+
+    Route *findRoute(uint16_t dest, unsigned long t);
+    void learn(uint16_t dest, uint16_t via, uint8_t hops, unsigned long t);
+    bool isExpired(const Route &route, unsigned long t);
+    // returns true if the frame was seen before, and remembers it otherwise
+    bool checkSeen(uint16_t origin, uint8_t id);
+    void onBeaconTimeout();
+    // send a beacon soon to announce a new or changed route
+    void triggerBeacon(unsigned long t);
+    size_t prepareBeacon(unsigned long t);
+};
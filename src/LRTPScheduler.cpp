@@ -0,0 +1,129 @@
+#include "LRTPScheduler.hpp"
+
+LRTPScheduler::LRTPScheduler(LRTPRadio &radio) : m_radio(radio) {
+}
+
+void LRTPScheduler::reserve(size_t connections) {
+    m_flows.reserve(connections);
+}
+
+void LRTPScheduler::addFlow(LRTPConnection *connection) {
+    m_flows.push_back({ connection, 0, true });
+}
+
+void LRTPScheduler::removeFlow(const LRTPConnection *connection) {
+    for (size_t i = 0; i < m_flows.size(); i++) {
+        if (m_flows[i].connection == connection) {
+            m_flows.erase(m_flows.begin() + i);
+            // keep the cursors pointing at the same flows
+            for (size_t c = 0; c < LRTP_PRIORITY_COUNT; c++) {
+                if (m_cursor[c] > i)
+                    m_cursor[c]--;
+                if (m_cursor[c] >= m_flows.size())
+                    m_cursor[c] = 0;
+            }
+            return;
+        }
+    }
+}
+
+LRTPConnection *LRTPScheduler::select() {
+    int c = selectClass();
+    if (c < 0)
+        return nullptr;
+    Flow *flow = selectFlow((LRTPPriority)c);
+    if (flow == nullptr)
+        return nullptr;
+    m_selectedCost = cost(*flow);
+    return flow->connection;
+}
+
+bool LRTPScheduler::hasReady() {
+    for (Flow &flow : m_flows) {
+        if (flow.connection->isReadyForTransmit())
+            return true;
+    }
+    return false;
+}
+
+unsigned long LRTPScheduler::getSelectedCost() {
+    return m_selectedCost;
+}
+
+void LRTPScheduler::onTransmit(const LRTPConnection *connection, unsigned long airtime) {
+    for (Flow &flow : m_flows) {
+        if (flow.connection == connection) {
+            flow.deficit -= airtime;
+            return;
+        }
+    }
+}
+
+long LRTPScheduler::quantum(const Flow &flow) {
+    return (long)m_radio.airtime(LRTP_MAX_PACKET) * flow.connection->getWeight();
+}
+
+unsigned long LRTPScheduler::cost(const Flow &flow) {
+    return m_radio.airtime(LRTP_HEADER_SZ + flow.connection->getNextTxPayloadLength());
+}
+
+bool LRTPScheduler::isReady(const Flow &flow, LRTPPriority priority) {
+    return flow.connection->isReadyForTransmit() && flow.connection->getTxPriority() == priority;
+}
+
+int LRTPScheduler::selectClass() {
+    bool ready[LRTP_PRIORITY_COUNT] = {};
+    for (Flow &flow : m_flows) {
+        if (flow.connection->isReadyForTransmit())
+            ready[(size_t)flow.connection->getTxPriority()] = true;
+    }
+    int chosen = -1;
+    for (int c = 0; c < LRTP_PRIORITY_COUNT; c++) {
+        if (!ready[c])
+            continue;
+        if (chosen < 0) {
+            chosen = c;
+        } else if (m_starvation[c] >= LRTP_SCHED_STARVATION_LIMIT) {
+            // a lower class has waited long enough
+            chosen = c;
+            break;
+        }
+    }
+    // count the classes that were passed over
+    for (int c = 0; c < LRTP_PRIORITY_COUNT; c++) {
+        if (c == chosen)
+            m_starvation[c] = 0;
+        else if (ready[c])
+            m_starvation[c]++;
+    }
+    return chosen;
+}
+
+LRTPScheduler::Flow *LRTPScheduler::selectFlow(LRTPPriority priority) {
+    size_t &cursor = m_cursor[(size_t)priority];
+    const size_t count = m_flows.size();
+    // a ready flow is always served on its first fresh visit (its quantum
+    // covers a full frame), so two passes are enough
+    for (size_t visited = 0; visited <= 2 * count && count > 0; visited++) {
+        if (cursor >= count)
+            cursor = 0;
+        Flow &flow = m_flows[cursor];
+        if (!isReady(flow, priority)) {
+            // idle flows don't accumulate credit
+            flow.deficit = 0;
+            flow.fresh = true;
+            cursor++;
+            continue;
+        }
+        if (flow.fresh) {
+            flow.deficit += quantum(flow);
+            flow.fresh = false;
+        }
+        if (flow.deficit >= (long)cost(flow))
+            return &flow;
+        // the flow has used its share for this round
+        flow.fresh = true;
+        cursor++;
+    }
+    return nullptr;
+}
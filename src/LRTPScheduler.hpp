@@ -0,0 +1,77 @@
+#pragma once
+#include <Arduino.h>
+#include <vector>
+
+#include "LRTPConnection.hpp"
+#include "LRTPConstants.hpp"
+#include "LRTPRadio.hpp"
+
+/**
+ * @brief Transmit scheduler deciding which connection sends the next frame.
+ *
+ * Connections are grouped by the priority of their next frame
+ * (LRTPConnection::getTxPriority()). Classes are served in strict priority
+ * order, except that a lower class with frames waiting is served after it has
+ * been passed over LRTP_SCHED_STARVATION_LIMIT times.
+ *
+ * Within a class, connections share the channel by deficit round robin over
+ * airtime: each visit credits a connection with a quantum of the airtime of
+ * a full frame times its weight, and a frame is sent once its airtime is
+ * covered by the connection's deficit. Connections therefore get airtime in
+ * proportion to their weights regardless of their frame sizes.
+ */
+class LRTPScheduler {
+  public:
+    LRTPScheduler(LRTPRadio &radio);
+
+    // preallocate room for the given number of connections
+    void reserve(size_t connections);
+
+    void addFlow(LRTPConnection *connection);
+    void removeFlow(const LRTPConnection *connection);
+
+    /**
+     * @brief Select the connection that should send the next frame. The same
+     * connection is returned until onTransmit() is called for it, so a frame
+     * deferred by channel access keeps its turn
+     *
+     * @return LRTPConnection* the connection, or nullptr if no connection has
+     * a frame ready
+     */
+    LRTPConnection *select();
+
+    // returns true if any connection has a frame ready, without changing the
+    // scheduling state
+    bool hasReady();
+
+    // airtime (us) of the frame the selected connection will send
+    unsigned long getSelectedCost();
+
+    // charge a transmitted frame to its connection
+    void onTransmit(const LRTPConnection *connection, unsigned long airtime);
+
+  private:
+    struct Flow {
+        LRTPConnection *connection;
+        // airtime credit (us)
+        long deficit;
+        // true until the quantum for the current visit has been credited
+        bool fresh;
+    };
+
+    LRTPRadio &m_radio;
+
+    std::vector<Flow> m_flows;
+    // round robin position of each priority class
+    size_t m_cursor[LRTP_PRIORITY_COUNT] = {};
+    // number of times each class has been passed over while it had frames
+    unsigned int m_starvation[LRTP_PRIORITY_COUNT] = {};
+
+    unsigned long m_selectedCost = 0;
+
+    long quantum(const Flow &flow);
+    unsigned long cost(const Flow &flow);
+    bool isReady(const Flow &flow, LRTPPriority priority);
+    int selectClass();
+    Flow *selectFlow(LRTPPriority priority);
+};
@@ -0,0 +1,76 @@
+#include "LRTPTaskRunner.hpp"
+
+#if defined(ESP32)
+
+LRTPTaskRunner::LRTPTaskRunner(LRTP &lrtp) : m_lrtp(lrtp) {
+}
+
+LRTPTaskRunner::~LRTPTaskRunner() {
+    end();
+}
+
+bool LRTPTaskRunner::begin(uint32_t stackSize, UBaseType_t priority, BaseType_t core) {
+    if (m_task != nullptr)
+        return false;
+    m_lrtp.onWake(std::bind(&LRTPTaskRunner::wake, this));
+    if (xTaskCreatePinnedToCore(&LRTPTaskRunner::taskMain, "lrtp", stackSize, this, priority, &m_task, core) != pdPASS) {
+        m_task = nullptr;
+        m_lrtp.onWake(nullptr);
+        return false;
+    }
+    return true;
+}
+
+void LRTPTaskRunner::end() {
+    if (m_task == nullptr)
+        return;
+    m_lrtp.onWake(nullptr);
+    // hold the lock so that the task is not deleted part way through loop()
+    m_lrtp.lock();
+    vTaskDelete(m_task);
+    m_task = nullptr;
+    m_lrtp.unlock();
+}
+
+TaskHandle_t LRTPTaskRunner::getTaskHandle() {
+    return m_task;
+}
+
+void LRTPTaskRunner::wake() {
+    TaskHandle_t task = m_task;
+    if (task == nullptr)
+        return;
+    // radio callbacks run in the DIO0 interrupt
+    if (xPortInIsrContext()) {
+        BaseType_t higherPriorityTaskWoken = pdFALSE;
+        vTaskNotifyGiveFromISR(task, &higherPriorityTaskWoken);
+        if (higherPriorityTaskWoken)
+            portYIELD_FROM_ISR();
+    } else {
+        xTaskNotifyGive(task);
+    }
+}
+
+void LRTPTaskRunner::run() {
+    bool polledRadio = m_lrtp.getRadio().getEventFd() >= 0;
+    for (;;) {
+        m_lrtp.loop();
+
+        unsigned long deadline = m_lrtp.nextDeadline();
+        if (polledRadio)
+            deadline = min(deadline, (unsigned long)LRTP_TASK_POLL_INTERVAL);
+        if (deadline == 0)
+            continue;
+        // round up to whole ticks so the task never wakes early
+        TickType_t ticks = portMAX_DELAY;
+        if (deadline != LRTP_NO_DEADLINE)
+            ticks = (deadline + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+        ulTaskNotifyTake(pdTRUE, ticks);
+    }
+}
+
+void LRTPTaskRunner::taskMain(void *arg) {
+    static_cast<LRTPTaskRunner *>(arg)->run();
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+#include <Arduino.h>
+
+#include "LRTP.h"
+
+#if defined(ESP32)
+
+/**
+ * @brief Runs an LRTP instance in its own FreeRTOS task.
+ *
+ * The task calls LRTP::loop() and then blocks on a task notification until
+ * LRTP::nextDeadline(). Radio interrupts and writes to connections notify the
+ * task through LRTP::onWake(), so it only runs when there is work to do.
+ * Radios that have to be polled (LRTPUdpRadio) are checked at least every
+ * LRTP_TASK_POLL_INTERVAL ms.
+ *
+ * Other tasks may read, write and open connections while it runs, as those
+ * calls take the node's lock (see LRTP::lock()); take the lock to use the rest
+ * of the API from another task. Once started, loop() must not be called from
+ * anywhere else.
+ */
+class LRTPTaskRunner {
+  public:
+    LRTPTaskRunner(LRTP &lrtp);
+    ~LRTPTaskRunner();
+
+    /**
+     * @brief Start the task. LRTP::begin() must have been called
+     *
+     * @return true if the task was created
+     */
+    bool begin(uint32_t stackSize = LRTP_TASK_STACK_SZ, UBaseType_t priority = LRTP_TASK_PRIORITY, BaseType_t core = LRTP_TASK_CORE);
+
+    // stop and delete the task
+    void end();
+
+    TaskHandle_t getTaskHandle();
+
+  private:
+    LRTP &m_lrtp;
+    TaskHandle_t m_task = nullptr;
+
+    void wake();
+    void run();
+    static void taskMain(void *arg);
+};
+
+#endif
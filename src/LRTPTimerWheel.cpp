@@ -0,0 +1,140 @@
+#include "LRTPTimerWheel.hpp"
+
+// signed difference between two timestamps, safe across wraparound
+static inline long timeDiff(unsigned long a, unsigned long b) {
+    return (long)(a - b);
+}
+
+LRTPTimer::LRTPTimer(std::function<void(void)> callback) : m_callback(callback) {
+}
+
+LRTPTimer::~LRTPTimer() {
+    cancel();
+}
+
+void LRTPTimer::setCallback(std::function<void(void)> callback) {
+    m_callback = callback;
+}
+
+void LRTPTimer::cancel() {
+    if (m_wheel != nullptr)
+        m_wheel->cancel(*this);
+}
+
+bool LRTPTimer::isActive() const {
+    return m_wheel != nullptr;
+}
+
+unsigned long LRTPTimer::getExpiry() const {
+    return m_expiry;
+}
+
+LRTPTimerWheel::LRTPTimerWheel() {
+}
+
+LRTPTimerWheel::~LRTPTimerWheel() {
+    // detach any timers that outlive the wheel
+    for (LRTPTimer *&slot : m_slots) {
+        while (slot != nullptr)
+            cancel(*slot);
+    }
+}
+
+void LRTPTimerWheel::start(LRTPTimer &timer, unsigned long timeout, unsigned long t) {
+    if (timer.m_wheel != nullptr)
+        timer.m_wheel->cancel(timer);
+    // an empty wheel has nothing to catch up on
+    if (m_count == 0)
+        m_tick = tickOf(t);
+    timer.m_expiry = t + timeout;
+    timer.m_wheel = this;
+    link(&m_slots[tickOf(timer.m_expiry) & (LRTP_TIMER_WHEEL_SLOTS - 1)], timer);
+    m_count++;
+}
+
+void LRTPTimerWheel::cancel(LRTPTimer &timer) {
+    if (timer.m_wheel != this)
+        return;
+    unlink(timer);
+    timer.m_wheel = nullptr;
+    m_count--;
+}
+
+void LRTPTimerWheel::advance(unsigned long t) {
+    unsigned long now = tickOf(t);
+    if (m_count == 0) {
+        m_tick = now;
+        return;
+    }
+    // move expired timers onto a private list first, so that callbacks can
+    // start and cancel timers (including the ones still to be fired) safely
+    LRTPTimer *expired = nullptr;
+    // visit every slot since the last call, at most one revolution. The
+    // current slot is visited again next time as it may hold later timers
+    unsigned long ticks = min(now - m_tick, (unsigned long)LRTP_TIMER_WHEEL_SLOTS - 1);
+    for (unsigned long i = 0; i <= ticks; i++) {
+        LRTPTimer *timer = m_slots[(m_tick + i) & (LRTP_TIMER_WHEEL_SLOTS - 1)];
+        while (timer != nullptr) {
+            LRTPTimer *next = timer->m_next;
+            if (timeDiff(t, timer->m_expiry) >= 0) {
+                unlink(*timer);
+                link(&expired, *timer);
+            }
+            timer = next;
+        }
+    }
+    m_tick = now;
+
+    while (expired != nullptr) {
+        LRTPTimer &timer = *expired;
+        cancel(timer);
+        if (timer.m_callback != nullptr)
+            timer.m_callback();
+    }
+}
+
+unsigned long LRTPTimerWheel::nextDeadline(unsigned long t) {
+    if (m_count == 0)
+        return LRTP_NO_DEADLINE;
+    // the first slot holding a timer that expires within this revolution has
+    // the earliest timer, unless every timer is further away
+    unsigned long deadline = LRTP_NO_DEADLINE;
+    for (unsigned long i = 0; i < LRTP_TIMER_WHEEL_SLOTS; i++) {
+        for (LRTPTimer *timer = m_slots[(m_tick + i) & (LRTP_TIMER_WHEEL_SLOTS - 1)]; timer != nullptr; timer = timer->m_next) {
+            long remaining = timeDiff(timer->m_expiry, t);
+            deadline = min(deadline, remaining > 0 ? (unsigned long)remaining : 0UL);
+        }
+        if (deadline < (i + 1) * LRTP_TIMER_TICK)
+            break;
+    }
+    return deadline;
+}
+
+size_t LRTPTimerWheel::count() {
+    return m_count;
+}
+
+unsigned long LRTPTimerWheel::tickOf(unsigned long t) {
+    return t / LRTP_TIMER_TICK;
+}
+
+void LRTPTimerWheel::link(LRTPTimer **list, LRTPTimer &timer) {
+    timer.m_list = list;
+    timer.m_prev = nullptr;
+    timer.m_next = *list;
+    if (*list != nullptr)
+        (*list)->m_prev = &timer;
+    *list = &timer;
+}
+
+void LRTPTimerWheel::unlink(LRTPTimer &timer) {
+    if (timer.m_prev != nullptr)
+        timer.m_prev->m_next = timer.m_next;
+    else
+        *timer.m_list = timer.m_next;
+    if (timer.m_next != nullptr)
+        timer.m_next->m_prev = timer.m_prev;
+    timer.m_list = nullptr;
+    timer.m_prev = nullptr;
+    timer.m_next = nullptr;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+
+#include "LRTPConstants.hpp"
+
+class LRTPTimerWheel;
+
+/**
+ * @brief A one-shot timer that can be started on an LRTPTimerWheel.
+ *
+ * Timers are intrusive: the links used by the wheel live in the timer itself,
+ * so starting and cancelling never allocate. A timer cancels itself when it is
+ * destroyed.
+ */
+class LRTPTimer {
+  public:
+    LRTPTimer(std::function<void(void)> callback = nullptr);
+    ~LRTPTimer();
+
+    void setCallback(std::function<void(void)> callback);
+
+    // stop the timer if it is running
+    void cancel();
+
+    bool isActive() const;
+
+    // the time (ms) at which the timer fires, only valid while it is active
+    unsigned long getExpiry() const;
+
+  private:
+    friend class LRTPTimerWheel;
+
+    std::function<void(void)> m_callback;
+
+    LRTPTimerWheel *m_wheel = nullptr;
+    // the list the timer is linked into (a wheel slot), or null
+    LRTPTimer **m_list = nullptr;
+    LRTPTimer *m_prev = nullptr;
+    LRTPTimer *m_next = nullptr;
+    unsigned long m_expiry = 0;
+};
+
+/**
+ * @brief Hashed timing wheel shared by all connection timers of an LRTP
+ * instance.
+ *
+ * Time is divided into ticks of LRTP_TIMER_TICK ms, and a timer is linked into
+ * the slot of the tick in which it expires (modulo LRTP_TIMER_WHEEL_SLOTS).
+ * Timers further away than one revolution share slots with nearer ones and are
+ * skipped until their expiry. Starting and cancelling a timer are O(1), and
+ * advancing the wheel only visits the slots of the ticks that have passed, so
+ * the cost does not grow with the number of idle connections.
+ */
+class LRTPTimerWheel {
+    static_assert((LRTP_TIMER_WHEEL_SLOTS & (LRTP_TIMER_WHEEL_SLOTS - 1)) == 0, "LRTP_TIMER_WHEEL_SLOTS must be a power of two");
+    static_assert((LRTP_TIMER_TICK & (LRTP_TIMER_TICK - 1)) == 0, "LRTP_TIMER_TICK must be a power of two");
+
+  public:
+    LRTPTimerWheel();
+    ~LRTPTimerWheel();
+
+    /**
+     * @brief Start a timer, restarting it if it is already running
+     *
+     * @param timer the timer
+     * @param timeout the time until the timer fires (ms)
+     * @param t the current time (ms)
+     */
+    void start(LRTPTimer &timer, unsigned long timeout, unsigned long t);
+
+    void cancel(LRTPTimer &timer);
+
+    /**
+     * @brief Fire every timer that has expired at time t. Timers may be
+     * started or cancelled from their callbacks
+     */
+    void advance(unsigned long t);
+
+    /**
+     * @brief Time until the next timer fires
+     *
+     * @return unsigned long the time in ms, or LRTP_NO_DEADLINE if no timer is
+     * running
+     */
+    unsigned long nextDeadline(unsigned long t);
+
+    // the number of running timers
+    size_t count();
+
+  private:
+    LRTPTimer *m_slots[LRTP_TIMER_WHEEL_SLOTS] = {};
+    // the last tick that was processed by advance()
+    unsigned long m_tick = 0;
+    size_t m_count = 0;
+
+    static unsigned long tickOf(unsigned long t);
+    static void link(LRTPTimer **list, LRTPTimer &timer);
+    static void unlink(LRTPTimer &timer);
+};
@@ -0,0 +1,326 @@
+#include "LRTPUdpRadio.hpp"
+
+#if LRTP_RADIO_UDP
+
+#if defined(ESP32)
+#include <lwip/sockets.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "LRTPDebug.h"
+
+#include <math.h>
+
+// datagram header: magic (2), frequency (4), spreading factor (1), bandwidth
+// (4), airtime in microseconds (4), transmit power in dBm (1), sender's path
+// loss in dB (1)
+#define LRTP_UDP_MAGIC_0 'L'
+#define LRTP_UDP_MAGIC_1 'E'
+#define LRTP_UDP_HEADER_SZ 17
+// receiver noise figure in dB
+#define LRTP_UDP_NOISE_FIGURE 6
+
+static void writeU32(uint8_t *buf, uint32_t val) {
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+static uint32_t readU32(const uint8_t *buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+// signed difference between two timestamps, safe across wraparound
+static inline long timeDiff(unsigned long a, unsigned long b) {
+    return (long)(a - b);
+}
+
+// time remaining until a timestamp, or 0 if it has passed
+static inline unsigned long timeUntil(unsigned long end, unsigned long t) {
+    return timeDiff(end, t) > 0 ? end - t : 0;
+}
+
+LRTPUdpRadio::LRTPUdpRadio(const LRTPRadioConfig &config, const char *groupAddr, uint16_t port, const char *ifaceAddr)
+    : m_groupAddr(groupAddr), m_port(port), m_ifaceAddr(ifaceAddr) {
+    m_config = config;
+}
+
+LRTPUdpRadio::~LRTPUdpRadio() {
+    end();
+}
+
+int LRTPUdpRadio::begin() {
+    // receive socket: joins the multicast group on the configured interface
+    m_rxSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m_rxSocket < 0) {
+        lrtp_debug("UDP radio: could not create receive socket");
+        return 0;
+    }
+    int one = 1;
+    setsockopt(m_rxSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+    setsockopt(m_rxSocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif
+    struct sockaddr_in bindAddr;
+    memset(&bindAddr, 0, sizeof(bindAddr));
+    bindAddr.sin_family = AF_INET;
+    bindAddr.sin_port = htons(m_port);
+    bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(m_rxSocket, (struct sockaddr *)&bindAddr, sizeof(bindAddr)) < 0) {
+        lrtp_debug("UDP radio: could not bind receive socket");
+        end();
+        return 0;
+    }
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(m_groupAddr);
+    mreq.imr_interface.s_addr = inet_addr(m_ifaceAddr);
+    if (setsockopt(m_rxSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        lrtp_debug("UDP radio: could not join multicast group");
+        end();
+        return 0;
+    }
+    fcntl(m_rxSocket, F_SETFL, fcntl(m_rxSocket, F_GETFL, 0) | O_NONBLOCK);
+
+    // transmit socket: sends to the group with loopback enabled so that other
+    // processes on this host receive our frames
+    m_txSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m_txSocket < 0) {
+        lrtp_debug("UDP radio: could not create transmit socket");
+        end();
+        return 0;
+    }
+    struct in_addr iface;
+    iface.s_addr = inet_addr(m_ifaceAddr);
+    setsockopt(m_txSocket, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface));
+    uint8_t loop = 1;
+    setsockopt(m_txSocket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    // bind to an ephemeral port so that our own datagrams can be recognised
+    struct sockaddr_in txAddr;
+    memset(&txAddr, 0, sizeof(txAddr));
+    txAddr.sin_family = AF_INET;
+    txAddr.sin_port = 0;
+    txAddr.sin_addr.s_addr = inet_addr(m_ifaceAddr);
+    socklen_t txAddrLen = sizeof(txAddr);
+    if (bind(m_txSocket, (struct sockaddr *)&txAddr, sizeof(txAddr)) < 0 || getsockname(m_txSocket, (struct sockaddr *)&txAddr, &txAddrLen) < 0) {
+        lrtp_debug("UDP radio: could not bind transmit socket");
+        end();
+        return 0;
+    }
+    m_txPort = ntohs(txAddr.sin_port);
+
+    m_mode = Mode::IDLE;
+    return 1;
+}
+
+void LRTPUdpRadio::end() {
+    if (m_rxSocket >= 0)
+        close(m_rxSocket);
+    if (m_txSocket >= 0)
+        close(m_txSocket);
+    m_rxSocket = -1;
+    m_txSocket = -1;
+}
+
+void LRTPUdpRadio::receive() {
+    m_mode = Mode::RECEIVE;
+}
+
+void LRTPUdpRadio::channelActivityDetection() {
+    unsigned long t = micros();
+    m_mode = Mode::CAD;
+    m_cadEnd = t + cadDuration();
+    m_cadBusy = channelBusy(t);
+}
+
+bool LRTPUdpRadio::rxSignalDetected() {
+    return m_mode == Mode::RECEIVE && m_airPending && !m_airCorrupt;
+}
+
+int LRTPUdpRadio::beginPacket() {
+    if (m_mode == Mode::TRANSMIT)
+        return 0;
+    m_txLength = 0;
+    return 1;
+}
+
+size_t LRTPUdpRadio::write(const uint8_t *buf, size_t size) {
+    size_t n = min(size, (size_t)LRTP_MAX_PACKET - m_txLength);
+    memcpy(m_txBuffer + m_txLength, buf, n);
+    m_txLength += n;
+    return n;
+}
+
+int LRTPUdpRadio::endPacket(bool async) {
+    unsigned long duration = airtime(m_txLength);
+
+    uint8_t datagram[LRTP_UDP_HEADER_SZ + LRTP_MAX_PACKET];
+    datagram[0] = LRTP_UDP_MAGIC_0;
+    datagram[1] = LRTP_UDP_MAGIC_1;
+    writeU32(datagram + 2, m_config.frequency);
+    datagram[6] = m_config.spreadingFactor;
+    writeU32(datagram + 7, m_config.signalBandwidth);
+    writeU32(datagram + 11, duration);
+    datagram[15] = m_config.txPower;
+    datagram[16] = m_pathLoss;
+    memcpy(datagram + LRTP_UDP_HEADER_SZ, m_txBuffer, m_txLength);
+
+    struct sockaddr_in groupAddr;
+    memset(&groupAddr, 0, sizeof(groupAddr));
+    groupAddr.sin_family = AF_INET;
+    groupAddr.sin_port = htons(m_port);
+    groupAddr.sin_addr.s_addr = inet_addr(m_groupAddr);
+    if (sendto(m_txSocket, datagram, LRTP_UDP_HEADER_SZ + m_txLength, 0, (struct sockaddr *)&groupAddr, sizeof(groupAddr)) < 0) {
+        lrtp_debug("UDP radio: sendto failed");
+        return 0;
+    }
+    // the radio is deaf to anything else while the frame is on air
+    m_mode = Mode::TRANSMIT;
+    m_airPending = false;
+    m_txEnd = micros() + duration;
+
+    if (!async) {
+        while (timeDiff(micros(), m_txEnd) < 0) {
+        }
+        m_mode = Mode::IDLE;
+    }
+    return 1;
+}
+
+int LRTPUdpRadio::available() {
+    return m_rxLength - m_rxPos;
+}
+
+int LRTPUdpRadio::read() {
+    if (m_rxPos >= m_rxLength)
+        return -1;
+    return m_rxBuffer[m_rxPos++];
+}
+
+size_t LRTPUdpRadio::readBytes(uint8_t *buf, size_t len) {
+    len = min(len, m_rxLength - m_rxPos);
+    memcpy(buf, m_rxBuffer + m_rxPos, len);
+    m_rxPos += len;
+    return len;
+}
+
+void LRTPUdpRadio::poll() {
+    if (m_rxSocket < 0)
+        return;
+
+    // drain all datagrams received since the last poll
+    uint8_t datagram[LRTP_UDP_HEADER_SZ + LRTP_MAX_PACKET];
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    ssize_t n;
+    while ((n = recvfrom(m_rxSocket, datagram, sizeof(datagram), 0, (struct sockaddr *)&from, &fromLen)) > 0) {
+        // ignore our own transmissions
+        if (ntohs(from.sin_port) != m_txPort || from.sin_addr.s_addr != inet_addr(m_ifaceAddr))
+            handleDatagram(datagram, n, micros());
+        fromLen = sizeof(from);
+    }
+
+    unsigned long t = micros();
+    if (m_mode == Mode::TRANSMIT && timeDiff(t, m_txEnd) >= 0) {
+        m_mode = Mode::IDLE;
+        if (m_onTxDone != nullptr)
+            m_onTxDone();
+    }
+    if (m_mode == Mode::CAD && timeDiff(t, m_cadEnd) >= 0) {
+        m_mode = Mode::IDLE;
+        if (m_onCadDone != nullptr)
+            m_onCadDone(m_cadBusy);
+    }
+    if (m_airPending && timeDiff(t, m_airEnd) >= 0) {
+        // the frame has finished; deliver it if it survived
+        m_airPending = false;
+        if (!m_airCorrupt && m_mode == Mode::RECEIVE) {
+            memcpy(m_rxBuffer, m_airBuffer, m_airLength);
+            m_rxLength = m_airLength;
+            m_rxPos = 0;
+            m_rxRssi = m_airRssi;
+            m_rxSnr = m_airSnr;
+            if (m_onReceive != nullptr)
+                m_onReceive(m_rxLength);
+        }
+    }
+}
+
+unsigned long LRTPUdpRadio::pollDeadline() {
+    // the next pending end of a transmission, CAD round or frame on air
+    unsigned long t = micros();
+    unsigned long deadline = LRTP_NO_DEADLINE;
+    if (m_mode == Mode::TRANSMIT)
+        deadline = min(deadline, timeUntil(m_txEnd, t));
+    if (m_mode == Mode::CAD)
+        deadline = min(deadline, timeUntil(m_cadEnd, t));
+    if (m_airPending)
+        deadline = min(deadline, timeUntil(m_airEnd, t));
+    return deadline;
+}
+
+int LRTPUdpRadio::packetRssi() {
+    return m_rxRssi;
+}
+
+float LRTPUdpRadio::packetSnr() {
+    return m_rxSnr;
+}
+
+void LRTPUdpRadio::setPathLoss(uint8_t loss) {
+    m_pathLoss = loss;
+}
+
+int LRTPUdpRadio::getEventFd() {
+    return m_rxSocket;
+}
+
+unsigned long LRTPUdpRadio::cadDuration() const {
+    // a CAD round takes roughly two symbols
+    return 2 * lrtpSymbolTime(m_config.spreadingFactor, m_config.signalBandwidth);
+}
+
+bool LRTPUdpRadio::channelBusy(unsigned long t) const {
+    return timeDiff(m_channelBusyUntil, t) > 0;
+}
+
+void LRTPUdpRadio::handleDatagram(const uint8_t *buf, size_t len, unsigned long t) {
+    if (len < LRTP_UDP_HEADER_SZ || buf[0] != LRTP_UDP_MAGIC_0 || buf[1] != LRTP_UDP_MAGIC_1)
+        return;
+    // frames on a different channel are not heard at all
+    if ((long)readU32(buf + 2) != m_config.frequency || buf[6] != m_config.spreadingFactor || (long)readU32(buf + 7) != m_config.signalBandwidth)
+        return;
+    unsigned long frameEnd = t + readU32(buf + 11);
+    // thermal noise over the bandwidth, and the signal after the path loss
+    int rssi = (int8_t)buf[15] - buf[16] - m_pathLoss;
+    float snr = rssi - (-174 + 10 * log10f(m_config.signalBandwidth) + LRTP_UDP_NOISE_FIGURE);
+    const uint8_t *frame = buf + LRTP_UDP_HEADER_SZ;
+    size_t frameLength = len - LRTP_UDP_HEADER_SZ;
+
+    if (m_mode == Mode::CAD)
+        m_cadBusy = true;
+
+    if (m_airPending && timeDiff(m_airEnd, t) > 0) {
+        // overlaps with a frame already on air: both are lost
+        m_airCorrupt = true;
+        if (timeDiff(frameEnd, m_airEnd) > 0)
+            m_airEnd = frameEnd;
+    } else if ((m_mode == Mode::RECEIVE || m_mode == Mode::CAD) && snr >= lrtpRequiredSnr(m_config.spreadingFactor)) {
+        memcpy(m_airBuffer, frame, frameLength);
+        m_airRssi = rssi;
+        m_airSnr = snr;
+        m_airLength = frameLength;
+        m_airEnd = frameEnd;
+        m_airPending = true;
+        m_airCorrupt = false;
+    }
+    if (timeDiff(frameEnd, m_channelBusyUntil) > 0)
+        m_channelBusyUntil = frameEnd;
+}
+
+#endif
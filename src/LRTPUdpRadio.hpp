@@ -0,0 +1,116 @@
+#pragma once
+#include <Arduino.h>
+#include "LRTPConstants.hpp"
+#include "LRTPRadio.hpp"
+
+#if LRTP_RADIO_UDP
+
+/**
+ * @brief LRTPRadio backend that simulates a shared LoRa channel ("ether")
+ * using UDP multicast.
+ *
+ * Every frame is sent as a single datagram to a multicast group, tagged with
+ * the sender's channel (frequency, spreading factor, bandwidth) and its time on
+ * air. Receivers on the same channel see the channel as busy for the frame's
+ * airtime and only deliver it once the airtime has elapsed. Frames which
+ * overlap at a receiver collide and are both lost, and a node which is
+ * transmitting cannot receive. Channel activity detection reports whether any
+ * frame was on air during the CAD period.
+ *
+ * Signal strength is simulated from the sender's transmit power and the path
+ * loss of both nodes (see setPathLoss()). Frames received below the
+ * demodulation floor of their spreading factor are lost.
+ *
+ * This allows several LRTP processes on one machine to run the protocol at
+ * simulated LoRa rates without any radio hardware. The backend is not
+ * interrupt driven: events are processed in poll(), called from LRTP::loop().
+ */
+class LRTPUdpRadio : public LRTPRadio {
+  public:
+    LRTPUdpRadio(const LRTPRadioConfig &config,
+        const char *groupAddr = LRTP_UDP_GROUP_ADDR,
+        uint16_t port = LRTP_UDP_PORT,
+        const char *ifaceAddr = LRTP_UDP_IFACE_ADDR);
+    ~LRTPUdpRadio();
+
+    int begin() override;
+    void end();
+
+    void receive() override;
+    void channelActivityDetection() override;
+    bool rxSignalDetected() override;
+
+    int beginPacket() override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int endPacket(bool async) override;
+
+    int available() override;
+    int read() override;
+    size_t readBytes(uint8_t *buf, size_t len) override;
+
+    void poll() override;
+    unsigned long pollDeadline() override;
+    int getEventFd() override;
+
+    int packetRssi() override;
+    float packetSnr() override;
+
+    /**
+     * @brief Set this node's share of the simulated path loss. The loss of a
+     * link is the sum of both nodes' shares
+     *
+     * @param loss the loss in dB
+     */
+    void setPathLoss(uint8_t loss);
+
+    // the duration of one channel activity detection round in microseconds
+    unsigned long cadDuration() const;
+
+  private:
+    enum class Mode { IDLE, RECEIVE, CAD, TRANSMIT };
+
+    const char *m_groupAddr;
+    uint16_t m_port;
+    const char *m_ifaceAddr;
+
+    // socket bound to the multicast group, and socket used to send frames
+    int m_rxSocket = -1;
+    int m_txSocket = -1;
+    // local port of the transmit socket, used to ignore our own datagrams
+    uint16_t m_txPort = 0;
+
+    Mode m_mode = Mode::IDLE;
+
+    // frame currently being transmitted
+    uint8_t m_txBuffer[LRTP_MAX_PACKET];
+    size_t m_txLength = 0;
+    unsigned long m_txEnd = 0;
+
+    // frame currently on air as seen by this node
+    uint8_t m_airBuffer[LRTP_MAX_PACKET];
+    size_t m_airLength = 0;
+    unsigned long m_airEnd = 0;
+    bool m_airPending = false;
+    bool m_airCorrupt = false;
+    int m_airRssi = 0;
+    float m_airSnr = 0;
+    // end of the last frame heard on the channel (received or not)
+    unsigned long m_channelBusyUntil = 0;
+
+    // last frame delivered through onReceive, read with read()
+    uint8_t m_rxBuffer[LRTP_MAX_PACKET];
+    size_t m_rxLength = 0;
+    size_t m_rxPos = 0;
+    int m_rxRssi = 0;
+    float m_rxSnr = 0;
+
+    uint8_t m_pathLoss = 0;
+
+    unsigned long m_cadEnd = 0;
+    bool m_cadBusy = false;
+
+    bool channelBusy(unsigned long t) const;
+    void handleDatagram(const uint8_t *buf, size_t len, unsigned long t);
+};
+
+#endif